@@ -11,6 +11,12 @@
 #include <cstdint>
 #include <algorithm>
 #include <string>
+#include <new>
+#include <memory>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 namespace hpce{
 	
@@ -21,6 +27,67 @@ namespace hpce{
 		Cell_Insulator	=0x2	//! Indicates heat does not flow across this cell (it is non conductive
 	}cell_flags_t;
 	
+	//! Allocator returning page aligned storage
+	/*! World arrays are allocated with this so that OpenCL runtimes can use them
+		in place (CL_MEM_USE_HOST_PTR) rather than copying them. */
+	template<class T>
+	struct aligned_allocator
+	{
+		typedef T value_type;
+		
+		static const size_t alignment = 4096;
+		
+		aligned_allocator()
+		{}
+		
+		template<class U>
+		aligned_allocator(const aligned_allocator<U> &)
+		{}
+		
+		template<class U>
+		struct rebind
+		{ typedef aligned_allocator<U> other; };
+		
+		T *allocate(size_t n)
+		{
+			// Round up to whole pages, as some runtimes also want the size aligned
+			size_t cb=((n*sizeof(T)+alignment-1)/alignment)*alignment;
+#ifdef _WIN32
+			void *p=_aligned_malloc(cb?cb:alignment, alignment);
+			if(p==0)
+				throw std::bad_alloc();
+#else
+			void *p=0;
+			if(posix_memalign(&p, alignment, cb?cb:alignment))
+				throw std::bad_alloc();
+#endif
+			return (T*)p;
+		}
+		
+		void deallocate(T *p, size_t)
+		{
+#ifdef _WIN32
+			_aligned_free(p);
+#else
+			free(p);
+#endif
+		}
+	};
+	
+	template<class T>
+	const size_t aligned_allocator<T>::alignment;
+	
+	template<class T, class U>
+	bool operator==(const aligned_allocator<T> &, const aligned_allocator<U> &)
+	{ return true; }
+	
+	template<class T, class U>
+	bool operator!=(const aligned_allocator<T> &, const aligned_allocator<U> &)
+	{ return false; }
+	
+	typedef std::vector<cell_flags_t,aligned_allocator<cell_flags_t> > properties_vector_t;
+	typedef std::vector<float,aligned_allocator<float> > state_vector_t;
+	
 	//! Captures the description of a world, and it's current state
 	struct world_t
 	{
@@ -28,11 +95,11 @@ namespace hpce{
 		unsigned w;	//! Number of cells across
 		unsigned h;	//! Number of cells down
 		float alpha;	//! Amount of heat that leaks to/from adjacent conductive cells
-		std::vector<cell_flags_t> properties;	//! Fixed properties of each cell
+		properties_vector_t properties;	//! Fixed properties of each cell
 		
 		// Dynamic properties of the world
 		float t;	//! Current world time
-		std::vector<float> state;		//! Dynamic state of the world
+		state_vector_t state;		//! Dynamic state of the world
 	};
 	
 	//! Create a square world with a standardised "slalom track"
@@ -43,19 +110,198 @@ namespace hpce{
 	void SaveWorld(std::ostream &dst, const world_t &world, bool binary=false);
 	
 	//! Read a world from a file
+	/*! Reads the text and binary formats, chunked worlds (see SaveWorldChunked)
+		and streamed ones (see WorldStreamWriter)
+	*/
 	world_t LoadWorld(std::istream &src);
+	//! For a caller that has already read the first word of the header
+	world_t LoadWorld(std::istream &src, const std::string &header);
+	
+	//! Save a world to a named file, or "-" for stdout
+	/*! Binary worlds are written in blocks by every thread with pwrite, and
+		come out byte for byte as SaveWorld would write them.
+		\param direct Open with O_DIRECT, so big checkpoints bypass the page cache
+	*/
+	void SaveWorldFile(const std::string &fileName, const world_t &world, bool binary=false, bool direct=false);
+	
+	//! Read a world from a named file, or "-" for stdin
+	/*! Binary worlds are read in blocks of rows by every thread with pread,
+		and each block is checked as it arrives. Other formats go through
+		LoadWorld.
+		\param direct Open with O_DIRECT, see SaveWorldFile
+	*/
+	world_t LoadWorldFile(const std::string &fileName, bool direct=false);
+	
+	//! Reads a world one row at a time, in the order the file holds them
+	/*! A file has every row of properties and then every row of state, so
+		a reader gives h readPropertiesRow, then h readStateRow, then finish.
+		Only the rows the caller passes in are ever held, so worlds bigger
+		than memory can be read. LoadWorld is built on this.
+	*/
+	class WorldReader
+	{
+	public:
+		//! Reads the header, leaving src at the first row of properties
+		WorldReader(std::istream &src);
+		//! For a caller that has already read the first word of the header
+		WorldReader(std::istream &src, const std::string &header);
+		
+		unsigned width() const
+		{ return m_w; }
+		unsigned height() const
+		{ return m_h; }
+		float alpha() const
+		{ return m_alpha; }
+		bool binary() const
+		{ return m_binary; }
+		
+		//! Reads the next row of properties, width() cells
+		void readPropertiesRow(cell_flags_t *row);
+		//! Reads past the remaining rows of properties without keeping them
+		void skipProperties();
+		//! Reads the next row of state, once all the properties are read
+		void readStateRow(float *row);
+		//! Checks the End that follows the last row of state
+		void finish();
+	private:
+		void readHeader(const std::string &header);
+		void readStateHyphen();
+		
+		std::istream &m_src;
+		unsigned m_w, m_h;
+		float m_alpha;
+		bool m_binary;
+		unsigned m_propertiesRows, m_stateRows;	// read so far
+	};
 	
-	//! Render the world as a bitmap to the specified file
+	//! Writes a world one row at a time, in the same order WorldReader reads it
+	/*! SaveWorld is built on this, so the output is byte for byte the same */
+	class WorldWriter
+	{
+	public:
+		//! Writes the header
+		WorldWriter(std::ostream &dst, unsigned w, unsigned h, float alpha, bool binary=false);
+		
+		void writePropertiesRow(const cell_flags_t *row);
+		//! Writes the next row of state, once all the properties are written
+		void writeStateRow(const float *row);
+		//! Writes the End after the last row of state
+		void finish();
+	private:
+		void startState();
+		
+		std::ostream &m_dst;
+		unsigned m_w, m_h;
+		bool m_binary;
+		unsigned m_propertiesRows, m_stateRows;	// written so far
+		bool m_stateStarted;	// the hyphen is out and m_fmt holds the stream's formatting
+		std::ios m_fmt;	// the stream's formatting, put back by finish
+	};
+	
+	//! Gives each row of properties together with the same row of state
+	/*! For consumers like RenderWorld, that need both for a row at once.
+		A file given by name is opened twice, one cursor on each section, so
+		memory is O(w). stdin can't be read twice, so from there the
+		properties are kept, at one byte a cell, until their state arrives.
+	*/
+	class WorldRowReader
+	{
+	public:
+		//! \param fileName Either the name of the file, or "-" for stdin
+		WorldRowReader(const std::string &fileName);
+		//! Reads a stream like stdin, whose first word the caller has already read
+		WorldRowReader(std::istream &src, const std::string &header);
+		~WorldRowReader();
+		
+		unsigned width() const
+		{ return m_state->width(); }
+		unsigned height() const
+		{ return m_state->height(); }
+		float alpha() const
+		{ return m_state->alpha(); }
+		
+		//! Moves on to the next row, false once there are no more
+		bool next();
+		
+		//! Index of the current row
+		unsigned row() const
+		{ return m_rowsRead-1; }
+		const cell_flags_t *properties() const
+		{ return &m_propertiesRow[0]; }
+		const float *state() const
+		{ return &m_stateRow[0]; }
+	private:
+		WorldRowReader(const WorldRowReader &); // = delete
+		WorldRowReader &operator=(const WorldRowReader &); // = delete
+		
+		void bufferProperties();
+		
+		std::unique_ptr<std::istream> m_propertiesFile, m_stateFile;
+		std::unique_ptr<WorldReader> m_properties;	// only when reading a file
+		std::unique_ptr<WorldReader> m_state;
+		std::vector<uint8_t> m_buffered;	// every row of properties, when reading stdin
+		unsigned m_rowsRead;
+		properties_vector_t m_propertiesRow;
+		state_vector_t m_stateRow;
+	};
+	
+	//! Render the world as an image to the specified file
 	/*! \param fileName Either the name of the file, or "-" for stdout
+		\note A name ending in .png or .qoi gives that format, anything else
+			a 24 bit bitmap, see MakeImageEncoder
 	*/
 	void RenderWorld(const std::string &fileName, const world_t &world);
 	
+	//! Render a world as it is read, one row at a time
+	/*! \param fileName Either the name of the file, or "-" for stdout
+		\note PNG and QOI start with the top row, which is read last, so for
+			them the world is read whole before it is drawn
+	*/
+	void RenderWorld(const std::string &fileName, WorldRowReader &src);
+	
 	//! Reference world stepping program
 	/*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 		\param n Number of times to step
 		\note Total change in world time will be dt*n
 	*/
 	void StepWorld(world_t &world, float dt, unsigned n);
+	
+	//! Summary of how far apart two worlds are, see CompareWorlds
+	struct world_diff_t
+	{
+		bool sameShape;	//! Same w and h, if not nothing else is compared
+		bool sameAlpha;
+		unsigned propertiesMismatched;	//! Cells whose properties differ, which should always be zero
+		
+		double maxAbs;	//! Largest absolute difference in state
+		uint32_t maxUlp;	//! Largest difference in units in the last place
+		double rms;	//! Root mean square difference over all cells
+		unsigned worstX, worstY;	//! Cell with the largest absolute difference
+		float worstA, worstB;	//! State of that cell in each world
+		
+		unsigned cellsOutside;	//! Cells outside both the absolute and the ULP tolerance
+	};
+	
+	//! Compares the state of two worlds cell by cell
+	/*! \param absTolerance Largest absolute difference a cell may have
+		\param ulpTolerance Largest difference in ULPs a cell may have
+		\note A cell only counts against the tolerance if it is outside
+			both of them, so zero for either makes the other one decide.
+	*/
+	world_diff_t CompareWorlds(const world_t &a, const world_t &b, double absTolerance=0, uint32_t ulpTolerance=0);
+	
+	//! A 64-bit hash of the width, height and properties of a world
+	/*! Worlds that share a geometry share a hash, whatever their alpha, t or
+		state, so derived data can be keyed on it. It is fast rather than
+		cryptographic, four multiply-xor lanes over the flags.
+	*/
+	uint64_t GeometryHash(const world_t &world);
+	
+	//! True if the worlds have the same geometry and every cell is within tolerance
+	inline bool WithinTolerance(const world_diff_t &diff)
+	{
+		return diff.sameShape && diff.sameAlpha && diff.propertiesMismatched==0 && diff.cellsOutside==0;
+	}
 };
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef hpce_heat_artefact_cache_hpp
+#define hpce_heat_artefact_cache_hpp
+
+#include "heat.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace hpce{
+
+	//! Bytes derived from a geometry alone, such as per cell neighbour masks
+	/*! Either mapped read-only from the cache, or built in memory when the
+		cache is off or couldn't be written. The bytes start 64-byte aligned
+		and stay valid for the lifetime of the artefact.
+	*/
+	class GeometryArtefact
+	{
+	public:
+		GeometryArtefact();
+		GeometryArtefact(GeometryArtefact &&o);
+		GeometryArtefact &operator=(GeometryArtefact &&o);
+		~GeometryArtefact();
+
+		const uint8_t *data() const
+		{ return m_data; }
+
+		size_t size() const
+		{ return m_size; }
+
+		//! True if the bytes came from the cache rather than being built
+		bool cached() const
+		{ return m_map!=0; }
+	private:
+		GeometryArtefact(const GeometryArtefact &); // = delete
+		GeometryArtefact &operator=(const GeometryArtefact &); // = delete
+
+		friend GeometryArtefact GetGeometryArtefact(const world_t &, const char *, unsigned, size_t, const std::function<void(uint8_t*)> &);
+
+		void release();
+
+		void *m_map;	// the whole mapped file, header included
+		size_t m_mapSize;
+		std::vector<uint8_t,aligned_allocator<uint8_t> > m_built;
+		const uint8_t *m_data;
+		size_t m_size;
+	};
+
+	//! Directory the artefacts are kept in, empty if the cache is off
+	/*! Taken from HPCE_CACHE_DIR. The cache is off unless it is set, and
+		setting it to "off" or to nothing turns it off too.
+	*/
+	std::string ArtefactCacheDir();
+
+	//! Bytes the cache directory may hold, 0 for no limit
+	/*! Taken from HPCE_CACHE_MAX_MB, default 1024. After each store the
+		least recently used artefacts are deleted until the rest fit.
+	*/
+	uint64_t ArtefactCacheLimit();
+
+	//! The artefact called name of the geometry of world, from the cache if it is there
+	/*! The file is keyed on GeometryHash, w, h, name and version, so worlds
+		sharing a geometry share the artefact whatever their state or alpha.
+		On a miss build is called to fill bytes bytes, and the result is
+		written to a temporary file that is renamed into place, so readers
+		only ever see whole artefacts and concurrent builders don't clash.
+		A cache that can't be written is reported once and then ignored.
+		Each file carries a checksum of its payload, and one whose payload
+		doesn't match is built again rather than mapped.
+		\param version Bump it whenever build changes what it produces
+		\note The key is a 64-bit hash rather than the geometry itself, so
+			two different geometries sharing a hash, w and h would share
+			an artefact.
+	*/
+	GeometryArtefact GetGeometryArtefact(const world_t &world, const char *name, unsigned version,
+		size_t bytes, const std::function<void(uint8_t *dst)> &build);
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef hpce_heat_checkpoint_hpp
+#define hpce_heat_checkpoint_hpp
+
+#include "heat.hpp"
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace hpce{
+
+	//! Atomically replace fileName with the world, the step it is at and dt
+	/*! A line holding step, t and dt goes in front of a binary world, which
+		is written by SaveWorldFile's threads to fileName.tmp, synced and then
+		renamed over fileName, so a crash leaves the previous checkpoint.
+		\param direct Write with O_DIRECT, see SaveWorldFile
+	*/
+	void SaveCheckpoint(const std::string &fileName, const world_t &world, uint64_t step, float dt, bool direct=false);
+
+	//! Read a checkpoint, including world.t
+	/*! \returns false if there is no checkpoint file
+		\throws std::invalid_argument if the file isn't a checkpoint
+	*/
+	bool LoadCheckpoint(const std::string &fileName, world_t &world, uint64_t &step, float &dt, bool direct=false);
+
+	//! Takes checkpoints of a long run every so many steps or seconds
+	/*! The caller steps in the chunks that nextChunk gives and calls update
+		after each. When a checkpoint is due the world is copied and written
+		in the background, so stepping carries on while it is written. Step
+		checkpoints keep to a fixed schedule, every everySteps after the
+		start, and if the last one is still being written when the next is
+		due, update waits for it rather than moving the checkpoint.
+		\note Each chunk is its own engine.step call, and the OpenCL engines
+			create their context, program and buffers in every call, so the
+			interval should be long compared with that setup.
+	*/
+	class Checkpointer
+	{
+	public:
+		/*! \param step Where the run starts, non-zero when resumed
+			\param everySteps,everySeconds Zero to not checkpoint on that
+		*/
+		Checkpointer(const std::string &fileName, float dt, uint64_t step, uint64_t everySteps, double everySeconds, bool direct=false);
+		//! Waits for any checkpoint being written, but drops its errors
+		~Checkpointer();
+
+		//! Steps to take before the next update, at most remaining
+		/*! Chunks end at the next step count due. For a time interval they
+			are sized from how fast the steps went so far, starting from one
+			step and at most doubling each chunk until the rate is known
+			from chunks long enough to hide the setup of a call.
+		*/
+		unsigned nextChunk(uint64_t step, uint64_t remaining) const;
+
+		//! Starts a checkpoint of the world at step if one is due
+		void update(const world_t &world, uint64_t step);
+
+		//! Waits for the last checkpoint, and rethrows any error writing it
+		void finish();
+	private:
+		Checkpointer(const Checkpointer &); // = delete
+		Checkpointer &operator=(const Checkpointer &); // = delete
+
+		std::string m_fileName;
+		float m_dt;
+		uint64_t m_everySteps;
+		double m_everySeconds;
+		bool m_direct;
+
+		uint64_t m_nextStep;	// of the next checkpoint due by steps
+		std::chrono::steady_clock::time_point m_lastTime;	// of the last checkpoint started
+		uint64_t m_chunkStep;	// where the last chunk started, to time it
+		std::chrono::steady_clock::time_point m_chunkTime;
+		uint64_t m_longestChunk;	// in steps, bounds the next time sized one
+		double m_secondsPerStep;	// 0 until one chunk has been timed
+		std::future<void> m_pending;
+	};
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef hpce_heat_chunked_hpp
+#define hpce_heat_chunked_hpp
+
+#include "heat.hpp"
+
+#include <string>
+#include <iostream>
+#include <vector>
+
+namespace hpce{
+
+	//! First word of a chunked world, LoadWorld reads either format
+	extern const char *ChunkedWorldHeader;
+
+	//! Save a world as square tiles that are each compressed on their own
+	/*! The file is a header, the compressed size of every tile, the tiles
+		in row-major order, then End. Each tile holds its properties as runs
+		and its state as the difference of each float's bits from the cell
+		before it, with runs of zeros collapsed, so uniform regions cost a
+		few bytes a tile and the round trip is exact. Tiles are compressed
+		in parallel.
+		\param tileSize Cells along each side of a tile, edge tiles are cut short
+	*/
+	void SaveWorldChunked(std::ostream &dst, const world_t &world, unsigned tileSize=64);
+
+	//! Reads a chunked world, either whole or one tile at a time
+	/*! The index of tile sizes is read up front, so on a seekable stream
+		any tile can be read without touching the others.
+	*/
+	class ChunkedWorldReader
+	{
+	public:
+		//! Reads the header and the index
+		ChunkedWorldReader(std::istream &src);
+		//! For a caller that has already read the first word of the header
+		ChunkedWorldReader(std::istream &src, const std::string &header);
+
+		unsigned width() const
+		{ return m_w; }
+		unsigned height() const
+		{ return m_h; }
+		float alpha() const
+		{ return m_alpha; }
+		unsigned tileSize() const
+		{ return m_tileSize; }
+		unsigned tilesAcross() const
+		{ return m_tilesAcross; }
+		unsigned tilesDown() const
+		{ return m_tilesDown; }
+		//! Bytes the compressed tile takes in the file
+		uint32_t tileBytes(unsigned tx, unsigned ty) const
+		{ return m_sizes[ty*m_tilesAcross+tx]; }
+
+		//! Reads and decompresses one tile, the stream must be seekable
+		/*! \param properties,state Tile sized, row-major with tileSize()
+				cells per row whether or not the tile is cut short
+		*/
+		void readTile(unsigned tx, unsigned ty, cell_flags_t *properties, float *state);
+
+		//! Reads every tile in order and checks the End, needs no seeking
+		world_t readWorld();
+	private:
+		void readHeader(const std::string &header);
+
+		std::istream &m_src;
+		unsigned m_w, m_h;
+		float m_alpha;
+		unsigned m_tileSize, m_tilesAcross, m_tilesDown;
+		std::vector<uint32_t> m_sizes;	// compressed bytes of each tile
+		std::vector<uint64_t> m_offsets;	// of each tile from the first, plus the end
+		std::streamoff m_dataStart;	// -1 if the stream can't tell
+	};
+
+	//! Read a world saved by SaveWorldChunked
+	world_t LoadWorldChunked(std::istream &src);
+};
+
+#endif
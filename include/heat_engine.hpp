@@ -0,0 +1,53 @@
+#ifndef hpce_heat_engine_hpp
+#define hpce_heat_engine_hpp
+
+#include "heat.hpp"
+
+#include <vector>
+#include <string>
+
+namespace hpce{
+
+	//! Signature shared by every implementation of StepWorld
+	typedef void (*step_world_func_t)(world_t &world, float dt, unsigned n);
+
+	//! Steps every world of a batch n times by its own dt
+	typedef void (*step_batch_func_t)(std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n);
+
+	//! A named world stepping implementation, chosen at run time
+	struct engine_t
+	{
+		const char *name;	//! Used with --engine=<name> and HPCE_ENGINE
+		const char *description;	//! One line summary for --list-engines
+		step_world_func_t step;	//! Same contract as StepWorld
+		step_batch_func_t stepBatch;	//! Steps many worlds in one go, 0 if the engine can't
+		double bytesPerCell;	//! Compulsory memory traffic of one cell update, 0 if unknown
+		double flopsPerCell;	//! Floating point operations of one cell update, 0 if unknown
+	};
+
+	//! Arithmetic intensity of an engine in flops per byte, 0 if unknown
+	inline double ArithmeticIntensity(const engine_t &engine)
+	{
+		return engine.bytesPerCell>0 ? engine.flopsPerCell/engine.bytesPerCell : 0;
+	}
+
+	//! Every engine linked into this binary, the reference first
+	/*! The table lives next to the engines themselves, so adding an engine
+		means adding one entry there. */
+	const std::vector<engine_t> &Engines();
+
+	//! Steps a batch of worlds, for sweeps over alpha, dt or geometry
+	/*! Engines with a stepBatch get the whole batch, so setup is paid once.
+		The rest have whole worlds handed out to ParallelThreads() threads,
+		which suits the CPU engines.
+		\param dts One dt per world, or a single dt for all of them
+		\throws std::invalid_argument if dts doesn't match the worlds
+	*/
+	void StepWorlds(const engine_t &engine, std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n);
+
+	//! Looks an engine up by name
+	/*! \throws std::invalid_argument naming the known engines if there is no match */
+	const engine_t &FindEngine(const std::string &name);
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef hpce_heat_image_hpp
+#define hpce_heat_image_hpp
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace hpce{
+
+	//! Turns the rows RenderWorld draws into an image file
+	/*! RenderWorld draws each row into rowBytes() bytes, with the pixels
+		starting pixelOffset() bytes in as BGR or RGB, and the rest of the
+		row zero. It hands them over a block of rows at a time, in order.
+	*/
+	class ImageEncoder
+	{
+	public:
+		virtual ~ImageEncoder()
+		{}
+
+		size_t rowBytes() const
+		{ return m_rowBytes; }
+		size_t pixelOffset() const
+		{ return m_pixelOffset; }
+		bool bgr() const
+		{ return m_bgr; }
+		//! True if the first row of the file is the top of the image
+		/*! A bitmap's first row is its bottom one, so RenderWorld hands it
+			row 0 of the world first. Top down formats are handed row h-1
+			first instead, so every format shows row 0 at the bottom.
+		*/
+		bool topDown() const
+		{ return m_topDown; }
+
+		//! Bytes before the first row
+		virtual std::string header()=0;
+
+		//! Encodes a block of rows into pieces, which are written in order
+		/*! \returns false if the block is to be written just as it was drawn */
+		virtual bool encode(const uint8_t *block, unsigned rows, std::vector<std::string> &pieces)=0;
+
+		//! Bytes after the last row
+		virtual std::string trailer()=0;
+	protected:
+		ImageEncoder(unsigned w, unsigned h, size_t rowBytes, size_t pixelOffset, bool bgr, bool topDown)
+			: m_w(w), m_h(h), m_rowBytes(rowBytes), m_pixelOffset(pixelOffset), m_bgr(bgr), m_topDown(topDown)
+		{}
+
+		unsigned m_w, m_h;
+		size_t m_rowBytes, m_pixelOffset;
+		bool m_bgr, m_topDown;
+	};
+
+	//! The encoder for the format the extension of fileName names
+	/*! ".png" and ".qoi", in either case, give those formats, and anything
+		else, including "-" for stdout, a 24 bit bitmap. All of them show row
+		0 of the world at the bottom, as the bitmap always has. Both
+		compressed formats are encoded in strips of rows
+		in parallel, and give the same bytes whatever the number of threads.
+		HPCE_PNG_DEFLATE=stored writes PNG data uncompressed, the default
+		"fast" finds repeats of the pixel to the left or above.
+	*/
+	std::unique_ptr<ImageEncoder> MakeImageEncoder(const std::string &fileName, unsigned w, unsigned h);
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef hpce_heat_out_of_core_hpp
+#define hpce_heat_out_of_core_hpp
+
+#include "heat.hpp"
+
+#include <string>
+#include <iostream>
+
+namespace hpce{
+
+	//! How the out-of-core engine uses memory and disk
+	struct out_of_core_options_t
+	{
+		std::string scratchDir;	//! Where the working files go, they are unlinked as soon as they are open
+		size_t memoryBudget;	//! Bytes of slabs and buffers to stay within
+		unsigned blockSteps;	//! Steps taken per pass over the files, so each slab is read once per blockSteps steps
+
+		//! Reads HPCE_OOC_DIR (default $TMPDIR or /tmp), HPCE_OOC_MEMORY_MB (default 1024)
+		//! and HPCE_OOC_BLOCK_STEPS (default 8)
+		static out_of_core_options_t FromEnvironment();
+	};
+
+	//! Steps a world from src to dst without ever holding all of it
+	/*! The world is read a row at a time into scratch files: one byte per
+		cell for the geometry and two state files that alternate between
+		passes. Each pass takes blockSteps steps, a horizontal slab at a
+		time, with blockSteps rows of halo either side, and reads the next
+		slab and writes the last one while the current one is stepped.
+		The result is written to dst a row at a time, and matches StepWorld
+		bit for bit.
+		\param binary Format of the world written to dst
+		\throws std::invalid_argument if a cell on the edge of the world is
+			neither fixed nor an insulator, which StepWorld assumes too
+	*/
+	void StepStreamOutOfCore(std::istream &src, std::ostream &dst, float dt, unsigned n, bool binary, const out_of_core_options_t &options);
+};
+
+#endif
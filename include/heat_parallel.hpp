@@ -0,0 +1,204 @@
+#ifndef hpce_heat_parallel_hpp
+#define hpce_heat_parallel_hpp
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <cstdlib>
+
+#include "heat_trace.hpp"
+
+namespace hpce{
+
+	//! Number of threads used by the parallel loops
+	/*! Taken from HPCE_THREADS if set, otherwise the hardware concurrency */
+	inline unsigned ParallelThreads()
+	{
+		const char *v=getenv("HPCE_THREADS");
+		if(v && atoi(v)>0)
+			return atoi(v);
+		unsigned n=std::thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+
+	//! True while the calling thread runs a chunk of a ParallelForRange
+	inline bool &InParallelLoop()
+	{
+		static thread_local bool inside=false;
+		return inside;
+	}
+
+	namespace detail{
+		//! Marks the thread as inside a parallel loop for its lifetime
+		class ParallelScope
+		{
+		public:
+			ParallelScope()
+				: m_old(InParallelLoop())
+			{ InParallelLoop()=true; }
+
+			~ParallelScope()
+			{ InParallelLoop()=m_old; }
+		private:
+			bool m_old;
+		};
+
+		//! Holds threads until all of them have arrived
+		class StepBarrier
+		{
+		public:
+			StepBarrier(unsigned count)
+				: m_count(count)
+				, m_waiting(0)
+				, m_generation(0)
+			{}
+
+			//! Blocks until count threads have called it, the last one
+			//! runs last() before any of them is released
+			template<class F>
+			void wait(F last)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				unsigned generation=m_generation;
+				if(++m_waiting==m_count){
+					last();
+					m_waiting=0;
+					m_generation++;
+					m_released.notify_all();
+				}else{
+					m_released.wait(lock, [&](){ return m_generation!=generation; });
+				}
+			}
+		private:
+			std::mutex m_mutex;
+			std::condition_variable m_released;
+			unsigned m_count, m_waiting, m_generation;
+		};
+	};
+
+	//! Splits [begin,end) into one contiguous chunk per thread
+	/*! \param f Called as f(chunkBegin, chunkEnd) for each chunk
+		\param grain Smallest chunk worth giving its own thread
+		\note The calling thread takes the first chunk. Any exception thrown
+			by f is re-thrown once all chunks have finished. When the range
+			is split, each chunk is a "parallel_chunk" trace span on its
+			thread. Loops nested inside a chunk run serially, so stepping
+			whole worlds on threads doesn't also split each world.
+	*/
+	template<class F>
+	void ParallelForRange(unsigned begin, unsigned end, F f, unsigned grain=1)
+	{
+		if(end<=begin)
+			return;
+		unsigned total=end-begin;
+		unsigned chunks=std::min(ParallelThreads(), std::max(1u, total/std::max(1u,grain)));
+		if(chunks<=1 || InParallelLoop()){
+			f(begin, end);
+			return;
+		}
+
+		std::vector<std::exception_ptr> errors(chunks);
+		std::vector<std::thread> threads;
+		for(unsigned i=1;i<chunks;i++){
+			unsigned b=begin+(unsigned)((unsigned long long)total*i/chunks);
+			unsigned e=begin+(unsigned)((unsigned long long)total*(i+1)/chunks);
+			threads.push_back(std::thread([&f,&errors,i,b,e](){
+				try{
+					detail::ParallelScope scope;
+					HPCE_TRACE_SPAN("parallel_chunk");
+					f(b, e);
+				}catch(...){
+					errors[i]=std::current_exception();
+				}
+			}));
+		}
+		try{
+			detail::ParallelScope scope;
+			HPCE_TRACE_SPAN("parallel_chunk");
+			f(begin, begin+total/chunks);
+		}catch(...){
+			errors[0]=std::current_exception();
+		}
+		for(unsigned i=0;i<threads.size();i++){
+			threads[i].join();
+		}
+		for(unsigned i=0;i<chunks;i++){
+			if(errors[i])
+				std::rethrow_exception(errors[i]);
+		}
+	}
+
+	//! Runs steps passes over [begin,end), split as ParallelForRange splits it
+	/*! \param f Called as f(step, chunkBegin, chunkEnd) for each chunk
+		\param between Called as between(step) on one thread once every
+			chunk has finished that step, and before any starts the next
+		\note The threads are created once for all the steps rather than
+			once a step, and wait for each other at a barrier between
+			steps. After an exception every thread stops at the next
+			barrier, and the first one is re-thrown once they have all
+			finished.
+	*/
+	template<class F, class FBetween>
+	void ParallelForSteps(unsigned begin, unsigned end, unsigned steps, F f, FBetween between, unsigned grain=1)
+	{
+		unsigned total=end>begin ? end-begin : 0;
+		unsigned chunks=std::min(ParallelThreads(), std::max(1u, total/std::max(1u,grain)));
+		if(chunks<=1 || InParallelLoop()){
+			for(unsigned t=0;t<steps;t++){
+				f(t, begin, std::max(begin,end));
+				between(t);
+			}
+			return;
+		}
+
+		std::vector<std::exception_ptr> errors(chunks);
+		bool failed=false;	// only written by the last thread into the barrier
+		detail::StepBarrier barrier(chunks);
+		auto run=[&](unsigned i){
+			detail::ParallelScope scope;
+			HPCE_TRACE_SPAN("parallel_chunk");
+			unsigned b=begin+(unsigned)((unsigned long long)total*i/chunks);
+			unsigned e=begin+(unsigned)((unsigned long long)total*(i+1)/chunks);
+			for(unsigned t=0;t<steps;t++){
+				try{
+					f(t, b, e);
+				}catch(...){
+					errors[i]=std::current_exception();
+				}
+				barrier.wait([&](){
+					for(unsigned j=0;j<chunks;j++)
+						failed=failed || errors[j];
+					if(!failed){
+						try{
+							between(t);
+						}catch(...){
+							errors[i]=std::current_exception();
+							failed=true;
+						}
+					}
+				});
+				if(failed)
+					break;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for(unsigned i=1;i<chunks;i++){
+			threads.push_back(std::thread(run, i));
+		}
+		run(0);
+		for(unsigned i=0;i<threads.size();i++){
+			threads[i].join();
+		}
+		for(unsigned i=0;i<chunks;i++){
+			if(errors[i])
+				std::rethrow_exception(errors[i]);
+		}
+	}
+
+}; // namespace hpce
+
+#endif
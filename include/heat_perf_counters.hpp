@@ -0,0 +1,229 @@
+#ifndef hpce_heat_perf_counters_hpp
+#define hpce_heat_perf_counters_hpp
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace hpce{
+
+	//! Hardware performance counters around one phase, reported per cell update
+	/*! Switched on by HPCE_PERF_COUNTERS, which works like HPCE_CL_PROFILE:
+		- unset, empty or "0" : disabled
+		- "1", "-" or "stderr" : report is written to stderr
+		- anything else : name of the file the report is written to
+
+		The counters follow the calling thread and any thread it starts while
+		they run (perf "inherit"), so the threaded engines are covered. Only
+		user space is counted, and for the OpenCL engines that is just the
+		host side. Counters the kernel or VM refuses are left out of the
+		report rather than failing the run.
+
+		Extra raw (model specific) events can be added with HPCE_PERF_RAW as
+		name=config pairs, e.g. for vector utilisation on recent Intel cores
+		(FP_ARITH_INST_RETIRED):
+			HPCE_PERF_RAW=fp_scalar_single=0x02c7,fp_128b_packed_single=0x08c7,fp_256b_packed_single=0x20c7
+	*/
+	class PerfCounters
+	{
+	public:
+		PerfCounters()
+			: m_enabled(false)
+			, m_seconds(0)
+		{
+			const char *v=getenv("HPCE_PERF_COUNTERS");
+			if(!(v && *v && std::string(v)!="0"))
+				return;
+			m_enabled=true;
+			m_dest=v;
+#ifdef __linux__
+			add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+			add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+			add("cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+			add("cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+			add("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+			add("l1d_read_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+				| (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16));
+			add("llc_read_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+				| (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16));
+			add("task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+			add("page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+
+			const char *raw=getenv("HPCE_PERF_RAW");
+			std::stringstream src(raw ? raw : "");
+			std::string item;
+			while(std::getline(src, item, ',')){
+				std::string::size_type eq=item.find('=');
+				if(eq==std::string::npos)
+					throw std::invalid_argument("PerfCounters : HPCE_PERF_RAW entries must be name=config, got '"+item+"'.");
+				add(item.substr(0, eq), PERF_TYPE_RAW, strtoull(item.c_str()+eq+1, NULL, 0));
+			}
+#else
+			std::cerr<<"PerfCounters : Hardware counters need Linux perf_event_open, only timing is reported"<<std::endl;
+#endif
+		}
+
+		~PerfCounters()
+		{
+#ifdef __linux__
+			for(unsigned i=0;i<m_counters.size();i++){
+				close(m_counters[i].fd);
+			}
+#endif
+		}
+
+		bool enabled() const
+		{ return m_enabled; }
+
+		void start()
+		{
+			if(!m_enabled)
+				return;
+#ifdef __linux__
+			for(unsigned i=0;i<m_counters.size();i++){
+				ioctl(m_counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(m_counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+			m_start=std::chrono::steady_clock::now();
+		}
+
+		void stop()
+		{
+			if(!m_enabled)
+				return;
+			m_seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-m_start).count();
+#ifdef __linux__
+			for(unsigned i=0;i<m_counters.size();i++){
+				counter_t &c=m_counters[i];
+				ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+				uint64_t values[3]={0, 0, 0};	// value, time enabled, time running
+				if(read(c.fd, values, sizeof(values))!=(ssize_t)sizeof(values)){
+					c.value=-1;
+					continue;
+				}
+				// Scale up if the counter was multiplexed with others
+				c.value = values[2] ? (double)values[0]*values[1]/values[2] : -1;
+			}
+#endif
+		}
+
+		//! Writes the counters, raw and per cell update, as JSON
+		void report(const std::string &engine, double cellUpdates) const
+		{
+			if(!m_enabled)
+				return;
+			if(m_dest=="1" || m_dest=="-" || m_dest=="stderr"){
+				write(std::cerr, engine, cellUpdates);
+			}else{
+				std::ofstream dst(m_dest.c_str());
+				if(!dst.is_open())
+					throw std::runtime_error("PerfCounters : Couldn't open '"+m_dest+"' for the counter report.");
+				write(dst, engine, cellUpdates);
+			}
+		}
+
+	private:
+		struct counter_t
+		{
+			std::string name;
+			int fd;
+			double value;	// -1 if it couldn't be read
+		};
+
+#ifdef __linux__
+		void add(const std::string &name, uint32_t type, uint64_t config)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size=sizeof(attr);
+			attr.type=type;
+			attr.config=config;
+			attr.disabled=1;
+			attr.inherit=1;	// count threads started while enabled too
+			attr.exclude_kernel=1;
+			attr.exclude_hv=1;
+			attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			int fd=(int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if(fd<0){
+				std::cerr<<"PerfCounters : "<<name<<" is not available here ("<<strerror(errno)<<")"<<std::endl;
+				return;
+			}
+			counter_t c={name, fd, -1};
+			m_counters.push_back(c);
+		}
+#endif
+
+		double value(const std::string &name) const
+		{
+			for(unsigned i=0;i<m_counters.size();i++){
+				if(m_counters[i].name==name)
+					return m_counters[i].value;
+			}
+			return -1;
+		}
+
+		void write(std::ostream &dst, const std::string &engine, double cellUpdates) const
+		{
+			dst<<"{\n";
+			dst<<"  \"engine\": \""<<engine<<"\",\n";
+			dst<<"  \"cell_updates\": "<<cellUpdates<<",\n";
+			dst<<"  \"seconds\": "<<m_seconds<<",\n";
+			dst<<"  \"counters\": {";
+			unsigned n=0;
+			for(unsigned i=0;i<m_counters.size();i++){
+				if(m_counters[i].value<0)
+					continue;
+				dst<<(n++?",":"")<<"\n    \""<<m_counters[i].name<<"\": {\"total\": "<<(uint64_t)m_counters[i].value
+					<<", \"per_cell_update\": "<<(cellUpdates>0 ? m_counters[i].value/cellUpdates : 0)<<"}";
+			}
+			dst<<"\n  },\n";
+
+			// Derived figures, only where the counters behind them exist
+			dst<<"  \"derived\": {";
+			n=0;
+			double cycles=value("cycles"), instructions=value("instructions"), llcMisses=value("llc_read_misses");
+			if(llcMisses<0)
+				llcMisses=value("cache_misses");
+			if(cycles>0 && instructions>=0){
+				dst<<(n++?",":"")<<"\n    \"ipc\": "<<instructions/cycles;
+			}
+			if(llcMisses>=0 && cellUpdates>0){
+				// every miss in the last level cache is a 64 byte line from DRAM
+				dst<<(n++?",":"")<<"\n    \"dram_bytes_per_cell_update\": "<<64*llcMisses/cellUpdates;
+				if(m_seconds>0)
+					dst<<",\n    \"dram_gb_per_s\": "<<64*llcMisses/m_seconds/1e9;
+			}
+			if(cellUpdates>0 && m_seconds>0){
+				dst<<(n++?",":"")<<"\n    \"cell_updates_per_s\": "<<cellUpdates/m_seconds;
+			}
+			dst<<"\n  }\n";
+			dst<<"}"<<std::endl;
+		}
+
+		bool m_enabled;
+		std::string m_dest;
+		std::vector<counter_t> m_counters;
+		std::chrono::steady_clock::time_point m_start;
+		double m_seconds;
+	};
+
+}; // namespace hpce
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef hpce_heat_roofline_hpp
+#define hpce_heat_roofline_hpp
+
+#include "heat.hpp"
+#include "heat_parallel.hpp"
+
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+namespace hpce{
+
+	//! The two roofs of a roofline model, measured on this host
+	/*! An engine with arithmetic intensity I (flops per byte) can at best
+		reach min(flops, I*bandwidth) flops per second. Below the ridge point
+		flops/bandwidth it is memory bound, above it compute bound.
+
+		Both are measured with the same compiler flags as the engines and on
+		ParallelThreads() threads, so they are the limits the engines could
+		reach as built, not the data sheet figures. Worlds that fit in cache
+		can beat the bandwidth roof, which is for main memory.
+	*/
+	struct roofline_t
+	{
+		double bandwidth;	//! Bytes per second, STREAM triad
+		double flops;	//! Flops per second, independent multiply-adds
+
+		double attainable(double intensity) const
+		{ return std::min(flops, intensity*bandwidth); }
+
+		double ridge() const
+		{ return bandwidth>0 ? flops/bandwidth : 0; }
+	};
+
+	namespace detail{
+		inline double RooflineSeconds(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+		}
+	};
+
+	//! STREAM triad a[i]=b[i]+s*c[i], best of a few passes, in bytes per second
+	/*! \param elements Length of each array, big enough to spill out of the
+			last level cache (the default is 3x32MB)
+		\note Counts 12 bytes per element like STREAM, so the write-allocate
+			read of a is not included.
+	*/
+	inline double MeasureStreamBandwidth(unsigned elements=8u<<20, unsigned passes=5)
+	{
+		state_vector_t a(elements), b(elements), c(elements);
+		// Touch the pages from the threads that will use them
+		ParallelForRange(0, elements, [&](unsigned begin, unsigned end){
+			for(unsigned i=begin;i<end;i++){
+				a[i]=0;
+				b[i]=1;
+				c[i]=2;
+			}
+		});
+
+		const float s=0.5f;
+		double best=std::numeric_limits<double>::infinity();
+		for(unsigned p=0;p<passes;p++){
+			std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+			ParallelForRange(0, elements, [&](unsigned begin, unsigned end){
+				float *pa=&a[0];
+				const float *pb=&b[0], *pc=&c[0];
+				for(unsigned i=begin;i<end;i++){
+					pa[i]=pb[i]+s*pc[i];
+				}
+			});
+			best=std::min(best, detail::RooflineSeconds(start));
+		}
+		if(a[elements/2]!=2)	// keeps the passes from being optimised away
+			return 0;
+		return 3.0*sizeof(float)*elements/best;
+	}
+
+	//! Multiply-add throughput on registers only, in flops per second
+	/*! Each thread runs enough independent accumulator chains to hide the
+		latency of the adds, and the loop vectorises to whatever the build
+		targets, so the result is the peak for this binary.
+	*/
+	inline double MeasureFmaPeak(unsigned iterations=1u<<22, unsigned passes=3)
+	{
+		const unsigned Chains=32;
+		unsigned threads=ParallelThreads();
+		std::vector<float> sink(threads, 0);
+		double best=std::numeric_limits<double>::infinity();
+		for(unsigned p=0;p<passes;p++){
+			std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+			ParallelForRange(0, threads, [&](unsigned begin, unsigned end){
+				for(unsigned t=begin;t<end;t++){
+					float acc[Chains];
+					for(unsigned j=0;j<Chains;j++){
+						acc[j]=(float)j;
+					}
+					// acc converges to 1, so it never overflows or goes denormal
+					const float m=0.999999f, k=1e-6f;
+					for(unsigned i=0;i<iterations;i++){
+						for(unsigned j=0;j<Chains;j++){
+							acc[j]=acc[j]*m+k;
+						}
+					}
+					float sum=0;
+					for(unsigned j=0;j<Chains;j++){
+						sum+=acc[j];
+					}
+					sink[t]=sum;
+				}
+			});
+			best=std::min(best, detail::RooflineSeconds(start));
+		}
+		float total=0;
+		for(unsigned t=0;t<threads;t++){
+			total+=sink[t];
+		}
+		if(total<0)	// uses the results, which are never negative
+			return 0;
+		return 2.0*Chains*(double)iterations*threads/best;
+	}
+
+	inline roofline_t MeasureRoofline()
+	{
+		roofline_t res;
+		res.bandwidth=MeasureStreamBandwidth();
+		res.flops=MeasureFmaPeak();
+		return res;
+	}
+
+}; // namespace hpce
+
+#endif
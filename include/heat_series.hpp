@@ -0,0 +1,126 @@
+#ifndef hpce_heat_series_hpp
+#define hpce_heat_series_hpp
+
+#include "heat.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hpce{
+
+	//! Writes the frames of one run to a time series, in the background
+	/*! The file holds the geometry once, then one record per frame. Each
+		frame is the difference of every cell from the frame before, as a
+		zigzag varint with runs of zeros collapsed, and every keyframe'th
+		frame is the difference from zero, so any frame can be rebuilt from
+		the keyframe before it. With a quantum the state is rounded to a
+		multiple of it first, which makes the differences shorter; without
+		one the differences are of the float bits and the frames are exact.
+
+		append copies the state and returns, and a thread encodes and
+		writes the frames in order. At most a few frames wait for it, after
+		that append blocks rather than queue without bound.
+
+		A resumed run carries on the series of the run it resumes. The
+		frames after world.t, which the stopped run wrote past its last
+		checkpoint, are cut off and the new ones go after the rest, with the
+		keyframe interval the series was started with.
+	*/
+	class SeriesWriter
+	{
+	public:
+		/*! \param keyframeInterval Frames from one keyframe to the next, at least 1
+			\param quantum Largest rounding error is quantum/2, zero for exact frames
+			\param resume Carry on the series in fileName if there is one, it
+				must have the geometry of world and the same quantum
+		*/
+		SeriesWriter(const std::string &fileName, const world_t &world, unsigned keyframeInterval=16, double quantum=0, bool resume=false);
+		//! Writes the frames still queued
+		~SeriesWriter();
+
+		//! True if a resumed series already ends with a frame at t
+		/*! Only meaningful before the first append */
+		bool endsAt(float t) const
+		{ return m_frames>0 && m_lastT==t; }
+
+		//! Queues the world's state and t as the next frame
+		void append(const world_t &world);
+
+		//! Writes the frames still queued, and rethrows any error writing them
+		void finish();
+	private:
+		SeriesWriter(const SeriesWriter &); // = delete
+		SeriesWriter &operator=(const SeriesWriter &); // = delete
+
+		struct frame_t
+		{
+			float t;
+			state_vector_t state;
+		};
+
+		void run();
+
+		std::ofstream m_dst;
+		unsigned m_keyframeInterval;
+		double m_quantum;
+		unsigned m_frames;	// written so far, only touched by the thread
+		std::vector<uint32_t> m_previous;	// last frame as written, ditto
+		float m_lastT;	// of the last frame kept when resuming
+
+		std::mutex m_mutex;
+		std::condition_variable m_changed;
+		std::deque<frame_t> m_queue;
+		bool m_closing;
+		std::exception_ptr m_error;
+		std::thread m_thread;
+	};
+
+	//! Reads any frame of a time series written by SeriesWriter
+	/*! Opening reads the geometry and the header of every record, so a
+		series cut short by a crash reads up to its last whole frame.
+	*/
+	class SeriesReader
+	{
+	public:
+		SeriesReader(const std::string &fileName);
+
+		unsigned frameCount() const
+		{ return m_records.size(); }
+		float frameTime(unsigned i) const
+		{ return m_records.at(i).t; }
+
+		//! The world as it was at frame i
+		/*! Decodes the keyframe at or before i and the frames after it */
+		world_t readFrame(unsigned i);
+	private:
+		friend class SeriesWriter;
+
+		//! The words frame i was differenced as, exactly as written
+		void readWords(unsigned i, std::vector<uint32_t> &words);
+		//! Bytes of the file up to the end of the first count frames
+		uint64_t bytesThrough(unsigned count) const;
+
+		struct record_t
+		{
+			uint64_t offset;	// of the payload
+			uint32_t bytes;
+			bool keyframe;
+			float t;
+		};
+
+		std::ifstream m_src;
+		world_t m_world;	// geometry, with no state
+		unsigned m_keyframeInterval;
+		double m_quantum;
+		uint64_t m_framesStart;	// offset of the first record
+		std::vector<record_t> m_records;
+	};
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef hpce_heat_stream_hpp
+#define hpce_heat_stream_hpp
+
+#include "heat.hpp"
+
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+
+namespace hpce{
+
+	//! First words of the two records of a streamed world
+	extern const char *GeometryRecordHeader;
+	extern const char *FrameRecordHeader;
+
+	//! Writes worlds to one stream, sending each geometry only once
+	/*! A geometry record holds w, h and one byte of flags per cell, under its
+		GeometryHash. A frame record holds the hash, alpha, the bits of t and
+		the state. The first world of a geometry is written as both, and
+		every later world with the same geometry as just a frame, so a
+		stream of steps or a batch sharing one geometry sends it once.
+		LoadWorld reads either record, keeping the geometries it has seen.
+	*/
+	class WorldStreamWriter
+	{
+	public:
+		WorldStreamWriter(std::ostream &dst);
+
+		void write(const world_t &world);
+	private:
+		std::ostream &m_dst;
+		std::set<uint64_t> m_sent;
+	};
+
+	//! The geometry of every geometry record this process has read
+	/*! \returns NULL for a hash that hasn't been seen */
+	std::shared_ptr<const world_t> FindStreamedGeometry(uint64_t hash);
+
+	//! Reads the rest of a record whose first word is header, see LoadWorld
+	/*! A geometry record must be followed by a frame, which is returned */
+	world_t LoadWorldStreamed(std::istream &src, const std::string &header);
+};
+
+#endif
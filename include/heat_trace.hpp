@@ -0,0 +1,254 @@
+#ifndef hpce_heat_trace_hpp
+#define hpce_heat_trace_hpp
+
+/* Trace spans, written as Chrome trace-event JSON (chrome://tracing, Perfetto)
+
+	Spans are recorded when HPCE_TRACE names a file. Every process of a
+	pipeline can be pointed at the same file: each appends its own events
+	(with its pid) when it exits, and the first one to create the file
+	writes the opening '['. The array is left open, which the trace
+	viewers accept, so delete the file between runs.
+
+	Spans only cost anything when tracing is on: two clock reads and an
+	append to a per-thread buffer, around 100ns. That is why they mark
+	phases and thread chunks rather than cells or rows. Building with
+	-DHPCE_NO_TRACE removes them altogether.
+
+	HPCE_TRACE_SPAN(name) times the rest of the enclosing scope.
+	HPCE_TRACE_PHASE(var, name) starts a span that HPCE_TRACE_NEXT(var, name)
+	ends and replaces with the next one, for long functions made of phases.
+	Names must be string literals (or otherwise live for the whole run).
+*/
+
+#ifndef HPCE_NO_TRACE
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace hpce{
+
+	class Tracer
+	{
+	public:
+		struct event_t
+		{
+			const char *name;
+			double begin;	// microseconds on the steady clock
+			double duration;
+		};
+
+		struct thread_buffer_t
+		{
+			unsigned tid;
+			uint64_t dropped;
+			std::vector<event_t> events;
+		};
+
+		static Tracer &Instance()
+		{
+			static Tracer tracer;
+			return tracer;
+		}
+
+		bool enabled() const
+		{ return m_enabled; }
+
+		//! Microseconds on a clock shared by every process, so pipelines line up
+		static double Now()
+		{
+			return std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		void record(const char *name, double begin, double end)
+		{
+			thread_buffer_t *buffer=threadBuffer();
+			if(buffer->events.size()>=m_maxEvents){
+				buffer->dropped++;
+				return;
+			}
+			event_t e={name, begin, end-begin};
+			buffer->events.push_back(e);
+		}
+
+		~Tracer()
+		{
+			if(m_enabled)
+				flush();
+		}
+
+	private:
+		Tracer()
+			: m_enabled(false)
+			, m_maxEvents(1<<20)
+		{
+			const char *v=getenv("HPCE_TRACE");
+			if(v && *v && std::string(v)!="0"){
+				m_enabled=true;
+				m_fileName=v;
+			}
+			const char *m=getenv("HPCE_TRACE_MAX_EVENTS");
+			if(m && atoi(m)>0)
+				m_maxEvents=atoi(m);
+		}
+
+		thread_buffer_t *threadBuffer()
+		{
+			static thread_local thread_buffer_t *buffer=0;
+			if(!buffer){
+				// Buffers belong to the tracer, so they outlive their threads
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_buffers.push_back(std::unique_ptr<thread_buffer_t>(new thread_buffer_t));
+				buffer=m_buffers.back().get();
+				buffer->tid=m_buffers.size();
+				buffer->dropped=0;
+				buffer->events.reserve(std::min(m_maxEvents, 1u<<12));
+			}
+			return buffer;
+		}
+
+		static std::string ProcessName()
+		{
+			std::string name="hpce";
+#ifdef __linux__
+			FILE *f=fopen("/proc/self/comm", "r");
+			if(f){
+				char buffer[64]={0};
+				if(fgets(buffer, sizeof(buffer), f)){
+					name=buffer;
+					if(!name.empty() && name[name.size()-1]=='\n')
+						name.erase(name.size()-1);
+				}
+				fclose(f);
+			}
+#endif
+			return name;
+		}
+
+		void flush()
+		{
+#ifndef _WIN32
+			unsigned pid=getpid();
+#else
+			unsigned pid=0;
+#endif
+			std::stringstream dst;
+			dst.precision(3);
+			dst<<std::fixed;
+			dst<<"{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "<<pid<<", \"tid\": 1, \"args\": {\"name\": \""<<ProcessName()<<"\"}},\n";
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for(unsigned i=0;i<m_buffers.size();i++){
+				const thread_buffer_t &b=*m_buffers[i];
+				dst<<"{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": "<<pid<<", \"tid\": "<<b.tid
+					<<", \"args\": {\"name\": \""<<(b.tid==1 ? "main" : "worker")<<" "<<b.tid<<"\"}},\n";
+				for(unsigned j=0;j<b.events.size();j++){
+					const event_t &e=b.events[j];
+					dst<<"{\"name\": \""<<e.name<<"\", \"ph\": \"X\", \"pid\": "<<pid<<", \"tid\": "<<b.tid
+						<<", \"ts\": "<<e.begin<<", \"dur\": "<<e.duration<<"},\n";
+				}
+				if(b.dropped){
+					fprintf(stderr, "Tracer : Dropped %llu events on thread %u, raise HPCE_TRACE_MAX_EVENTS\n", (unsigned long long)b.dropped, b.tid);
+				}
+			}
+			std::string text=dst.str();
+
+#ifndef _WIN32
+			// One append per process, so processes sharing the file don't interleave
+			int fd=open(m_fileName.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0644);
+			if(fd>=0){
+				text="[\n"+text;
+			}else{
+				fd=open(m_fileName.c_str(), O_WRONLY|O_APPEND);
+			}
+			if(fd<0 || write(fd, text.data(), text.size())!=(ssize_t)text.size()){
+				fprintf(stderr, "Tracer : Couldn't write trace to '%s'\n", m_fileName.c_str());
+			}
+			if(fd>=0)
+				close(fd);
+#else
+			FILE *f=fopen(m_fileName.c_str(), "ab");
+			if(f){
+				if(ftell(f)==0)
+					text="[\n"+text;
+				fwrite(text.data(), 1, text.size(), f);
+				fclose(f);
+			}
+#endif
+		}
+
+		bool m_enabled;
+		std::string m_fileName;
+		unsigned m_maxEvents;	// per thread, so a long run can't eat all memory
+		std::mutex m_mutex;
+		std::vector<std::unique_ptr<thread_buffer_t> > m_buffers;
+	};
+
+	//! Records the time from construction to destruction (or to next())
+	class TraceSpan
+	{
+	public:
+		TraceSpan(const char *name)
+			: m_name(Tracer::Instance().enabled() ? name : 0)
+			, m_begin(m_name ? Tracer::Now() : 0)
+		{}
+
+		~TraceSpan()
+		{ end(); }
+
+		//! Ends this span and starts another straight away
+		void next(const char *name)
+		{
+			if(!Tracer::Instance().enabled())
+				return;
+			double now=Tracer::Now();
+			if(m_name)
+				Tracer::Instance().record(m_name, m_begin, now);
+			m_name=name;
+			m_begin=now;
+		}
+
+	private:
+		TraceSpan(const TraceSpan &); // = delete
+		TraceSpan &operator=(const TraceSpan &); // = delete
+
+		void end()
+		{
+			if(m_name){
+				Tracer::Instance().record(m_name, m_begin, Tracer::Now());
+				m_name=0;
+			}
+		}
+
+		const char *m_name;
+		double m_begin;
+	};
+
+}; // namespace hpce
+
+#define HPCE_TRACE_CONCAT2(a,b) a##b
+#define HPCE_TRACE_CONCAT(a,b) HPCE_TRACE_CONCAT2(a,b)
+#define HPCE_TRACE_SPAN(name) ::hpce::TraceSpan HPCE_TRACE_CONCAT(hpce_trace_span_, __LINE__)(name)
+#define HPCE_TRACE_PHASE(var, name) ::hpce::TraceSpan var(name)
+#define HPCE_TRACE_NEXT(var, name) var.next(name)
+
+#else
+
+#define HPCE_TRACE_SPAN(name) do{}while(0)
+#define HPCE_TRACE_PHASE(var, name) do{}while(0)
+#define HPCE_TRACE_NEXT(var, name) do{}while(0)
+
+#endif
+
+#endif
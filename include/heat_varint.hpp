@@ -0,0 +1,58 @@
+#ifndef hpce_heat_varint_hpp
+#define hpce_heat_varint_hpp
+
+/* The integer coding the compressed formats share
+
+	Values go seven bits to a byte, low bits first, with the top bit set on
+	every byte but the last. Differences are zigzagged first, so small
+	negative ones stay short too.
+*/
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace hpce{
+	namespace detail{
+
+		inline void PutVarint(std::string &dst, uint32_t v)
+		{
+			while(v>=0x80){
+				dst+=(char)(v|0x80);
+				v>>=7;
+			}
+			dst+=(char)v;
+		}
+
+		//! \param where Prefix of the error if the value runs past end
+		inline uint32_t GetVarint(const uint8_t *&p, const uint8_t *end, const char *where)
+		{
+			uint32_t v=0;
+			for(unsigned shift=0;shift<35;shift+=7){
+				if(p==end)
+					throw std::invalid_argument(std::string(where)+" : Corrupt data, truncated value.");
+				uint8_t b=*p++;
+				v|=(uint32_t)(b&0x7F)<<shift;
+				if(!(b&0x80))
+					return v;
+			}
+			throw std::invalid_argument(std::string(where)+" : Corrupt data, value too long.");
+		}
+
+		//! The difference a-b, as an unsigned that is small if it is
+		inline uint32_t ZigzagDelta(uint32_t a, uint32_t b)
+		{
+			uint32_t d=a-b;
+			return (d<<1)^(uint32_t)((int32_t)d>>31);
+		}
+
+		//! Inverse of ZigzagDelta, giving a from zz and b
+		inline uint32_t UnzigzagDelta(uint32_t zz, uint32_t b)
+		{
+			return b+((zz>>1)^(0u-(zz&1)));
+		}
+
+	}; // namespace detail
+}; // namespace hpce
+
+#endif
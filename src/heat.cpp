@@ -1,18 +1,29 @@
 #include "heat.hpp"
+#include "heat_chunked.hpp"
+#include "heat_image.hpp"
+#include "heat_parallel.hpp"
+#include "heat_stream.hpp"
+#include "heat_trace.hpp"
 
 #include <stdexcept>
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <memory>
 #include <cstdio>
 #include <string>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <future>
 
 namespace hpce{
 	
 //! Create a square world with a standardised "slalom track"
 world_t MakeTestWorld(unsigned n, float alpha)
 {	
-	std::vector<cell_flags_t> properties(n*n, (cell_flags_t)0);
+	HPCE_TRACE_SPAN("MakeTestWorld");
+	properties_vector_t properties(n*n, (cell_flags_t)0);
 	
 	// Top, bottom, left, right boundary
 	for(unsigned i=0;i<n;i++){
@@ -43,7 +54,7 @@ world_t MakeTestWorld(unsigned n, float alpha)
 	}
 	
 	// Create state, all intially at ambient temperature
-	std::vector<float> state(n*n, 0.0f);
+	state_vector_t state(n*n, 0.0f);
 	
 	// Create a band of constant heart source along the top
 	for(unsigned x=1;x<n-1;x++){
@@ -67,206 +78,415 @@ world_t MakeTestWorld(unsigned n, float alpha)
 	return world;
 }
 
-//! Save the give world to a file
-void SaveWorld(std::ostream &dst, const world_t &world, bool binary)
-{	
+WorldWriter::WorldWriter(std::ostream &dst, unsigned w, unsigned h, float alpha, bool binary)
+	: m_dst(dst)
+	, m_w(w)
+	, m_h(h)
+	, m_binary(binary)
+	, m_propertiesRows(0)
+	, m_stateRows(0)
+	, m_stateStarted(false)
+	, m_fmt(NULL)
+{
 	if(binary){
 		dst<<"HPCEHeatWorldV0Binary"<<std::endl;
 	}else{
 		dst<<"HPCEHeatWorldV0"<<std::endl;
 	}
-	dst<<world.w<<" "<<world.h<<" "<<world.alpha<<std::endl;
+	dst<<w<<" "<<h<<" "<<alpha<<std::endl;
 	
 	dst<<"-";
 	if(!binary){
 		dst<<std::endl;
 	}
-	
-	for(unsigned y=0;y<world.h;y++){
-		if(binary){
-			dst.write((char*)&world.properties[y*world.w], world.w*4);
-		}else{
-			for(unsigned x=0;x<world.w;x++){
-				dst<<" "<<world.properties[y*world.w+x];
-			}
-			dst<<std::endl;
+}
+
+void WorldWriter::writePropertiesRow(const cell_flags_t *row)
+{
+	if(m_propertiesRows==m_h)
+		throw std::logic_error("WorldWriter : Too many rows of properties.");
+	if(m_binary){
+		m_dst.write((const char*)row, m_w*4);
+	}else{
+		for(unsigned x=0;x<m_w;x++){
+			m_dst<<" "<<row[x];
 		}
+		m_dst<<std::endl;
 	}
-	
-	dst<<"-";
-	if(!binary){
-		dst<<std::endl;
+	m_propertiesRows++;
+}
+
+void WorldWriter::writeStateRow(const float *row)
+{
+	if(m_propertiesRows!=m_h)
+		throw std::logic_error("WorldWriter : All the rows of properties must be written before the state.");
+	if(m_stateRows==m_h)
+		throw std::logic_error("WorldWriter : Too many rows of state.");
+	if(!m_stateStarted){
+		startState();
+	}
+	if(m_binary){
+		m_dst.write((const char*)row, m_w*4);
+	}else{
+		for(unsigned x=0;x<m_w;x++){
+			m_dst<<" "<<row[x];
+		}
+		m_dst<<std::endl;
+	}
+	m_stateRows++;
+}
+
+void WorldWriter::startState()
+{
+	m_dst<<"-";
+	if(!m_binary){
+		m_dst<<std::endl;
 	}
 	
 	// Save the output modifiers
-	std::ios fmt(NULL);
-	fmt.copyfmt(dst);
+	m_fmt.copyfmt(m_dst);
+	m_stateStarted=true;
 	
-	dst<<std::fixed;	// Record with absolute precision
-	dst.precision(8);	// Want the state recorded with similar accuracy to a float
+	m_dst<<std::fixed;	// Record with absolute precision
+	m_dst.precision(8);	// Want the state recorded with similar accuracy to a float
 	// Note that by recording in text rather than binary, we'll see an expansion in data
 	// size of around 3 times, and reading/writing will be much slower than for binary.
-	
-	for(unsigned y=0;y<world.h;y++){
-		if(binary){
-			dst.write((char*)&world.state[y*world.w], world.w*4);
-		}else{
-			for(unsigned x=0;x<world.w;x++){
-				dst<<" "<<world.state[y*world.w+x];
-			}
-			dst<<std::endl;
+}
+
+void WorldWriter::finish()
+{
+	if(m_stateRows!=m_h)
+		throw std::logic_error("WorldWriter : Finished before every row of state was written.");
+	if(!m_stateStarted){
+		// A world with no rows still has the hyphen before its empty state
+		m_dst<<"-";
+		if(!m_binary){
+			m_dst<<std::endl;
 		}
+	}else{
+		m_dst.copyfmt(m_fmt);
 	}
 	
-	dst.copyfmt(fmt);
-	
-	dst<<"End"<<std::endl;
+	m_dst<<"End"<<std::endl;
 }
 
-//! Read a world from a file
-world_t LoadWorld(std::istream &src)
+//! Save the give world to a file
+void SaveWorld(std::ostream &dst, const world_t &world, bool binary)
+{	
+	HPCE_TRACE_SPAN("SaveWorld");
+	WorldWriter writer(dst, world.w, world.h, world.alpha, binary);
+	for(unsigned y=0;y<world.h;y++){
+		writer.writePropertiesRow(&world.properties[y*world.w]);
+	}
+	for(unsigned y=0;y<world.h;y++){
+		writer.writeStateRow(&world.state[y*world.w]);
+	}
+	writer.finish();
+}
+
+WorldReader::WorldReader(std::istream &src)
+	: m_src(src)
+	, m_propertiesRows(0)
+	, m_stateRows(0)
 {
-	bool binary=false;
-	
 	std::string header;
 	src>>header;
+	readHeader(header);
+}
+
+WorldReader::WorldReader(std::istream &src, const std::string &header)
+	: m_src(src)
+	, m_propertiesRows(0)
+	, m_stateRows(0)
+{
+	readHeader(header);
+}
+
+void WorldReader::readHeader(const std::string &header)
+{
+	std::istream &src=m_src;
 	if(header=="HPCEHeatWorldV0"){
-		binary=false;
+		m_binary=false;
 	}else if(header=="HPCEHeatWorldV0Binary"){
-		binary=true;
+		m_binary=true;
 	}else{
 		throw std::invalid_argument("LoadWorld : File does not start with HPCEHeatWorldV0.");
 	}
 	
-	world_t world;
-	
-	src>>world.w>>world.h>>world.alpha;
+	src>>m_w>>m_h>>m_alpha;
 	if(!src.good())
 		throw std::invalid_argument("LoadWorld : Corrupt input file, couldn't write initial world state (width, height, alpha).");
 	
-	world.properties.resize(world.w*world.h);
-	world.state.resize(world.w*world.h);
-	
 	char delim;
 	src>>delim;
 	if(delim!='-'){
 		throw std::invalid_argument("LoadWorld : Corrupt input file, missing hyphen before properties array.");
 	}
-	
-	for(unsigned y=0;y<world.h;y++){
-		if(binary){
-			src.read((char*)&world.properties[y*world.w], world.w*4);
-			for(unsigned x=0;x<world.w;x++){
-				unsigned flags=world.properties[y*world.w+x];
-				if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed)){
-					std::cerr<<"y="<<y<<", x="<<x<<", flags="<<flags<<"\n";
-					throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
-				}
-			}
-		}else{
-			for(unsigned x=0;x<world.w;x++){
-				unsigned flags;
-				src>>flags;
-				if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
-					throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
-				world.properties[y*world.w+x]=(cell_flags_t)flags;
+}
+
+void WorldReader::readPropertiesRow(cell_flags_t *row)
+{
+	if(m_propertiesRows==m_h)
+		throw std::logic_error("WorldReader : No more rows of properties.");
+	unsigned y=m_propertiesRows++;
+	if(m_binary){
+		m_src.read((char*)row, m_w*4);
+		for(unsigned x=0;x<m_w;x++){
+			unsigned flags=row[x];
+			if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed)){
+				std::cerr<<"y="<<y<<", x="<<x<<", flags="<<flags<<"\n";
+				throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
 			}
 		}
+	}else{
+		for(unsigned x=0;x<m_w;x++){
+			unsigned flags;
+			m_src>>flags;
+			if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
+				throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
+			row[x]=(cell_flags_t)flags;
+		}
 	}
-	if(!src.good())
+	if(!m_src.good())
 		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements of properties could not be read.");
-	
-	src>>delim;
-	if(delim!='-'){
-		throw std::invalid_argument("LoadWorld : Corrupt input file, missing hyphen before state array.");
+}
+
+void WorldReader::skipProperties()
+{
+	if(m_binary && m_propertiesRows<m_h){
+		// Flags are only checked by the reader that keeps them
+		m_src.ignore((std::streamsize)(m_h-m_propertiesRows)*m_w*4);
+		m_propertiesRows=m_h;
+		if(!m_src.good())
+			throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements of properties could not be read.");
 	}
-	
-	for(unsigned y=0;y<world.h;y++){
-		if(binary){
-			src.read((char*)&world.state[y*world.w], world.w*4);
-			for(unsigned x=0;x<world.w;x++){
-				float temp=world.state[y*world.w+x];
-				if(temp<0 || temp>1)
-					throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
-			}
-		}else{
-			for(unsigned x=0;x<world.w;x++){
-				float temp;
-				src>>temp;
-				if(temp<0 || temp>1)
-					throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
-				world.state[y*world.w+x]=temp;
-			}
+	properties_vector_t row(m_w);
+	while(m_propertiesRows<m_h){
+		readPropertiesRow(&row[0]);
+	}
+}
+
+void WorldReader::readStateRow(float *row)
+{
+	if(m_propertiesRows!=m_h)
+		throw std::logic_error("WorldReader : All the rows of properties must be read before the state.");
+	if(m_stateRows==m_h)
+		throw std::logic_error("WorldReader : No more rows of state.");
+	if(m_stateRows==0){
+		readStateHyphen();
+	}
+	m_stateRows++;
+	if(m_binary){
+		m_src.read((char*)row, m_w*4);
+		for(unsigned x=0;x<m_w;x++){
+			float temp=row[x];
+			if(temp<0 || temp>1)
+				throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
+		}
+	}else{
+		for(unsigned x=0;x<m_w;x++){
+			float temp;
+			m_src>>temp;
+			if(temp<0 || temp>1)
+				throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
+			row[x]=temp;
 		}
 	}
-	if(!src.good())
+	if(!m_src.good())
 		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements of state could not be read.");
-	
-	src>>header;
+}
+
+void WorldReader::readStateHyphen()
+{
+	char delim;
+	m_src>>delim;
+	if(delim!='-'){
+		throw std::invalid_argument("LoadWorld : Corrupt input file, missing hyphen before state array.");
+	}
+}
+
+void WorldReader::finish()
+{
+	if(m_stateRows!=m_h)
+		throw std::logic_error("WorldReader : Finished before every row of state was read.");
+	if(m_h==0){
+		readStateHyphen();	// no row of state read it
+	}
+	std::string header;
+	m_src>>header;
 	if(header!="End"){
 		throw std::invalid_argument("LoadWorld : Corrupt input file, missing 'End' to terminate world description.");
 	}
+}
+
+//! Read a world from a file
+world_t LoadWorld(std::istream &src)
+{
+	std::string header;
+	src>>header;
+	return LoadWorld(src, header);
+}
+
+world_t LoadWorld(std::istream &src, const std::string &header)
+{
+	HPCE_TRACE_SPAN("LoadWorld");
+	if(header==ChunkedWorldHeader){
+		ChunkedWorldReader chunked(src, header);
+		return chunked.readWorld();
+	}
+	if(header==GeometryRecordHeader || header==FrameRecordHeader){
+		return LoadWorldStreamed(src, header);
+	}
+	WorldReader reader(src, header);
+	
+	world_t world;
+	world.w=reader.width();
+	world.h=reader.height();
+	world.alpha=reader.alpha();
+	world.t=0.0f;	// the text and binary formats don't record it
+	
+	world.properties.resize(world.w*world.h);
+	world.state.resize(world.w*world.h);
+	
+	for(unsigned y=0;y<world.h;y++){
+		reader.readPropertiesRow(&world.properties[y*world.w]);
+	}
+	for(unsigned y=0;y<world.h;y++){
+		reader.readStateRow(&world.state[y*world.w]);
+	}
+	reader.finish();
 	
 	return world;
 }
 
-void RenderWorld(const std::string &fileName, const world_t &world)
+WorldRowReader::WorldRowReader(const std::string &fileName)
+	: m_rowsRead(0)
 {
-	// The solution to doing BITMAPINFOHEADER etc. without being platform-specific
-	// comes from:
-	//   http://stackoverflow.com/a/18675807
-	// In practise you would never do this, but it's the easiest way to stay platform independent fo
-	// coursework purposes.
-
-	uint8_t file[14] = {
-		'B','M', // magic
-		0,0,0,0, // size in bytes
-		0,0, // app data
-		0,0, // app data
-		40+14,0,0,0 // start of data offset
-	};
-	uint8_t info[40] = {
-		40,0,0,0, // info hd size
-		0,0,0,0, // width
-		0,0,0,0, // heigth
-		1,0, // number color planes
-		24,0, // bits per pixel
-		0,0,0,0, // compression is none
-		0,0,0,0, // image bits size
-		0x13,0x0B,0,0, // horz resoluition in pixel / m
-		0x13,0x0B,0,0, // vert resolutions (0x03C3 = 96 dpi, 0x0B13 = 72 dpi)
-		0,0,0,0, // #colors in pallete
-		0,0,0,0, // #important colors
-		};
+	if(fileName=="-"){
+		m_state.reset(new WorldReader(std::cin));
+		bufferProperties();
+	}else{
+		m_propertiesFile.reset(new std::ifstream(fileName.c_str(), std::ios::in | std::ios::binary));
+		m_stateFile.reset(new std::ifstream(fileName.c_str(), std::ios::in | std::ios::binary));
+		if(!m_propertiesFile->good() || !m_stateFile->good())
+			throw std::runtime_error("WorldRowReader : Couldn't open '"+fileName+"'.");
+		m_properties.reset(new WorldReader(*m_propertiesFile));
+		m_state.reset(new WorldReader(*m_stateFile));
+		m_state->skipProperties();
+		m_propertiesRow.resize(width());
+		m_stateRow.resize(width());
+	}
+}
 
-	unsigned w=world.w;
-	unsigned h=world.h;
+WorldRowReader::WorldRowReader(std::istream &src, const std::string &header)
+	: m_rowsRead(0)
+{
+	m_state.reset(new WorldReader(src, header));
+	bufferProperties();
+}
 
-	unsigned padSize  = (4-w%4)%4;
-	unsigned sizeData = w*h*3 + h*padSize;
-	unsigned sizeAll  = sizeData + sizeof(file) + sizeof(info);
+WorldRowReader::~WorldRowReader()
+{}
 
-	file[ 2] = (uint8_t)( sizeAll    );
-	file[ 3] = (uint8_t)( sizeAll>> 8);
-	file[ 4] = (uint8_t)( sizeAll>>16);
-	file[ 5] = (uint8_t	)( sizeAll>>24);
-		
-	info[ 4] = (uint8_t)( w   );
-	info[ 5] = (uint8_t)( w>> 8);
-	info[ 6] = (uint8_t)( w>>16);
-	info[ 7] = (uint8_t)( w>>24);
-
-	info[ 8] = (uint8_t)( h    );
-	info[ 9] = (uint8_t)( h>> 8);
-	info[10] = (uint8_t)( h>>16);
-	info[11] = (uint8_t)( h>>24);
-
-	info[24] = (uint8_t)( sizeData    );
-	info[25] = (uint8_t)( sizeData>> 8);
-	info[26] = (uint8_t)( sizeData>>16);
-	info[27] = (uint8_t)( sizeData>>24);
-		
-	// End stackoverflow excerpt
+void WorldRowReader::bufferProperties()
+{
+	unsigned w=width(), h=height();
+	m_propertiesRow.resize(w);
+	m_stateRow.resize(w);
+	m_buffered.resize((size_t)w*h);
+	for(unsigned y=0;y<h;y++){
+		m_state->readPropertiesRow(&m_propertiesRow[0]);
+		std::copy(m_propertiesRow.begin(), m_propertiesRow.end(), m_buffered.begin()+(size_t)y*w);
+	}
+}
+
+bool WorldRowReader::next()
+{
+	unsigned w=width();
+	if(m_rowsRead==height()){
+		if(m_rowsRead){
+			m_state->finish();
+			m_rowsRead++;	// only check the End once
+		}
+		return false;
+	}
+	if(m_rowsRead>height())
+		return false;
+	
+	if(m_properties){
+		m_properties->readPropertiesRow(&m_propertiesRow[0]);
+	}else{
+		const uint8_t *src=&m_buffered[(size_t)m_rowsRead*w];
+		for(unsigned x=0;x<w;x++){
+			m_propertiesRow[x]=(cell_flags_t)src[x];
+		}
+	}
+	m_state->readStateRow(&m_stateRow[0]);
+	m_rowsRead++;
+	return true;
+}
+
+// Bytes of scanlines converted and then written at a time
+static const size_t RenderBlockBytes=4<<20;
+
+//! The bytes of each colour a cell can be drawn in
+/*! Entries 0 to 255 are the quantised heat, from blue to red, and entry
+	256 is an insulator. Each is padded to a word, so a pixel can be copied
+	as one four byte store that spills into the next pixel.
+*/
+struct render_lut_t
+{
+	uint32_t colour[257];
+
+	render_lut_t(bool bgr)
+	{
+		for(unsigned heat=0;heat<256;heat++){
+			uint8_t blue=(uint8_t)(255-heat), red=(uint8_t)heat;
+			uint8_t bytes[4]={bgr ? blue : red, 0, bgr ? red : blue, 0};
+			memcpy(&colour[heat], bytes, 4);
+		}
+		uint8_t insulator[4]={0, 255, 0, 0};
+		memcpy(&colour[256], insulator, 4);
+	}
+};
+
+static const render_lut_t RenderLutBgr(true), RenderLutRgb(false);
+
+//! Draws one row of cells as 3*w bytes of colour at dst
+/*! \param index Scratch space for w entries */
+static void RenderRow(unsigned w, const render_lut_t &lut, const cell_flags_t *properties, const float *state, uint32_t *index, uint8_t *dst)
+{
+	if(w==0)
+		return;
+	// Quantising and picking the insulator entry is free of branches, so
+	// it vectorises, and leaves only the table lookups per pixel
+	for(unsigned x=0;x<w;x++){
+		int heat=std::max(0, std::min(255, (int)(state[x]*255)));
+		index[x]=(properties[x]&Cell_Insulator) ? 256 : heat;
+	}
+	for(unsigned x=0;x+1<w;x++){
+		memcpy(dst+3*x, &lut.colour[index[x]], 4);
+	}
+	// The last pixel mustn't spill, the next row may be another thread's
+	memcpy(dst+3*(w-1), &lut.colour[index[w-1]], 3);
+}
+
+//! Writes an image, asking for a block of rows of the world at a time
+/*! \param getRows Called in order as getRows(y, rows, properties, state),
+		with pointers to fill in to rows*w contiguous cells starting at row y
+
+	The format comes from the extension of fileName, see MakeImageEncoder.
+	The rows of a block are drawn and encoded in parallel, and each block
+	is written with large fwrites while the next block is drawn.
+*/
+template<class TGetRows>
+static void RenderRows(const std::string &fileName, unsigned w, unsigned h, TGetRows getRows)
+{
+	std::unique_ptr<ImageEncoder> encoder=MakeImageEncoder(fileName, w, h);
+	const render_lut_t &lut=encoder->bgr() ? RenderLutBgr : RenderLutRgb;
+	size_t rowBytes=encoder->rowBytes();
+	size_t offset=encoder->pixelOffset();
+	unsigned blockRows=(unsigned)std::max<size_t>(1, std::min<size_t>(h, RenderBlockBytes/std::max<size_t>(1, rowBytes)));
 
 	FILE *dst=stdout;
 	if(fileName!="-"){
@@ -275,41 +495,119 @@ void RenderWorld(const std::string &fileName, const world_t &world)
 			throw std::runtime_error("RenderWorld : Couldn't open destination file.");
 	}
 	try{
-		if(sizeof(file)!=fwrite(file, 1, sizeof(file), dst))
-			throw std::runtime_error("RenderWorld : Couldn't write bitmap header.");
-		
-		if(sizeof(info)!=fwrite(info, 1, sizeof(info), dst))
-			throw std::runtime_error("RenderWorld : Couldn't write bitmap info.");
+		std::string header=encoder->header();
+		if(header.size()!=fwrite(header.data(), 1, header.size(), dst))
+			throw std::runtime_error("RenderWorld : Couldn't write image header.");
 		
-		std::vector<uint8_t> scanline(w*3+padSize, 0);
+		// Two blocks, one being drawn while the other is written. Whatever
+		// is either side of the pixels in each row is never drawn over, so
+		// stays 0
+		std::vector<uint8_t> blocks[2]={
+			std::vector<uint8_t>(blockRows*rowBytes, 0),
+			std::vector<uint8_t>(blockRows*rowBytes, 0)
+		};
+		std::future<void> writing;
 		
-		for(unsigned y=0;y<h;y++){
-			uint8_t *pDst=&scanline[0];
-			for(unsigned x=0;x<w;x++){
-				unsigned index=y*w+x;
-				if(world.properties[index]&Cell_Insulator){
-					*pDst++ = 0;
-					*pDst++ = 255;
-					*pDst++ = 0;
-				}else{
-					uint8_t heat=(uint8_t)(world.state[index]*255);
-					*pDst++ = (255-heat);	// Blue
-					*pDst++ = 0; // Green
-					*pDst++ = heat; // Red
+		// A top down format starts with the last rows of the world, and
+		// draws each block of them in reverse
+		bool topDown=encoder->topDown();
+		for(unsigned y=0, i=0;y<h;y+=blockRows, i^=1){
+			unsigned rows=std::min(blockRows, h-y);
+			const cell_flags_t *properties=0;
+			const float *state=0;
+			getRows(topDown ? h-y-rows : y, rows, properties, state);
+			
+			uint8_t *block=&blocks[i][0];
+			ParallelForRange(0, rows, [&](unsigned rBegin, unsigned rEnd){
+				std::vector<uint32_t> index(w);
+				for(unsigned r=rBegin;r<rEnd;r++){
+					size_t src=(size_t)(topDown ? rows-1-r : r)*w;
+					RenderRow(w, lut, properties+src, state+src, &index[0], block+r*rowBytes+offset);
 				}
-			}
-			if(scanline.size()!=fwrite(&scanline[0], 1, scanline.size(), dst))
-				throw std::runtime_error("RenderWorld : Couldn't write scanline.");
+			}, 16);
+			
+			// Either the block goes out as it is, or what it was encoded to
+			std::shared_ptr<std::vector<std::string> > pieces=std::make_shared<std::vector<std::string> >();
+			size_t bytes=encoder->encode(block, rows, *pieces) ? 0 : rows*rowBytes;
+			
+			if(writing.valid())
+				writing.get();
+			writing=std::async(std::launch::async, [=](){
+				if(bytes!=fwrite(block, 1, bytes, dst))
+					throw std::runtime_error("RenderWorld : Couldn't write scanlines.");
+				for(unsigned j=0;j<pieces->size();j++){
+					const std::string &piece=(*pieces)[j];
+					if(piece.size()!=fwrite(piece.data(), 1, piece.size(), dst))
+						throw std::runtime_error("RenderWorld : Couldn't write scanlines.");
+				}
+			});
 		}
+		if(writing.valid())
+			writing.get();
+		
+		std::string trailer=encoder->trailer();
+		if(trailer.size()!=fwrite(trailer.data(), 1, trailer.size(), dst))
+			throw std::runtime_error("RenderWorld : Couldn't write image trailer.");
 		
 		if(dst!=stdout)
 			fclose(dst);
 	}catch(...){
 		if(dst!=stdout)
 			fclose(dst);
+		throw;
 	}
 }
 
+void RenderWorld(const std::string &fileName, const world_t &world)
+{
+	HPCE_TRACE_SPAN("RenderWorld");
+	RenderRows(fileName, world.w, world.h, [&](unsigned y, unsigned, const cell_flags_t *&properties, const float *&state){
+		properties=&world.properties[(size_t)y*world.w];
+		state=&world.state[(size_t)y*world.w];
+	});
+}
+
+void RenderWorld(const std::string &fileName, WorldRowReader &src)
+{
+	HPCE_TRACE_SPAN("RenderWorld");
+	unsigned w=src.width();
+	if(MakeImageEncoder(fileName, w, src.height())->topDown()){
+		// The rows come bottom first, and the image starts at the top
+		world_t world;
+		world.w=w;
+		world.h=src.height();
+		world.alpha=src.alpha();
+		world.t=0.0f;
+		world.properties.resize((size_t)w*world.h);
+		world.state.resize((size_t)w*world.h);
+		for(unsigned y=0;y<world.h;y++){
+			if(!src.next())
+				throw std::invalid_argument("RenderWorld : World ended early.");
+			std::copy(src.properties(), src.properties()+w, &world.properties[(size_t)y*w]);
+			std::copy(src.state(), src.state()+w, &world.state[(size_t)y*w]);
+		}
+		src.next();
+		RenderWorld(fileName, world);
+		return;
+	}
+	properties_vector_t blockProperties;
+	state_vector_t blockState;
+	RenderRows(fileName, w, src.height(), [&](unsigned, unsigned rows, const cell_flags_t *&properties, const float *&state){
+		blockProperties.resize((size_t)rows*w);
+		blockState.resize((size_t)rows*w);
+		for(unsigned r=0;r<rows;r++){
+			if(!src.next())
+				throw std::invalid_argument("RenderWorld : World ended early.");
+			std::copy(src.properties(), src.properties()+w, &blockProperties[(size_t)r*w]);
+			std::copy(src.state(), src.state()+w, &blockState[(size_t)r*w]);
+		}
+		properties=blockProperties.data();
+		state=blockState.data();
+	});
+	// Checks the End after the last row
+	src.next();
+}
+
 //! Reference world stepping program
 /*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 	\param n Number of times to step the world
@@ -317,13 +615,14 @@ void RenderWorld(const std::string &fileName, const world_t &world)
 */
 void StepWorld(world_t &world, float dt, unsigned n)
 {
+	HPCE_TRACE_SPAN("StepWorld");
 	unsigned w=world.w, h=world.h;
 	
 	float outer=world.alpha*dt;		// We spread alpha to other cells per time
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	state_vector_t buffer(w*h);
 	
 	for(unsigned t=0;t<n;t++){
 		for(unsigned y=0;y<h;y++){
@@ -383,4 +682,96 @@ void StepWorld(world_t &world, float dt, unsigned n)
 }
 
 	
+//! Maps a float onto an integer line where adjacent floats are adjacent integers
+static int64_t OrderedFloatBits(float f)
+{
+	int32_t bits;
+	memcpy(&bits, &f, 4);
+	// Negative floats count down from -0, so flip them to keep the order
+	return bits<0 ? (int64_t)INT32_MIN-bits : (int64_t)bits;
+}
+
+world_diff_t CompareWorlds(const world_t &a, const world_t &b, double absTolerance, uint32_t ulpTolerance)
+{
+	world_diff_t diff;
+	diff.sameShape=(a.w==b.w) && (a.h==b.h);
+	diff.sameAlpha=(a.alpha==b.alpha);
+	diff.propertiesMismatched=0;
+	diff.maxAbs=0;
+	diff.maxUlp=0;
+	diff.rms=0;
+	diff.worstX=diff.worstY=0;
+	diff.worstA=diff.worstB=0;
+	diff.cellsOutside=0;
+	if(!diff.sameShape)
+		return diff;
+	
+	unsigned w=a.w, h=a.h;
+	double sumSq=0;
+	for(unsigned y=0;y<h;y++){
+		for(unsigned x=0;x<w;x++){
+			unsigned index=y*w+x;
+			if(a.properties[index]!=b.properties[index])
+				diff.propertiesMismatched++;
+			
+			float va=a.state[index], vb=b.state[index];
+			double d=std::abs((double)va-(double)vb);
+			int64_t ulp64=OrderedFloatBits(va)-OrderedFloatBits(vb);
+			uint32_t ulp=(uint32_t)std::min<int64_t>(ulp64<0 ? -ulp64 : ulp64, UINT32_MAX);
+			
+			if(d!=d)
+				d=std::numeric_limits<double>::infinity();	// NaN is never close to anything
+			
+			sumSq+=d*d;
+			if(index==0 || d>diff.maxAbs){
+				diff.maxAbs=d;
+				diff.worstX=x;
+				diff.worstY=y;
+				diff.worstA=va;
+				diff.worstB=vb;
+			}
+			diff.maxUlp=std::max(diff.maxUlp, ulp);
+			if(d>absTolerance && ulp>ulpTolerance)
+				diff.cellsOutside++;
+		}
+	}
+	if(w && h)
+		diff.rms=std::sqrt(sumSq/(w*h));
+	return diff;
+}
+
+//! The splitmix64 finaliser, so every input bit reaches every output bit
+static uint64_t MixBits(uint64_t x)
+{
+	x^=x>>30;
+	x*=0xBF58476D1CE4E5B9ull;
+	x^=x>>27;
+	x*=0x94D049BB133111EBull;
+	return x^(x>>31);
+}
+
+uint64_t GeometryHash(const world_t &world)
+{
+	const uint64_t K=0x9E3779B97F4A7C15ull;
+	size_t n=world.properties.size();
+	const cell_flags_t *p=world.properties.data();
+	// Independent lanes, so the multiplies overlap
+	uint64_t lanes[4]={MixBits(world.w), MixBits(world.h), K, ~K};
+	size_t i=0;
+	for(;i+4<=n;i+=4){
+		for(unsigned j=0;j<4;j++){
+			lanes[j]=(lanes[j]^(uint32_t)p[i+j])*K;
+			lanes[j]^=lanes[j]>>29;
+		}
+	}
+	for(;i<n;i++){
+		lanes[i%4]=(lanes[i%4]^(uint32_t)p[i])*K;
+	}
+	uint64_t h=MixBits(n);
+	for(unsigned j=0;j<4;j++){
+		h=MixBits(h^lanes[j]);
+	}
+	return h;
+}
+
 }; // namepspace hpce
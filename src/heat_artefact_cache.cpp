@@ -0,0 +1,311 @@
+#include "heat_artefact_cache.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace hpce{
+
+static const char *ArtefactHeader="HPCEArtefactV0";
+
+// At the start of every cached file, the payload follows it
+struct artefact_header_t
+{
+	char magic[16];
+	uint64_t hash;
+	uint32_t w, h;
+	uint32_t version;
+	uint32_t checksum;	// of the payload, see PayloadChecksum
+	uint64_t bytes;
+	char name[80];	// pads the header to 128, so the payload stays aligned
+};
+
+GeometryArtefact::GeometryArtefact()
+	: m_map(0)
+	, m_mapSize(0)
+	, m_data(0)
+	, m_size(0)
+{}
+
+GeometryArtefact::GeometryArtefact(GeometryArtefact &&o)
+	: m_map(o.m_map)
+	, m_mapSize(o.m_mapSize)
+	, m_built(std::move(o.m_built))
+	, m_data(o.m_data)
+	, m_size(o.m_size)
+{
+	o.m_map=0;
+	o.m_mapSize=0;
+	o.m_data=0;
+	o.m_size=0;
+}
+
+GeometryArtefact &GeometryArtefact::operator=(GeometryArtefact &&o)
+{
+	if(this!=&o){
+		release();
+		m_map=o.m_map;
+		m_mapSize=o.m_mapSize;
+		m_built=std::move(o.m_built);
+		m_data=o.m_data;
+		m_size=o.m_size;
+		o.m_map=0;
+		o.m_mapSize=0;
+		o.m_data=0;
+		o.m_size=0;
+	}
+	return *this;
+}
+
+GeometryArtefact::~GeometryArtefact()
+{
+	release();
+}
+
+void GeometryArtefact::release()
+{
+#ifndef _WIN32
+	if(m_map)
+		munmap(m_map, m_mapSize);
+#endif
+	m_map=0;
+	m_mapSize=0;
+}
+
+std::string ArtefactCacheDir()
+{
+	const char *d=getenv("HPCE_CACHE_DIR");
+	if(!d || std::string(d)=="off")
+		return std::string();
+	return d;
+}
+
+uint64_t ArtefactCacheLimit()
+{
+	const char *m=getenv("HPCE_CACHE_MAX_MB");
+	return (m ? strtoull(m, NULL, 10) : 1024)<<20;
+}
+
+//! Catches a payload that was cut short or corrupted on disk
+/*! Four independent lanes of 8 bytes, as GeometryHash does, so checking a
+	mapped artefact runs at close to memory speed.
+*/
+static uint32_t PayloadChecksum(const uint8_t *p, size_t n)
+{
+	const uint64_t K=0x9E3779B97F4A7C15ull;
+	uint64_t lanes[4]={K, ~K, K>>1, ~K>>1};
+	size_t i=0;
+	for(;i+32<=n;i+=32){
+		for(unsigned j=0;j<4;j++){
+			uint64_t v;
+			memcpy(&v, p+i+8*j, 8);
+			lanes[j]=(lanes[j]^v)*K;
+			lanes[j]^=lanes[j]>>29;
+		}
+	}
+	uint64_t h=(uint64_t)n*K;
+	for(;i<n;i++){
+		h=(h^p[i])*K;
+	}
+	for(unsigned j=0;j<4;j++){
+		h=(h^lanes[j])*K;
+		h^=h>>32;
+	}
+	return (uint32_t)h;
+}
+
+#ifndef _WIN32
+
+static void FillHeader(artefact_header_t &header, const world_t &world, uint64_t hash, const char *name, unsigned version, size_t bytes)
+{
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, ArtefactHeader, sizeof(header.magic)-1);
+	header.hash=hash;
+	header.w=world.w;
+	header.h=world.h;
+	header.version=version;
+	header.bytes=bytes;
+	strncpy(header.name, name, sizeof(header.name)-1);
+}
+
+//! Maps path if it holds exactly the artefact expected, otherwise returns false
+static bool MapArtefact(const std::string &path, const artefact_header_t &expected, void *&map, size_t &mapSize)
+{
+	int fd=open(path.c_str(), O_RDONLY);
+	if(fd<0)
+		return false;
+	struct stat st;
+	size_t total=sizeof(artefact_header_t)+expected.bytes;
+	if(fstat(fd, &st) || (uint64_t)st.st_size!=total){
+		close(fd);
+		return false;
+	}
+	futimens(fd, NULL);	// recently used, so trimmed last
+	void *p=mmap(0, total, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);	// the mapping keeps the file
+	if(p==MAP_FAILED)
+		return false;
+	// A file that is torn or corrupted is rebuilt, rather than trusted
+	// by engines that index it without checking
+	artefact_header_t found;
+	memcpy(&found, p, sizeof(found));
+	uint32_t checksum=found.checksum;
+	found.checksum=0;
+	if(memcmp(&found, &expected, sizeof(artefact_header_t))
+		|| checksum!=PayloadChecksum((const uint8_t*)p+sizeof(artefact_header_t), expected.bytes)){
+		munmap(p, total);
+		return false;
+	}
+	map=p;
+	mapSize=total;
+	return true;
+}
+
+//! Writes the artefact to a temporary file in dir and renames it to path
+static void StoreArtefact(const std::string &dir, const std::string &path, const artefact_header_t &header, const uint8_t *data)
+{
+	mkdir(dir.c_str(), 0777);	// usually there already
+
+	std::string pattern=path+".tmp_XXXXXX";
+	std::vector<char> temp(pattern.begin(), pattern.end());
+	temp.push_back(0);
+	int fd=mkstemp(&temp[0]);
+	if(fd<0)
+		throw std::runtime_error("Couldn't create a file in '"+dir+"' : "+strerror(errno));
+	fchmod(fd, 0644);	// mkstemp makes it private, but the cache can be shared
+
+	const char *pieces[2]={(const char*)&header, (const char*)data};
+	size_t sizes[2]={sizeof(header), (size_t)header.bytes};
+	uint64_t offset=0;
+	for(unsigned i=0;i<2;i++){
+		const char *p=pieces[i];
+		size_t size=sizes[i];
+		while(size){
+			ssize_t put=pwrite(fd, p, size, offset);
+			if(put<0){
+				std::string err=strerror(errno);
+				close(fd);
+				unlink(&temp[0]);
+				throw std::runtime_error("Couldn't write '"+path+"' : "+err);
+			}
+			p+=put;
+			offset+=put;
+			size-=put;
+		}
+	}
+	// A reader either sees the old file, no file, or all of this one
+	close(fd);
+	if(rename(&temp[0], path.c_str())){
+		std::string err=strerror(errno);
+		unlink(&temp[0]);
+		throw std::runtime_error("Couldn't rename to '"+path+"' : "+err);
+	}
+}
+
+//! Deletes the least recently used artefacts until dir holds at most limit bytes
+/*! Only files named as artefacts are counted or deleted. A process that
+	has one mapped keeps its bytes until it unmaps them.
+*/
+static void TrimCache(const std::string &dir, uint64_t limit)
+{
+	DIR *d=opendir(dir.c_str());
+	if(!d)
+		return;
+	std::vector<std::pair<uint64_t,std::string> > files;	// last used in ns, path
+	uint64_t total=0;
+	while(struct dirent *e=readdir(d)){
+		std::string name=e->d_name;
+		if(name.size()<4 || name.compare(name.size()-4, 4, ".bin") || name.find("_v")==std::string::npos)
+			continue;
+		struct stat st;
+		std::string path=dir+"/"+name;
+		if(stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+			continue;
+		files.push_back(std::make_pair((uint64_t)st.st_mtim.tv_sec*1000000000u+st.st_mtim.tv_nsec, path));
+		total+=st.st_size;
+	}
+	closedir(d);
+	if(total<=limit)
+		return;
+
+	std::sort(files.begin(), files.end());
+	for(unsigned i=0;i<files.size() && total>limit;i++){
+		struct stat st;
+		if(!stat(files[i].second.c_str(), &st) && !unlink(files[i].second.c_str()))
+			total-=std::min<uint64_t>(total, st.st_size);
+	}
+}
+
+#endif
+
+GeometryArtefact GetGeometryArtefact(const world_t &world, const char *name, unsigned version,
+	size_t bytes, const std::function<void(uint8_t *dst)> &build)
+{
+	HPCE_TRACE_SPAN("artefact_cache");
+	GeometryArtefact res;
+	std::string dir=ArtefactCacheDir();
+
+#ifndef _WIN32
+	artefact_header_t header;
+	std::string path;
+	if(!dir.empty()){
+		uint64_t hash=GeometryHash(world);
+		FillHeader(header, world, hash, name, version, bytes);
+		char key[64];
+		snprintf(key, sizeof(key), "%016llx_%ux%u_", (unsigned long long)hash, world.w, world.h);
+		path=dir+"/"+key+name+"_v"+std::to_string(version)+".bin";
+
+		if(MapArtefact(path, header, res.m_map, res.m_mapSize)){
+			res.m_data=(const uint8_t*)res.m_map+sizeof(artefact_header_t);
+			res.m_size=bytes;
+			return res;
+		}
+	}
+#endif
+
+	{
+		HPCE_TRACE_SPAN("artefact_cache:build");
+		res.m_built.resize(bytes);
+		build(res.m_built.data());
+		res.m_data=res.m_built.data();
+		res.m_size=bytes;
+	}
+
+#ifndef _WIN32
+	if(!dir.empty()){
+		try{
+			HPCE_TRACE_SPAN("artefact_cache:store");
+			header.checksum=PayloadChecksum(res.m_data, bytes);
+			StoreArtefact(dir, path, header, res.m_data);
+			uint64_t limit=ArtefactCacheLimit();
+			if(limit)
+				TrimCache(dir, limit);
+		}catch(const std::exception &e){
+			// The cache only saves time, so a run carries on without it
+			static std::atomic<bool> warned(false);
+			if(!warned.exchange(true))
+				std::cerr<<"GetGeometryArtefact : Not caching, "<<e.what()<<std::endl;
+		}
+	}
+#endif
+	return res;
+}
+
+}; // namespace hpce
@@ -0,0 +1,723 @@
+#include "heat.hpp"
+#include "heat_chunked.hpp"
+#include "heat_engine.hpp"
+#include "heat_parallel.hpp"
+#include "heat_roofline.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <set>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <cmath>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* Benchmarks engines over a sweep of world sizes and step counts.
+
+	Each trial loads a MakeTestWorld from memory, steps it and saves it back
+	to memory, timing the three phases separately. Process startup and the
+	pipes of the makefile targets are not part of any phase.
+
+	heat_bench [options]
+		--engines=a,b,...	engines to run, or "all" (default reference)
+		--sizes=16,256,...	world widths, worlds are square (default 64,256,1024)
+		--steps=1,64,...	step counts (default 1,64)
+		--trials=N	timed trials per case (default 5)
+		--warmup=N	untimed trials per case (default 1)
+		--batch=K	step K copies of each world together with StepWorlds,
+			every phase then covers all K (default 1, one world with step)
+		--text	load and save in the text format rather than binary
+		--chunked	load and save as compressed tiles, see SaveWorldChunked,
+			the bytes of the load and save rows then show the compression
+		--file=path	load from and save to a file rather than memory, binary
+			worlds then go through LoadWorldFile and SaveWorldFile
+		--direct	open the file with O_DIRECT
+		--format=csv|json	output on stdout (default csv)
+		--label=str	tag for the results, e.g. a commit hash
+		--no-roofline	don't measure the host's roofs
+
+	Each step result is placed on a roofline: the engine's bytes and flops
+	per cell update (from the engine table) give its arithmetic intensity,
+	and the host's STREAM bandwidth and multiply-add peak, measured before
+	the sweep, give the best it could do at that intensity. roof_fraction
+	is how much of that the engine reached, and a summary goes to stderr.
+	OpenCL engines on a device that isn't a CPU get no roof, as the host's
+	roofs say nothing about a GPU.
+
+	Baselines are kept per host, keyed by a fingerprint of the CPU model,
+	thread count and OpenCL device, as one file per host in --baseline-dir
+	(default bench/baselines):
+		--save-baseline	record the step timings of this run as the baseline
+		--append-baseline	add this run's timings to the baseline, so it
+			captures the drift between runs as well as within one
+		--check-baseline	compare against the baseline, exit 1 on a regression
+			or a missing case
+		--threshold=x	smallest slowdown of the median that counts (default 0.10)
+		--alpha=p	significance the slowdown must reach (default 0.01)
+	A case regresses only if its median step time is more than threshold
+	slower than the baseline AND a one-sided Mann-Whitney U test says the
+	new trials are slower with p<alpha, so noise alone doesn't fail it.
+	A case in the baseline that this run has no timing for, because its
+	engine threw or wasn't run, fails the check too, as does a case this
+	run timed that the baseline doesn't have. A case whose engine threw
+	while the baseline was recorded, such as an OpenCL engine on a host
+	without a device, is kept as unavailable rather than timed, and is
+	skipped by the check for as long as it keeps throwing.
+*/
+
+namespace{
+
+	std::vector<std::string> SplitList(const std::string &list)
+	{
+		std::vector<std::string> res;
+		std::stringstream src(list);
+		std::string item;
+		while(std::getline(src, item, ',')){
+			if(!item.empty())
+				res.push_back(item);
+		}
+		return res;
+	}
+
+	std::vector<unsigned> ParseUnsignedList(const std::string &list)
+	{
+		std::vector<std::string> items=SplitList(list);
+		std::vector<unsigned> res;
+		for(unsigned i=0;i<items.size();i++){
+			res.push_back(atoi(items[i].c_str()));
+		}
+		return res;
+	}
+
+	//! Linear interpolation between the closest ranks, samples must be sorted
+	double Percentile(const std::vector<double> &sorted, double p)
+	{
+		if(sorted.empty())
+			return 0;
+		double pos=p*(sorted.size()-1);
+		unsigned lo=(unsigned)pos;
+		unsigned hi=std::min(lo+1, (unsigned)sorted.size()-1);
+		return sorted[lo]+(pos-lo)*(sorted[hi]-sorted[lo]);
+	}
+
+	struct result_t
+	{
+		std::string engine;
+		unsigned size;
+		unsigned steps;
+		unsigned batch;
+		std::string phase;
+		std::vector<double> seconds;	// sorted once the case is done
+		double cellUpdates;	// per trial, 0 if the phase doesn't step
+		double bytes;	// per trial
+		double flops;	// per trial
+		double roof;	// attainable flops per second, 0 if unknown
+		bool offHost;	// stepped on an OpenCL device that isn't the host CPU
+	};
+
+	double Rate(double amount, const std::vector<double> &sorted)
+	{
+		double median=Percentile(sorted, 0.5);
+		return median>0 ? amount/median : 0;
+	}
+
+	double RoofFraction(const result_t &r)
+	{
+		return r.roof>0 ? Rate(r.flops, r.seconds)/r.roof : 0;
+	}
+
+	std::string Quote(const std::string &s)
+	{
+		std::string res="\"";
+		for(unsigned i=0;i<s.size();i++){
+			if(s[i]=='"' || s[i]=='\\')
+				res+='\\';
+			res+=s[i];
+		}
+		return res+"\"";
+	}
+
+	std::string HostName()
+	{
+#ifdef _WIN32
+		const char *c=getenv("COMPUTERNAME");
+		return c ? c : "unknown";
+#else
+		char buffer[256]={0};
+		if(gethostname(buffer, sizeof(buffer)-1))
+			return "unknown";
+		return buffer;
+#endif
+	}
+
+	void WriteCsv(std::ostream &dst, const std::string &label, const std::vector<result_t> &results)
+	{
+		dst<<"label,engine,size,steps,batch,phase,trials,min_s,p10_s,median_s,p90_s,max_s,cell_updates_per_s,gb_per_s,gflops_per_s,roof_gflops_per_s,roof_fraction\n";
+		for(unsigned i=0;i<results.size();i++){
+			const result_t &r=results[i];
+			double median=Percentile(r.seconds, 0.5);
+			dst<<label<<","<<r.engine<<","<<r.size<<","<<r.steps<<","<<r.batch<<","<<r.phase<<","<<r.seconds.size()
+				<<","<<r.seconds.front()<<","<<Percentile(r.seconds, 0.1)<<","<<median
+				<<","<<Percentile(r.seconds, 0.9)<<","<<r.seconds.back()
+				<<","<<Rate(r.cellUpdates, r.seconds)
+				<<","<<Rate(r.bytes, r.seconds)/1e9
+				<<","<<Rate(r.flops, r.seconds)/1e9
+				<<","<<r.roof/1e9<<","<<RoofFraction(r)<<"\n";
+		}
+	}
+
+	void WriteJson(std::ostream &dst, const std::string &label, const std::string &fingerprint, const hpce::roofline_t &roofline, const std::vector<result_t> &results)
+	{
+		dst<<"{\n";
+		dst<<"  \"label\": "<<Quote(label)<<",\n";
+		dst<<"  \"host\": "<<Quote(HostName())<<",\n";
+		dst<<"  \"fingerprint\": "<<Quote(fingerprint)<<",\n";
+		dst<<"  \"threads\": "<<hpce::ParallelThreads()<<",\n";
+		dst<<"  \"timestamp\": "<<(long long)time(0)<<",\n";
+		dst<<"  \"roofline\": {\"stream_gb_per_s\": "<<roofline.bandwidth/1e9
+			<<", \"peak_gflops_per_s\": "<<roofline.flops/1e9
+			<<", \"ridge_flops_per_byte\": "<<roofline.ridge()<<"},\n";
+		dst<<"  \"results\": [";
+		for(unsigned i=0;i<results.size();i++){
+			const result_t &r=results[i];
+			double median=Percentile(r.seconds, 0.5);
+			dst<<(i?",":"")<<"\n    {\"engine\": "<<Quote(r.engine)
+				<<", \"size\": "<<r.size<<", \"steps\": "<<r.steps<<", \"batch\": "<<r.batch
+				<<", \"phase\": "<<Quote(r.phase)<<", \"trials\": "<<r.seconds.size()
+				<<", \"min_s\": "<<r.seconds.front()
+				<<", \"p10_s\": "<<Percentile(r.seconds, 0.1)
+				<<", \"median_s\": "<<median
+				<<", \"p90_s\": "<<Percentile(r.seconds, 0.9)
+				<<", \"max_s\": "<<r.seconds.back()
+				<<", \"cell_updates_per_s\": "<<Rate(r.cellUpdates, r.seconds)
+				<<", \"gb_per_s\": "<<Rate(r.bytes, r.seconds)/1e9
+				<<", \"gflops_per_s\": "<<Rate(r.flops, r.seconds)/1e9
+				<<", \"roof_gflops_per_s\": "<<r.roof/1e9
+				<<", \"roof_fraction\": "<<RoofFraction(r)<<"}";
+		}
+		dst<<"\n  ]\n";
+		dst<<"}"<<std::endl;
+	}
+
+	//! The OpenCL device the engines would pick, throws if there is none
+	cl::Device SelectedOpenCLDevice()
+	{
+		std::vector<cl::Platform> platforms;
+		cl::Platform::get(&platforms);
+		const char *p=getenv("HPCE_SELECT_PLATFORM");
+		cl::Platform platform=platforms.at(p ? atoi(p) : 0);
+		std::vector<cl::Device> devices;
+		platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+		const char *d=getenv("HPCE_SELECT_DEVICE");
+		return devices.at(d ? atoi(d) : 0);
+	}
+
+	//! Name of the OpenCL device the engines would pick, or "none"
+	std::string OpenCLDeviceName()
+	{
+		try{
+			return SelectedOpenCLDevice().getInfo<CL_DEVICE_NAME>();
+		}catch(...){
+			return "none";
+		}
+	}
+
+	//! True if the engine steps on the OpenCL device rather than on the host
+	bool RunsOnOpenCL(const hpce::engine_t &engine)
+	{
+		std::string name=engine.name;
+		if(name=="v6_half_precision"){
+			const char *d=getenv("HPCE_HALF_DEVICE");
+			return d && std::string(d)=="opencl";
+		}
+		return name=="v3_opencl" || name=="v4_double_buffered" || name=="v5_packed_properties";
+	}
+
+	//! True if the host's roofs bound the engine, i.e. it runs on the host CPU
+	bool HostRoofsApply(const hpce::engine_t &engine)
+	{
+		if(!RunsOnOpenCL(engine))
+			return true;
+		try{
+			return (SelectedOpenCLDevice().getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)!=0;
+		}catch(...){
+			return true;	// there is no device, and the engine will throw anyway
+		}
+	}
+
+	std::string CpuModel()
+	{
+		std::ifstream src("/proc/cpuinfo");
+		std::string line;
+		while(std::getline(src, line)){
+			if(!line.compare(0, 10, "model name")){
+				std::string::size_type pos=line.find(':');
+				if(pos!=std::string::npos)
+					return line.substr(line.find_first_not_of(" \t", pos+1));
+			}
+		}
+		return "unknown";
+	}
+
+	//! What a baseline is only valid for: the same CPU, threads and OpenCL device
+	std::string HostFingerprint()
+	{
+		std::stringstream acc;
+		acc<<"cpu="<<CpuModel()<<";threads="<<hpce::ParallelThreads()<<";cl="<<OpenCLDeviceName();
+		return acc.str();
+	}
+
+	//! File the baseline of a fingerprint lives in, named by its FNV-1a hash
+	std::string BaselineFile(const std::string &dir, const std::string &fingerprint)
+	{
+		uint64_t hash=14695981039346656037ull;
+		for(unsigned i=0;i<fingerprint.size();i++){
+			hash=(hash^(unsigned char)fingerprint[i])*1099511628211ull;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+		return dir+"/"+name+".txt";
+	}
+
+	//! Step timings per case, keyed by "engine size steps"
+	struct baseline_t
+	{
+		std::map<std::string,std::vector<double> > samples;
+		std::set<std::string> unavailable;	// cases whose engine threw, with no samples
+	};
+
+	//! Reads a baseline, where a line is either a case and its timings, or
+	//! "unavailable" and a case
+	baseline_t LoadBaseline(const std::string &fileName)
+	{
+		std::ifstream src(fileName.c_str());
+		if(!src.is_open())
+			throw std::runtime_error("LoadBaseline : No baseline for this host in '"+fileName+"', record one with --save-baseline.");
+		baseline_t res;
+		std::string line;
+		while(std::getline(src, line)){
+			if(line.empty() || line[0]=='#')
+				continue;
+			std::stringstream fields(line);
+			std::string engine;
+			fields>>engine;
+			bool unavailable=(engine=="unavailable");
+			if(unavailable)
+				fields>>engine;
+			unsigned size, steps;
+			fields>>size>>steps;
+			std::stringstream key;
+			key<<engine<<" "<<size<<" "<<steps;
+			if(unavailable){
+				res.unavailable.insert(key.str());
+				continue;
+			}
+			double seconds;
+			while(fields>>seconds){
+				res.samples[key.str()].push_back(seconds);
+			}
+		}
+		return res;
+	}
+
+	//! Key of a case in a baseline
+	std::string BaselineKey(const result_t &r)
+	{
+		std::stringstream key;
+		key<<r.engine<<" "<<r.size<<" "<<r.steps;
+		return key.str();
+	}
+
+	//! Writes the step timings per case, pooled over however many runs went in
+	void SaveBaseline(const std::string &fileName, const std::string &fingerprint, const std::string &label, const baseline_t &baseline)
+	{
+		std::ofstream dst(fileName.c_str());
+		if(!dst.is_open())
+			throw std::runtime_error("SaveBaseline : Couldn't open '"+fileName+"'.");
+		dst.precision(9);
+		dst<<"# heat_bench baseline, step seconds per trial\n";
+		dst<<"# host "<<fingerprint<<"\n";
+		dst<<"# label "<<label<<"\n";
+		std::map<std::string,std::vector<double> >::const_iterator it;
+		for(it=baseline.samples.begin();it!=baseline.samples.end();++it){
+			dst<<it->first;
+			for(unsigned j=0;j<it->second.size();j++){
+				dst<<" "<<it->second[j];
+			}
+			dst<<"\n";
+		}
+		std::set<std::string>::const_iterator u;
+		for(u=baseline.unavailable.begin();u!=baseline.unavailable.end();++u){
+			dst<<"unavailable "<<*u<<"\n";
+		}
+	}
+
+	//! One-sided Mann-Whitney U test that the samples in slower are larger
+	/*! \return p value from the normal approximation, fine for 5+ trials */
+	double MannWhitneyGreater(const std::vector<double> &slower, const std::vector<double> &base)
+	{
+		double u=0;
+		for(unsigned i=0;i<slower.size();i++){
+			for(unsigned j=0;j<base.size();j++){
+				if(slower[i]>base[j])
+					u+=1;
+				else if(slower[i]==base[j])
+					u+=0.5;
+			}
+		}
+		double n1=slower.size(), n2=base.size();
+		double mean=n1*n2/2;
+		double sd=std::sqrt(n1*n2*(n1+n2+1)/12);
+		if(sd==0)
+			return 1;
+		double z=(u-0.5-mean)/sd;	// continuity correction
+		return 0.5*std::erfc(z/std::sqrt(2.0));
+	}
+
+	//! Compares the step timings against the baseline
+	/*! \param failed Cases whose engine threw in this run
+		\return Number of cases that regressed or are missing on either side,
+			where a case that was unavailable in the baseline and still is
+			doesn't count
+	*/
+	unsigned CheckBaseline(const baseline_t &baseline, const std::vector<result_t> &results, const std::vector<std::string> &failed, double threshold, double alpha)
+	{
+		unsigned regressions=0;
+		std::map<std::string,bool> timed;
+		for(unsigned i=0;i<results.size();i++){
+			const result_t &r=results[i];
+			if(r.phase!="step")
+				continue;
+			std::string key=BaselineKey(r);
+			timed[key]=true;
+			std::map<std::string,std::vector<double> >::const_iterator it=baseline.samples.find(key);
+			if(it==baseline.samples.end()){
+				if(baseline.unavailable.count(key)){
+					std::cerr<<"NEW "<<key<<" was unavailable when the baseline was recorded"<<std::endl;
+				}else{
+					regressions++;
+					std::cerr<<"MISSING "<<key<<" has no baseline"<<std::endl;
+				}
+				continue;
+			}
+			std::vector<double> base=it->second;
+			std::sort(base.begin(), base.end());
+			double medianBase=Percentile(base, 0.5), medianNew=Percentile(r.seconds, 0.5);
+			double change=medianBase>0 ? medianNew/medianBase-1 : 0;
+			double p=MannWhitneyGreater(r.seconds, base);
+			bool regressed=(change>threshold) && (p<alpha);
+			if(regressed)
+				regressions++;
+			std::cerr<<(regressed ? "REGRESSION " : "ok ")<<key
+				<<" median "<<medianBase<<"s -> "<<medianNew<<"s ("<<(change>=0?"+":"")<<100*change<<"%, p="<<p<<")"<<std::endl;
+		}
+		std::map<std::string,std::vector<double> >::const_iterator it;
+		for(it=baseline.samples.begin();it!=baseline.samples.end();++it){
+			if(!timed.count(it->first)){
+				regressions++;
+				bool threw=std::find(failed.begin(), failed.end(), it->first)!=failed.end();
+				std::cerr<<"MISSING "<<it->first<<(threw ? " threw" : " has no result in this run")<<std::endl;
+			}
+		}
+		for(unsigned i=0;i<failed.size();i++){
+			if(baseline.samples.count(failed[i])){
+				continue;	// counted as missing above
+			}else if(baseline.unavailable.count(failed[i])){
+				std::cerr<<"skipped "<<failed[i]<<" is unavailable, as in the baseline"<<std::endl;
+			}else{
+				regressions++;
+				std::cerr<<"MISSING "<<failed[i]<<" threw, and has no baseline"<<std::endl;
+			}
+		}
+		return regressions;
+	}
+
+	//! One line per step result: where the engine sits and what limits it
+	void ReportRoofline(std::ostream &dst, const hpce::roofline_t &roofline, const std::vector<result_t> &results)
+	{
+		dst<<"roofline: stream "<<roofline.bandwidth/1e9<<" GB/s, peak "<<roofline.flops/1e9
+			<<" GFLOP/s, ridge "<<roofline.ridge()<<" flop/byte"<<std::endl;
+		for(unsigned i=0;i<results.size();i++){
+			const result_t &r=results[i];
+			if(r.phase!="step")
+				continue;
+			dst<<"roofline: "<<r.engine<<" size="<<r.size<<" steps="<<r.steps;
+			if(r.batch>1)
+				dst<<" batch="<<r.batch;
+			if(r.bytes<=0 || r.flops<=0){
+				dst<<" has no traffic model"<<std::endl;
+				continue;
+			}
+			if(r.offHost){
+				dst<<" runs on the OpenCL device, which the host roofs don't bound"<<std::endl;
+				continue;
+			}
+			double intensity=r.flops/r.bytes;
+			dst<<" intensity "<<intensity<<" flop/byte, "<<Rate(r.flops, r.seconds)/1e9<<" of "<<r.roof/1e9
+				<<" GFLOP/s ("<<100*RoofFraction(r)<<"%), "<<(intensity<roofline.ridge() ? "memory" : "compute")<<" bound"<<std::endl;
+		}
+	}
+
+	double SecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	}
+
+};
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> engineNames(1, "reference");
+	std::vector<unsigned> sizes=ParseUnsignedList("64,256,1024");
+	std::vector<unsigned> stepCounts=ParseUnsignedList("1,64");
+	unsigned trials=5, warmup=1, batch=1;
+	bool binary=true, chunked=false;
+	std::string file;
+	bool direct=false;
+	std::string format="csv", label;
+	std::string baselineDir="bench/baselines";
+	bool saveBaseline=false, appendBaseline=false, checkBaseline=false;
+	bool roofline=true;
+	double threshold=0.10, alpha=0.01;
+
+	try{
+		for(int i=1;i<argc;i++){
+			std::string arg=argv[i];
+			std::string value=arg.substr(arg.find('=')==std::string::npos ? arg.size() : arg.find('=')+1);
+			if(!arg.compare(0, 10, "--engines=")){
+				engineNames=SplitList(value);
+				if(engineNames.size()==1 && engineNames[0]=="all"){
+					engineNames.clear();
+					for(unsigned j=0;j<hpce::Engines().size();j++){
+						engineNames.push_back(hpce::Engines()[j].name);
+					}
+				}
+			}else if(!arg.compare(0, 8, "--sizes=")){
+				sizes=ParseUnsignedList(value);
+			}else if(!arg.compare(0, 8, "--steps=")){
+				stepCounts=ParseUnsignedList(value);
+			}else if(!arg.compare(0, 9, "--trials=")){
+				trials=std::max(1, atoi(value.c_str()));
+			}else if(!arg.compare(0, 9, "--warmup=")){
+				warmup=atoi(value.c_str());
+			}else if(!arg.compare(0, 8, "--batch=")){
+				batch=std::max(1, atoi(value.c_str()));
+			}else if(arg=="--text"){
+				binary=false;
+			}else if(arg=="--chunked"){
+				chunked=true;
+			}else if(!arg.compare(0, 7, "--file=")){
+				file=value;
+			}else if(arg=="--direct"){
+				direct=true;
+			}else if(!arg.compare(0, 9, "--format=")){
+				format=value;
+				if(format!="csv" && format!="json")
+					throw std::invalid_argument("--format must be csv or json.");
+			}else if(!arg.compare(0, 8, "--label=")){
+				label=value;
+			}else if(arg=="--no-roofline"){
+				roofline=false;
+			}else if(!arg.compare(0, 15, "--baseline-dir=")){
+				baselineDir=value;
+			}else if(arg=="--save-baseline"){
+				saveBaseline=true;
+			}else if(arg=="--append-baseline"){
+				saveBaseline=true;
+				appendBaseline=true;
+			}else if(arg=="--check-baseline"){
+				checkBaseline=true;
+			}else if(!arg.compare(0, 12, "--threshold=")){
+				threshold=strtod(value.c_str(), NULL);
+			}else if(!arg.compare(0, 8, "--alpha=")){
+				alpha=strtod(value.c_str(), NULL);
+			}else{
+				throw std::invalid_argument("Unknown option '"+arg+"'.");
+			}
+		}
+
+		if(chunked && !binary)
+			throw std::invalid_argument("Pick one of --text and --chunked.");
+		auto save=[&](std::ostream &dst, const hpce::world_t &world){
+			if(chunked){
+				hpce::SaveWorldChunked(dst, world);
+			}else{
+				hpce::SaveWorld(dst, world, binary);
+			}
+		};
+
+		if(direct && file.empty())
+			throw std::invalid_argument("--direct needs --file.");
+		// Trials load file and save to file.out, so the load isn't of what was just saved
+		auto load=[&](const std::string &serialised){
+			if(!file.empty())
+				return hpce::LoadWorldFile(file, direct);
+			std::stringstream src(serialised);
+			return hpce::LoadWorld(src);
+		};
+		auto saveFile=[&](const hpce::world_t &world){
+			if(chunked){
+				std::ofstream dst((file+".out").c_str(), std::ios::binary);
+				hpce::SaveWorldChunked(dst, world);
+			}else{
+				hpce::SaveWorldFile(file+".out", world, binary, direct);
+			}
+		};
+
+		if(batch>1 && (saveBaseline || checkBaseline))
+			throw std::invalid_argument("Baselines are for single worlds, drop --batch.");
+
+		// Read the baseline first, so a missing one fails before the long run
+		std::string fingerprint=HostFingerprint();
+		std::string baselineFile=BaselineFile(baselineDir, fingerprint);
+		baseline_t baseline;
+		if(checkBaseline){
+			baseline=LoadBaseline(baselineFile);
+			std::cerr<<"heat_bench: Checking against "<<baselineFile<<" for "<<fingerprint<<std::endl;
+		}
+
+		// Measured before the sweep, while nothing else of ours is running
+		hpce::roofline_t roofs={0, 0};
+		if(roofline){
+			roofs=hpce::MeasureRoofline();
+		}
+
+		std::vector<result_t> results;
+		std::vector<std::string> failed;	// cases whose engine threw
+		for(unsigned e=0;e<engineNames.size();e++){
+			const hpce::engine_t &engine=hpce::FindEngine(engineNames[e]);
+			for(unsigned s=0;s<sizes.size();s++){
+				// The serialised world is made once, so every trial loads the same bytes
+				std::stringstream master;
+				save(master, hpce::MakeTestWorld(sizes[s], 0.1f));
+				std::string serialised=master.str();
+				if(!file.empty()){
+					std::ofstream(file.c_str(), std::ios::binary)<<serialised;
+				}
+				double cells=(double)sizes[s]*sizes[s]*batch;
+
+				for(unsigned n=0;n<stepCounts.size();n++){
+					const char *phases[3]={"load", "step", "save"};
+					result_t r[3];
+					for(unsigned p=0;p<3;p++){
+						r[p].engine=engine.name;
+						r[p].size=sizes[s];
+						r[p].steps=stepCounts[n];
+						r[p].batch=batch;
+						r[p].phase=phases[p];
+						r[p].cellUpdates=0;
+						r[p].bytes=(double)serialised.size()*batch;
+						r[p].flops=0;
+						r[p].roof=0;
+						r[p].offHost=false;
+					}
+					r[1].cellUpdates=cells*stepCounts[n];
+					r[1].bytes=r[1].cellUpdates*engine.bytesPerCell;
+					r[1].flops=r[1].cellUpdates*engine.flopsPerCell;
+					r[1].offHost=!HostRoofsApply(engine);
+					r[1].roof=(roofline && !r[1].offHost) ? roofs.attainable(hpce::ArithmeticIntensity(engine)) : 0;
+
+					std::cerr<<"heat_bench: "<<engine.name<<" size="<<sizes[s]<<" steps="<<stepCounts[n]<<" batch="<<batch<<std::endl;
+					try{
+						for(unsigned t=0;t<warmup+trials;t++){
+							std::vector<hpce::world_t> worlds;
+							std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+							for(unsigned k=0;k<batch;k++){
+								worlds.push_back(load(serialised));
+							}
+							double tLoad=SecondsSince(start);
+
+							start=std::chrono::steady_clock::now();
+							if(batch==1){
+								engine.step(worlds[0], 0.1f, stepCounts[n]);
+							}else{
+								hpce::StepWorlds(engine, worlds, std::vector<float>(1, 0.1f), stepCounts[n]);
+							}
+							double tStep=SecondsSince(start);
+
+							std::stringstream dst;
+							start=std::chrono::steady_clock::now();
+							for(unsigned k=0;k<batch;k++){
+								if(file.empty()){
+									save(dst, worlds[k]);
+								}else{
+									saveFile(worlds[k]);
+								}
+							}
+							double tSave=SecondsSince(start);
+
+							if(t>=warmup){
+								r[0].seconds.push_back(tLoad);
+								r[1].seconds.push_back(tStep);
+								r[2].seconds.push_back(tSave);
+							}
+						}
+					}catch(const std::exception &ex){
+						std::cerr<<"heat_bench: Skipping "<<engine.name<<" : "<<ex.what()<<std::endl;
+						failed.push_back(BaselineKey(r[1]));
+						continue;
+					}
+					for(unsigned p=0;p<3;p++){
+						std::sort(r[p].seconds.begin(), r[p].seconds.end());
+						results.push_back(r[p]);
+					}
+				}
+			}
+		}
+
+		if(format=="json"){
+			WriteJson(std::cout, label, fingerprint, roofs, results);
+		}else{
+			WriteCsv(std::cout, label, results);
+		}
+		if(roofline){
+			ReportRoofline(std::cerr, roofs, results);
+		}
+
+		if(saveBaseline){
+			baseline_t pooled;
+			if(appendBaseline && std::ifstream(baselineFile.c_str()).is_open())
+				pooled=LoadBaseline(baselineFile);
+			for(unsigned i=0;i<results.size();i++){
+				if(results[i].phase=="step"){
+					std::vector<double> &samples=pooled.samples[BaselineKey(results[i])];
+					samples.insert(samples.end(), results[i].seconds.begin(), results[i].seconds.end());
+				}
+			}
+			// A case is only unavailable if no run going into the baseline timed it
+			for(unsigned i=0;i<failed.size();i++){
+				pooled.unavailable.insert(failed[i]);
+			}
+			std::map<std::string,std::vector<double> >::const_iterator it;
+			for(it=pooled.samples.begin();it!=pooled.samples.end();++it){
+				pooled.unavailable.erase(it->first);
+			}
+			SaveBaseline(baselineFile, fingerprint, label, pooled);
+			std::cerr<<"heat_bench: Saved baseline "<<baselineFile<<" for "<<fingerprint<<std::endl;
+		}
+		if(checkBaseline){
+			unsigned regressions=CheckBaseline(baseline, results, failed, threshold, alpha);
+			if(regressions){
+				std::cerr<<"heat_bench: "<<regressions<<" case(s) are missing or slower than the baseline beyond noise"<<std::endl;
+				return 1;
+			}
+		}
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include "heat_checkpoint.hpp"
+#include "heat_trace.hpp"
+
+#include <algorithm>
+#include <climits>
+
+namespace hpce{
+
+static double SecondsBetween(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+{
+	return std::chrono::duration<double>(b-a).count();
+}
+
+Checkpointer::Checkpointer(const std::string &fileName, float dt, uint64_t step, uint64_t everySteps, double everySeconds, bool direct)
+	: m_fileName(fileName)
+	, m_dt(dt)
+	, m_everySteps(everySteps)
+	, m_everySeconds(everySeconds)
+	, m_direct(direct)
+	, m_nextStep(step+everySteps)
+	, m_lastTime(std::chrono::steady_clock::now())
+	, m_chunkStep(step)
+	, m_chunkTime(m_lastTime)
+	, m_longestChunk(0)
+	, m_secondsPerStep(0)
+{}
+
+Checkpointer::~Checkpointer()
+{
+	if(m_pending.valid())
+		m_pending.wait();
+}
+
+unsigned Checkpointer::nextChunk(uint64_t step, uint64_t remaining) const
+{
+	uint64_t chunk=remaining;
+	if(m_everySteps){
+		chunk=std::min(chunk, m_nextStep-step);	// update keeps m_nextStep ahead of step
+	}
+	if(m_everySeconds>0){
+		if(m_secondsPerStep>0){
+			double left=m_everySeconds-SecondsBetween(m_lastTime, std::chrono::steady_clock::now());
+			chunk=std::min(chunk, (uint64_t)std::max(1.0, left/m_secondsPerStep));
+		}
+		// The first chunks also pay for the engine's setup, which makes the
+		// steps look slow, so grow into the interval rather than trust them
+		chunk=std::min(chunk, std::max<uint64_t>(1, 2*m_longestChunk));
+	}
+	return (unsigned)std::max<uint64_t>(1, std::min<uint64_t>(chunk, UINT_MAX));
+}
+
+void Checkpointer::update(const world_t &world, uint64_t step)
+{
+	std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+	if(step>m_chunkStep){
+		m_secondsPerStep=SecondsBetween(m_chunkTime, now)/(step-m_chunkStep);
+		m_longestChunk=std::max(m_longestChunk, step-m_chunkStep);
+	}
+	m_chunkStep=step;
+	m_chunkTime=now;
+
+	bool dueSteps=m_everySteps && step>=m_nextStep;
+	bool dueSeconds=m_everySeconds>0 && SecondsBetween(m_lastTime, now)>=m_everySeconds;
+	if(!dueSteps && !dueSeconds)
+		return;
+	while(m_everySteps && m_nextStep<=step){
+		m_nextStep+=m_everySteps;
+	}
+	if(m_pending.valid()){
+		// Writing is slower than stepping, so keep to the schedule and wait
+		HPCE_TRACE_SPAN("checkpoint:wait");
+		m_pending.get();
+	}
+
+	HPCE_TRACE_SPAN("checkpoint:snapshot");
+	std::shared_ptr<world_t> snapshot=std::make_shared<world_t>(world);
+	m_lastTime=now;
+	std::cerr<<"Checkpointing step "<<step<<" to "<<m_fileName<<std::endl;
+
+	std::string fileName=m_fileName;
+	float dt=m_dt;
+	bool direct=m_direct;
+	m_pending=std::async(std::launch::async, [=](){
+		SaveCheckpoint(fileName, *snapshot, step, dt, direct);
+	});
+	// The wait and the copy aren't stepping, so the next chunk is timed from here
+	m_chunkTime=std::chrono::steady_clock::now();
+}
+
+void Checkpointer::finish()
+{
+	if(m_pending.valid())
+		m_pending.get();
+}
+
+}; // namespace hpce
@@ -0,0 +1,282 @@
+#include "heat_chunked.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+#include "heat_varint.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace hpce{
+
+const char *ChunkedWorldHeader="HPCEHeatWorldV0Chunked";
+
+// Tiles bigger than this could overflow a tile's 32-bit size
+static const unsigned MaxTileSize=4096;
+
+static uint32_t FloatBits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, 4);
+	return bits;
+}
+
+//! Compresses the tw x th cells starting at (x0,y0)
+/*! Properties are (run, flags) pairs. State is the zigzagged difference of
+	each cell's bits from the one before it in the tile, and a zero is
+	followed by how many more zeros come after it. Neighbouring
+	temperatures have neighbouring bits, so the differences are short.
+*/
+static std::string EncodeTile(const world_t &world, unsigned x0, unsigned y0, unsigned tw, unsigned th)
+{
+	std::string res;
+	unsigned cells=tw*th;
+	std::vector<uint32_t> props(cells), bits(cells);
+	for(unsigned y=0;y<th;y++){
+		for(unsigned x=0;x<tw;x++){
+			unsigned index=(y0+y)*world.w+x0+x;
+			props[y*tw+x]=world.properties[index];
+			bits[y*tw+x]=FloatBits(world.state[index]);
+		}
+	}
+
+	for(unsigned i=0;i<cells;){
+		unsigned j=i+1;
+		while(j<cells && props[j]==props[i])
+			j++;
+		detail::PutVarint(res, j-i);
+		res+=(char)props[i];
+		i=j;
+	}
+
+	uint32_t prev=0;
+	for(unsigned i=0;i<cells;){
+		uint32_t zz=detail::ZigzagDelta(bits[i], prev);
+		detail::PutVarint(res, zz);
+		if(zz==0){
+			unsigned j=i+1;
+			while(j<cells && bits[j]==prev)
+				j++;
+			detail::PutVarint(res, j-i-1);
+			i=j;
+		}else{
+			prev=bits[i];
+			i++;
+		}
+	}
+	return res;
+}
+
+//! Writes run copies of v to the tile, starting x cells into row dst
+/*! dst and x move on to where the run ends, wrapping onto the next row */
+template<class T>
+static void FillRun(T *&dst, unsigned &x, unsigned tw, unsigned stride, unsigned run, T v)
+{
+	while(run){
+		unsigned n=std::min(run, tw-x);
+		std::fill(dst+x, dst+x+n, v);
+		x+=n;
+		run-=n;
+		if(x==tw){
+			x=0;
+			dst+=stride;
+		}
+	}
+}
+
+//! Inverse of EncodeTile, checking the cells as LoadWorld does
+/*! \param stride Cells between the rows of properties and state */
+static void DecodeTile(const uint8_t *p, const uint8_t *end, unsigned tw, unsigned th,
+	cell_flags_t *properties, float *state, unsigned stride)
+{
+	unsigned cells=tw*th;
+
+	unsigned x=0;
+	for(unsigned i=0;i<cells;){
+		uint32_t run=detail::GetVarint(p, end, "LoadWorldChunked");
+		if(p==end)
+			throw std::invalid_argument("LoadWorldChunked : Corrupt tile, truncated properties.");
+		unsigned flags=*p++;
+		if(run==0 || run>cells-i)
+			throw std::invalid_argument("LoadWorldChunked : Corrupt tile, bad run of properties.");
+		if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
+			throw std::invalid_argument("LoadWorldChunked : Unknown flags for cell.");
+		FillRun(properties, x, tw, stride, run, (cell_flags_t)flags);
+		i+=run;
+	}
+
+	uint32_t prev=0;
+	x=0;
+	for(unsigned i=0;i<cells;){
+		uint32_t zz=detail::GetVarint(p, end, "LoadWorldChunked");
+		unsigned run=1;
+		if(zz==0){
+			uint32_t more=detail::GetVarint(p, end, "LoadWorldChunked");
+			if(more>=cells-i)
+				throw std::invalid_argument("LoadWorldChunked : Corrupt tile, bad run of state.");
+			run+=more;
+		}else{
+			prev=detail::UnzigzagDelta(zz, prev);
+		}
+		float temp;
+		memcpy(&temp, &prev, 4);
+		if(temp<0 || temp>1)
+			throw std::invalid_argument("LoadWorldChunked : Corrupt input file, temperature out of range.");
+		FillRun(state, x, tw, stride, run, temp);
+		i+=run;
+	}
+
+	if(p!=end)
+		throw std::invalid_argument("LoadWorldChunked : Corrupt tile, trailing bytes.");
+}
+
+void SaveWorldChunked(std::ostream &dst, const world_t &world, unsigned tileSize)
+{
+	HPCE_TRACE_SPAN("SaveWorldChunked");
+	if(tileSize==0 || tileSize>MaxTileSize)
+		throw std::invalid_argument("SaveWorldChunked : Tile size must be between 1 and 4096.");
+
+	unsigned across=(world.w+tileSize-1)/tileSize;
+	unsigned down=(world.h+tileSize-1)/tileSize;
+	std::vector<std::string> tiles(across*down);
+	ParallelForRange(0, across*down, [&](unsigned begin, unsigned end){
+		for(unsigned i=begin;i<end;i++){
+			unsigned x0=(i%across)*tileSize, y0=(i/across)*tileSize;
+			unsigned tw=std::min(tileSize, world.w-x0), th=std::min(tileSize, world.h-y0);
+			tiles[i]=EncodeTile(world, x0, y0, tw, th);
+		}
+	});
+
+	dst<<ChunkedWorldHeader<<std::endl;
+	dst<<world.w<<" "<<world.h<<" "<<world.alpha<<" "<<tileSize<<std::endl;
+	dst<<"-";
+	std::vector<uint32_t> sizes(tiles.size());
+	for(unsigned i=0;i<tiles.size();i++){
+		sizes[i]=tiles[i].size();
+	}
+	if(!sizes.empty())
+		dst.write((const char*)&sizes[0], 4*sizes.size());
+	for(unsigned i=0;i<tiles.size();i++){
+		dst.write(tiles[i].data(), tiles[i].size());
+	}
+	dst<<"End"<<std::endl;
+}
+
+ChunkedWorldReader::ChunkedWorldReader(std::istream &src)
+	: m_src(src)
+{
+	std::string header;
+	src>>header;
+	readHeader(header);
+}
+
+ChunkedWorldReader::ChunkedWorldReader(std::istream &src, const std::string &header)
+	: m_src(src)
+{
+	readHeader(header);
+}
+
+void ChunkedWorldReader::readHeader(const std::string &header)
+{
+	if(header!=ChunkedWorldHeader)
+		throw std::invalid_argument("LoadWorldChunked : File does not start with HPCEHeatWorldV0Chunked.");
+
+	m_src>>m_w>>m_h>>m_alpha>>m_tileSize;
+	if(!m_src.good())
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, couldn't read initial world state (width, height, alpha, tile size).");
+	if(m_tileSize==0 || m_tileSize>MaxTileSize)
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, bad tile size.");
+
+	char delim;
+	m_src>>delim;
+	if(delim!='-'){
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, missing hyphen before tile index.");
+	}
+
+	m_tilesAcross=(m_w+m_tileSize-1)/m_tileSize;
+	m_tilesDown=(m_h+m_tileSize-1)/m_tileSize;
+	unsigned count=m_tilesAcross*m_tilesDown;
+	m_sizes.resize(count);
+	if(count)
+		m_src.read((char*)&m_sizes[0], 4*count);
+	if(!m_src.good())
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, tile index could not be read.");
+	m_offsets.resize(count+1);
+	m_offsets[0]=0;
+	for(unsigned i=0;i<count;i++){
+		m_offsets[i+1]=m_offsets[i]+m_sizes[i];
+	}
+	// Pipes can't tell, and then only readWorld works
+	m_dataStart=m_src.tellg();
+}
+
+void ChunkedWorldReader::readTile(unsigned tx, unsigned ty, cell_flags_t *properties, float *state)
+{
+	if(tx>=m_tilesAcross || ty>=m_tilesDown)
+		throw std::out_of_range("ChunkedWorldReader : Tile is outside the world.");
+	if(m_dataStart<0)
+		throw std::logic_error("ChunkedWorldReader : Reading single tiles needs a seekable stream.");
+
+	unsigned i=ty*m_tilesAcross+tx;
+	std::vector<uint8_t> payload(m_sizes[i]);
+	m_src.clear();
+	m_src.seekg(m_dataStart+(std::streamoff)m_offsets[i]);
+	m_src.read((char*)payload.data(), payload.size());
+	if(!m_src.good())
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, tile could not be read.");
+
+	unsigned tw=std::min(m_tileSize, m_w-tx*m_tileSize), th=std::min(m_tileSize, m_h-ty*m_tileSize);
+	DecodeTile(payload.data(), payload.data()+payload.size(), tw, th, properties, state, m_tileSize);
+}
+
+world_t ChunkedWorldReader::readWorld()
+{
+	HPCE_TRACE_SPAN("LoadWorldChunked");
+	// Only readTile moves the stream, so usually it is already at the first tile
+	if(m_dataStart>=0 && m_src.tellg()!=m_dataStart){
+		m_src.clear();
+		m_src.seekg(m_dataStart);
+	}
+
+	std::vector<uint8_t> data(m_offsets.back());
+	if(!data.empty())
+		m_src.read((char*)&data[0], data.size());
+	if(!m_src.good())
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, one or more tiles could not be read.");
+
+	world_t world;
+	world.w=m_w;
+	world.h=m_h;
+	world.alpha=m_alpha;
+	world.t=0.0f;
+	world.properties.resize(m_w*m_h);
+	world.state.resize(m_w*m_h);
+
+	ParallelForRange(0, m_sizes.size(), [&](unsigned begin, unsigned end){
+		for(unsigned i=begin;i<end;i++){
+			unsigned x0=(i%m_tilesAcross)*m_tileSize, y0=(i/m_tilesAcross)*m_tileSize;
+			unsigned tw=std::min(m_tileSize, m_w-x0), th=std::min(m_tileSize, m_h-y0);
+			const uint8_t *p=data.data()+m_offsets[i];
+			unsigned index=y0*m_w+x0;
+			DecodeTile(p, p+m_sizes[i], tw, th, &world.properties[index], &world.state[index], m_w);
+		}
+	});
+
+	std::string footer;
+	m_src>>footer;
+	if(footer!="End"){
+		throw std::invalid_argument("LoadWorldChunked : Corrupt input file, missing 'End' to terminate world description.");
+	}
+	return world;
+}
+
+world_t LoadWorldChunked(std::istream &src)
+{
+	ChunkedWorldReader reader(src);
+	return reader.readWorld();
+}
+
+}; // namespace hpce
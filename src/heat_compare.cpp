@@ -0,0 +1,90 @@
+#include "heat.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+/* Compares the state of two worlds, e.g. an engine against StepWorld.
+
+	heat_compare [--max-abs=x] [--max-ulp=n] [--json] a.world b.world
+
+	Either file can be "-" for stdin. The exit code is 0 if the worlds have
+	the same geometry and every cell is within tolerance, 1 if not, and 2 if
+	a world couldn't be read. Both tolerances default to zero, so with no
+	options the worlds have to match exactly.
+*/
+
+namespace{
+	hpce::world_t LoadWorldFile(const std::string &name)
+	{
+		if(name=="-")
+			return hpce::LoadWorld(std::cin);
+		std::ifstream src(name.c_str(), std::ios::in | std::ios::binary);
+		if(!src.is_open())
+			throw std::runtime_error("Couldn't open '"+name+"'.");
+		return hpce::LoadWorld(src);
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	double absTolerance=0;
+	uint32_t ulpTolerance=0;
+	bool json=false;
+	std::vector<std::string> files;
+	
+	for(int i=1;i<argc;i++){
+		if(!strncmp(argv[i], "--max-abs=", 10)){
+			absTolerance=strtod(argv[i]+10, NULL);
+		}else if(!strncmp(argv[i], "--max-ulp=", 10)){
+			ulpTolerance=strtoul(argv[i]+10, NULL, 10);
+		}else if(!strcmp(argv[i], "--json")){
+			json=true;
+		}else{
+			files.push_back(argv[i]);
+		}
+	}
+	if(files.size()!=2){
+		std::cerr<<"Usage : heat_compare [--max-abs=x] [--max-ulp=n] [--json] a.world b.world"<<std::endl;
+		return 2;
+	}
+	
+	hpce::world_diff_t diff;
+	try{
+		hpce::world_t a=LoadWorldFile(files[0]);
+		hpce::world_t b=LoadWorldFile(files[1]);
+		diff=hpce::CompareWorlds(a, b, absTolerance, ulpTolerance);
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 2;
+	}
+	
+	bool pass=hpce::WithinTolerance(diff);
+	if(json){
+		std::cout<<"{\"same_shape\": "<<(diff.sameShape?"true":"false")
+			<<", \"same_alpha\": "<<(diff.sameAlpha?"true":"false")
+			<<", \"properties_mismatched\": "<<diff.propertiesMismatched
+			<<", \"max_abs\": "<<diff.maxAbs
+			<<", \"max_ulp\": "<<diff.maxUlp
+			<<", \"rms\": "<<diff.rms
+			<<", \"worst_x\": "<<diff.worstX
+			<<", \"worst_y\": "<<diff.worstY
+			<<", \"worst_a\": "<<diff.worstA
+			<<", \"worst_b\": "<<diff.worstB
+			<<", \"cells_outside\": "<<diff.cellsOutside
+			<<", \"pass\": "<<(pass?"true":"false")<<"}"<<std::endl;
+	}else if(!diff.sameShape){
+		std::cout<<"Worlds have different sizes"<<std::endl;
+	}else{
+		if(!diff.sameAlpha)
+			std::cout<<"alpha differs"<<std::endl;
+		if(diff.propertiesMismatched)
+			std::cout<<"properties differ in "<<diff.propertiesMismatched<<" cells"<<std::endl;
+		std::cout<<"max_abs="<<diff.maxAbs<<" max_ulp="<<diff.maxUlp<<" rms="<<diff.rms
+			<<" worst=("<<diff.worstX<<","<<diff.worstY<<") "<<diff.worstA<<" vs "<<diff.worstB<<std::endl;
+		std::cout<<diff.cellsOutside<<" cells outside max_abs="<<absTolerance<<", max_ulp="<<ulpTolerance
+			<<(pass ? " : PASS" : " : FAIL")<<std::endl;
+	}
+	
+	return pass ? 0 : 1;
+}
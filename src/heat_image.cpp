@@ -0,0 +1,636 @@
+#include "heat_image.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace hpce{
+
+// Rows of raw pixels each thread compresses at once. The strips are a
+// fixed size, so the output doesn't depend on the number of threads
+static const size_t ImageStripBytes=256<<10;
+
+static void PutBE32(std::string &dst, uint32_t v)
+{
+	dst+=(char)(v>>24);
+	dst+=(char)(v>>16);
+	dst+=(char)(v>>8);
+	dst+=(char)v;
+}
+
+//! Splits rows into strips of about ImageStripBytes each
+static unsigned StripRows(size_t rowBytes)
+{
+	return (unsigned)std::max<size_t>(1, ImageStripBytes/std::max<size_t>(1, rowBytes));
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Bitmap
+
+class BitmapEncoder
+	: public ImageEncoder
+{
+public:
+	BitmapEncoder(unsigned w, unsigned h)
+		: ImageEncoder(w, h, (size_t)w*3+(4-w%4)%4, 0, true, false)
+	{}
+
+	std::string header()
+	{
+		unsigned w=m_w, h=m_h;
+
+		// The solution to doing BITMAPINFOHEADER etc. without being platform-specific
+		// comes from:
+		//   http://stackoverflow.com/a/18675807
+		// In practise you would never do this, but it's the easiest way to stay platform independent fo
+		// coursework purposes.
+
+		uint8_t file[14] = {
+			'B','M', // magic
+			0,0,0,0, // size in bytes
+			0,0, // app data
+			0,0, // app data
+			40+14,0,0,0 // start of data offset
+		};
+		uint8_t info[40] = {
+			40,0,0,0, // info hd size
+			0,0,0,0, // width
+			0,0,0,0, // heigth
+			1,0, // number color planes
+			24,0, // bits per pixel
+			0,0,0,0, // compression is none
+			0,0,0,0, // image bits size
+			0x13,0x0B,0,0, // horz resoluition in pixel / m
+			0x13,0x0B,0,0, // vert resolutions (0x03C3 = 96 dpi, 0x0B13 = 72 dpi)
+			0,0,0,0, // #colors in pallete
+			0,0,0,0, // #important colors
+			};
+
+		unsigned padSize  = (4-w%4)%4;
+		unsigned sizeData = w*h*3 + h*padSize;
+		unsigned sizeAll  = sizeData + sizeof(file) + sizeof(info);
+
+		file[ 2] = (uint8_t)( sizeAll    );
+		file[ 3] = (uint8_t)( sizeAll>> 8);
+		file[ 4] = (uint8_t)( sizeAll>>16);
+		file[ 5] = (uint8_t	)( sizeAll>>24);
+
+		info[ 4] = (uint8_t)( w   );
+		info[ 5] = (uint8_t)( w>> 8);
+		info[ 6] = (uint8_t)( w>>16);
+		info[ 7] = (uint8_t)( w>>24);
+
+		info[ 8] = (uint8_t)( h    );
+		info[ 9] = (uint8_t)( h>> 8);
+		info[10] = (uint8_t)( h>>16);
+		info[11] = (uint8_t)( h>>24);
+
+		info[24] = (uint8_t)( sizeData    );
+		info[25] = (uint8_t)( sizeData>> 8);
+		info[26] = (uint8_t)( sizeData>>16);
+		info[27] = (uint8_t)( sizeData>>24);
+
+		// End stackoverflow excerpt
+
+		return std::string((const char*)file, sizeof(file))+std::string((const char*)info, sizeof(info));
+	}
+
+	bool encode(const uint8_t *, unsigned, std::vector<std::string> &)
+	{ return false; }
+
+	std::string trailer()
+	{ return std::string(); }
+};
+
+////////////////////////////////////////////////////////////////////////////
+// PNG
+
+//! CRC-32 of PNG chunks, a slice of eight bytes at a time
+class Crc32
+{
+public:
+	Crc32()
+	{
+		for(unsigned i=0;i<256;i++){
+			uint32_t c=i;
+			for(unsigned k=0;k<8;k++)
+				c=(c&1) ? 0xEDB88320u^(c>>1) : c>>1;
+			m_table[0][i]=c;
+		}
+		for(unsigned i=0;i<256;i++){
+			for(unsigned s=1;s<8;s++)
+				m_table[s][i]=(m_table[s-1][i]>>8)^m_table[0][m_table[s-1][i]&0xFF];
+		}
+	}
+
+	uint32_t update(uint32_t crc, const uint8_t *p, size_t n) const
+	{
+		crc=~crc;
+		for(;n>=8;n-=8, p+=8){
+			uint32_t lo, hi;
+			memcpy(&lo, p, 4);
+			memcpy(&hi, p+4, 4);
+			lo^=crc;	// little-endian
+			crc=m_table[7][lo&0xFF]^m_table[6][(lo>>8)&0xFF]^m_table[5][(lo>>16)&0xFF]^m_table[4][lo>>24]
+				^m_table[3][hi&0xFF]^m_table[2][(hi>>8)&0xFF]^m_table[1][(hi>>16)&0xFF]^m_table[0][hi>>24];
+		}
+		for(;n>0;n--, p++)
+			crc=m_table[0][(crc^*p)&0xFF]^(crc>>8);
+		return ~crc;
+	}
+private:
+	uint32_t m_table[8][256];
+};
+
+static const Crc32 PngCrc;
+
+static const uint32_t AdlerBase=65521;
+
+static uint32_t Adler32(const uint8_t *p, size_t n)
+{
+	uint32_t a=1, b=0;
+	while(n){
+		// The most bytes before b could overflow
+		size_t chunk=std::min<size_t>(n, 5552);
+		n-=chunk;
+		for(;chunk>0;chunk--){
+			a+=*p++;
+			b+=a;
+		}
+		a%=AdlerBase;
+		b%=AdlerBase;
+	}
+	return a|(b<<16);
+}
+
+//! The Adler-32 of two pieces, from the sums of each, as zlib's adler32_combine
+static uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+	uint32_t rem=(uint32_t)(len2%AdlerBase);
+	uint32_t sum1=adler1&0xFFFF;
+	uint32_t sum2=(uint32_t)(((uint64_t)rem*sum1)%AdlerBase);
+	sum1+=(adler2&0xFFFF)+AdlerBase-1;
+	sum2+=(adler1>>16)+(adler2>>16)+AdlerBase-rem;
+	if(sum1>=AdlerBase) sum1-=AdlerBase;
+	if(sum1>=AdlerBase) sum1-=AdlerBase;
+	if(sum2>=(AdlerBase<<1)) sum2-=(AdlerBase<<1);
+	if(sum2>=AdlerBase) sum2-=AdlerBase;
+	return sum1|(sum2<<16);
+}
+
+//! Writes deflate's bit stream, least significant bit first
+class DeflateBits
+{
+public:
+	DeflateBits(std::string &dst)
+		: m_dst(dst), m_acc(0), m_count(0)
+	{}
+
+	void put(uint32_t bits, unsigned count)
+	{
+		m_acc|=(uint64_t)bits<<m_count;
+		m_count+=count;
+		while(m_count>=8){
+			m_dst+=(char)m_acc;
+			m_acc>>=8;
+			m_count-=8;
+		}
+	}
+
+	//! Pads with zeros to a whole byte
+	void align()
+	{
+		if(m_count)
+			put(0, 8-m_count);
+	}
+private:
+	std::string &m_dst;
+	uint64_t m_acc;
+	unsigned m_count;
+};
+
+//! The fixed Huffman codes of deflate, already bit reversed
+struct fixed_huffman_t
+{
+	uint16_t litCode[288];
+	uint8_t litBits[288];
+	uint16_t lenSymbol[259];	// by match length
+	uint8_t lenExtraBits[259];
+	uint16_t lenExtra[259];
+
+	static uint16_t Reverse(uint32_t code, unsigned bits)
+	{
+		uint32_t res=0;
+		for(unsigned i=0;i<bits;i++)
+			res|=((code>>i)&1)<<(bits-1-i);
+		return (uint16_t)res;
+	}
+
+	fixed_huffman_t()
+	{
+		for(unsigned v=0;v<288;v++){
+			uint32_t code;
+			unsigned bits;
+			if(v<144){ code=0x30+v; bits=8; }
+			else if(v<256){ code=0x190+(v-144); bits=9; }
+			else if(v<280){ code=v-256; bits=7; }
+			else{ code=0xC0+(v-280); bits=8; }
+			litCode[v]=Reverse(code, bits);
+			litBits[v]=bits;
+		}
+		static const uint16_t base[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+		static const uint8_t extra[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+		for(unsigned s=0;s<29;s++){
+			unsigned end=s+1<29 ? base[s+1] : 259;
+			for(unsigned len=base[s];len<end && len<=258;len++){
+				lenSymbol[len]=257+s;
+				lenExtraBits[len]=extra[s];
+				lenExtra[len]=len-base[s];
+			}
+		}
+	}
+
+	static void DistanceCode(unsigned dist, unsigned &code, unsigned &extraBits, unsigned &extra)
+	{
+		// Codes 0 to 3 are 1 to 4, then each pair of codes doubles the range
+		if(dist<=4){
+			code=dist-1;
+			extraBits=0;
+			extra=0;
+			return;
+		}
+		unsigned d=dist-1;
+		unsigned top=0;
+		while(d>>(top+1))
+			top++;
+		code=2*top+((d>>(top-1))&1);
+		extraBits=top-1;
+		extra=d&((1u<<extraBits)-1);
+	}
+};
+
+static const fixed_huffman_t FixedHuffman;
+
+//! Deflate's largest back reference
+static const size_t DeflateWindow=32768;
+
+//! Deflates a strip as one fixed Huffman block, ending on a byte boundary
+/*! The only matches looked for are repeats of the byte, the pixel to the
+	left and the row above, which is where the repeats in a rendered
+	world are. Each strip only refers back into itself.
+*/
+static void DeflateFast(const uint8_t *src, size_t n, size_t stride, std::string &dst)
+{
+	DeflateBits bits(dst);
+	bits.put(0, 1);	// not final
+	bits.put(1, 2);	// fixed Huffman
+
+	unsigned dists[3]={1, 3, (unsigned)stride};
+	unsigned distCode[3], distExtraBits[3], distExtra[3];
+	unsigned candidates=stride<=DeflateWindow ? 3 : 2;
+	for(unsigned c=0;c<candidates;c++)
+		fixed_huffman_t::DistanceCode(dists[c], distCode[c], distExtraBits[c], distExtra[c]);
+
+	const fixed_huffman_t &fh=FixedHuffman;
+	size_t i=0;
+	while(i<n){
+		size_t limit=std::min<size_t>(258, n-i);
+		size_t bestLen=0;
+		unsigned best=0;
+		for(unsigned c=0;c<candidates;c++){
+			if(i<dists[c])
+				continue;
+			const uint8_t *a=src+i, *b=src+i-dists[c];
+			size_t len=0;
+			while(len<limit && a[len]==b[len])
+				len++;
+			if(len>bestLen){
+				bestLen=len;
+				best=c;
+			}
+		}
+		if(bestLen>=3){
+			bits.put(fh.litCode[fh.lenSymbol[bestLen]], fh.litBits[fh.lenSymbol[bestLen]]);
+			bits.put(fh.lenExtra[bestLen], fh.lenExtraBits[bestLen]);
+			bits.put(fixed_huffman_t::Reverse(distCode[best], 5), 5);
+			bits.put(distExtra[best], distExtraBits[best]);
+			i+=bestLen;
+		}else{
+			bits.put(fh.litCode[src[i]], fh.litBits[src[i]]);
+			i++;
+		}
+	}
+	bits.put(fh.litCode[256], fh.litBits[256]);	// end of block
+
+	// An empty stored block brings the stream back to a byte boundary, so
+	// the strips can just be put one after the other
+	bits.put(0, 3);
+	bits.align();
+	dst.append("\x00\x00\xFF\xFF", 4);
+}
+
+//! Deflates a strip as stored blocks, which are already byte aligned
+static void DeflateStored(const uint8_t *src, size_t n, std::string &dst)
+{
+	for(size_t i=0;i<n;){
+		size_t len=std::min<size_t>(65535, n-i);
+		dst+=(char)0;	// not final, stored
+		dst+=(char)len;
+		dst+=(char)(len>>8);
+		dst+=(char)~len;
+		dst+=(char)(~len>>8);
+		dst.append((const char*)src+i, len);
+		i+=len;
+	}
+}
+
+static std::string PngChunk(const char *type, const std::string &data)
+{
+	std::string res;
+	PutBE32(res, (uint32_t)data.size());
+	res.append(type, 4);
+	res+=data;
+	uint32_t crc=PngCrc.update(0, (const uint8_t*)type, 4);
+	crc=PngCrc.update(crc, (const uint8_t*)data.data(), data.size());
+	PutBE32(res, crc);
+	return res;
+}
+
+//! RGB rows, each behind a filter byte of zero, as one zlib stream
+/*! Each strip becomes its own IDAT chunk, so the deflating and the CRC of
+	every strip happen in parallel, and only the Adler-32s are combined in
+	order.
+*/
+class PngEncoder
+	: public ImageEncoder
+{
+public:
+	PngEncoder(unsigned w, unsigned h, bool stored)
+		: ImageEncoder(w, h, 1+(size_t)w*3, 1, false, true)
+		, m_stored(stored)
+		, m_adler(1)
+	{}
+
+	std::string header()
+	{
+		std::string res("\x89PNG\r\n\x1A\n", 8);
+		std::string ihdr;
+		PutBE32(ihdr, m_w);
+		PutBE32(ihdr, m_h);
+		ihdr+=(char)8;	// bits per channel
+		ihdr+=(char)2;	// RGB
+		ihdr.append(3, (char)0);	// deflate, adaptive filtering, not interlaced
+		res+=PngChunk("IHDR", ihdr);
+		res+=PngChunk("IDAT", std::string("\x78\x01", 2));	// zlib header, 32K window
+		return res;
+	}
+
+	bool encode(const uint8_t *block, unsigned rows, std::vector<std::string> &pieces)
+	{
+		HPCE_TRACE_SPAN("png:encode");
+		unsigned stripRows=StripRows(m_rowBytes);
+		unsigned strips=(rows+stripRows-1)/stripRows;
+		pieces.resize(strips);
+		std::vector<uint32_t> adlers(strips);
+		ParallelForRange(0, strips, [&](unsigned sBegin, unsigned sEnd){
+			for(unsigned s=sBegin;s<sEnd;s++){
+				const uint8_t *src=block+(size_t)s*stripRows*m_rowBytes;
+				size_t n=(size_t)std::min(stripRows, rows-s*stripRows)*m_rowBytes;
+				std::string data;
+				if(m_stored)
+					DeflateStored(src, n, data);
+				else
+					DeflateFast(src, n, m_rowBytes, data);
+				adlers[s]=Adler32(src, n);
+				pieces[s]=PngChunk("IDAT", data);
+			}
+		});
+		for(unsigned s=0;s<strips;s++){
+			size_t n=(size_t)std::min(stripRows, rows-s*stripRows)*m_rowBytes;
+			m_adler=Adler32Combine(m_adler, adlers[s], n);
+		}
+		return true;
+	}
+
+	std::string trailer()
+	{
+		std::string last("\x01\x00\x00\xFF\xFF", 5);	// final, stored and empty
+		PutBE32(last, m_adler);
+		return PngChunk("IDAT", last)+PngChunk("IEND", std::string());
+	}
+private:
+	bool m_stored;
+	uint32_t m_adler;	// of every row so far
+};
+
+////////////////////////////////////////////////////////////////////////////
+// QOI
+
+// A pixel as r | g<<8 | b<<16 | a<<24
+typedef uint32_t qoi_pixel_t;
+
+static const qoi_pixel_t QoiStart=0xFF000000u;	// opaque black
+
+static unsigned QoiHash(qoi_pixel_t p)
+{
+	return ((p&0xFF)*3+((p>>8)&0xFF)*5+((p>>16)&0xFF)*7+(p>>24)*11)%64;
+}
+
+static qoi_pixel_t QoiPixel(const uint8_t *rgb)
+{
+	return rgb[0] | (rgb[1]<<8) | (rgb[2]<<16) | QoiStart;
+}
+
+//! What a QOI encoder carries from one pixel to the next
+struct qoi_state_t
+{
+	qoi_pixel_t previous;
+	qoi_pixel_t index[64];
+	uint64_t written;	// the slots that were set, for merging strips
+
+	qoi_state_t()
+		: previous(QoiStart), written(0)
+	{
+		std::fill(index, index+64, 0);
+	}
+
+	//! Moves past pixel p, as the encoder would update the index
+	/*! A pixel repeating the one before goes out as a run, and doesn't
+		touch the index, otherwise it ends up in its slot. */
+	void see(qoi_pixel_t p)
+	{
+		if(p!=previous){
+			unsigned h=QoiHash(p);
+			index[h]=p;
+			written|=1ull<<h;
+		}
+		previous=p;
+	}
+
+	//! Carries on from this state with what a later stretch of pixels did
+	void follow(const qoi_state_t &later)
+	{
+		for(unsigned h=0;h<64;h++){
+			if(later.written>>h&1)
+				index[h]=later.index[h];
+		}
+		written|=later.written;
+		previous=later.previous;
+	}
+};
+
+//! Encodes n pixels, starting from and updating state
+static void QoiEncode(const uint8_t *rgb, size_t n, qoi_state_t &state, std::string &dst)
+{
+	unsigned run=0;
+	qoi_pixel_t previous=state.previous;
+	for(size_t i=0;i<n;i++){
+		qoi_pixel_t p=QoiPixel(rgb+3*i);
+		if(p==previous){
+			if(++run==62){
+				dst+=(char)(0xC0|(run-1));
+				run=0;
+			}
+			continue;
+		}
+		if(run){
+			dst+=(char)(0xC0|(run-1));
+			run=0;
+		}
+		unsigned h=QoiHash(p);
+		if(state.index[h]==p){
+			dst+=(char)h;
+		}else{
+			state.index[h]=p;
+			state.written|=1ull<<h;
+			int8_t dr=(int8_t)((p&0xFF)-(previous&0xFF));
+			int8_t dg=(int8_t)(((p>>8)&0xFF)-((previous>>8)&0xFF));
+			int8_t db=(int8_t)(((p>>16)&0xFF)-((previous>>16)&0xFF));
+			int drg=dr-dg, dbg=db-dg;
+			if(dr>=-2 && dr<=1 && dg>=-2 && dg<=1 && db>=-2 && db<=1){
+				dst+=(char)(0x40|((dr+2)<<4)|((dg+2)<<2)|(db+2));
+			}else if(dg>=-32 && dg<=31 && drg>=-8 && drg<=7 && dbg>=-8 && dbg<=7){
+				dst+=(char)(0x80|(dg+32));
+				dst+=(char)(((drg+8)<<4)|(dbg+8));
+			}else{
+				dst+=(char)0xFE;
+				dst+=(char)(p&0xFF);
+				dst+=(char)((p>>8)&0xFF);
+				dst+=(char)((p>>16)&0xFF);
+			}
+		}
+		previous=p;
+	}
+	if(run)
+		dst+=(char)(0xC0|(run-1));
+	state.previous=previous;
+}
+
+//! RGB rows as QOI, with the strips encoded in parallel
+/*! A QOI encoder's state after a stretch of pixels depends only on them:
+	the last pixel, and the last pixel to land in each slot of the index.
+	So each strip first works out what it does to the state, those are
+	chained in order to give the state each strip starts from, and then
+	the strips are encoded at once. The result is the same as encoding the
+	rows one after another.
+*/
+class QoiEncoder
+	: public ImageEncoder
+{
+public:
+	QoiEncoder(unsigned w, unsigned h)
+		: ImageEncoder(w, h, (size_t)w*3, 0, false, true)
+	{}
+
+	std::string header()
+	{
+		std::string res("qoif");
+		PutBE32(res, m_w);
+		PutBE32(res, m_h);
+		res+=(char)3;	// RGB
+		res+=(char)0;	// sRGB with linear alpha
+		return res;
+	}
+
+	bool encode(const uint8_t *block, unsigned rows, std::vector<std::string> &pieces)
+	{
+		HPCE_TRACE_SPAN("qoi:encode");
+		unsigned stripRows=StripRows(m_rowBytes);
+		unsigned strips=(rows+stripRows-1)/stripRows;
+		pieces.resize(strips);
+
+		// What each strip does to the state on its own
+		std::vector<qoi_state_t> effects(strips);
+		ParallelForRange(0, strips, [&](unsigned sBegin, unsigned sEnd){
+			for(unsigned s=sBegin;s<sEnd;s++){
+				const uint8_t *src=block+(size_t)s*stripRows*m_rowBytes;
+				size_t n=(size_t)std::min(stripRows, rows-s*stripRows)*m_w;
+				// Whether the first pixel repeats depends on the strip before
+				effects[s].previous=s>0 ? QoiPixel(src-3) : m_state.previous;
+				for(size_t i=0;i<n;i++)
+					effects[s].see(QoiPixel(src+3*i));
+			}
+		});
+
+		std::vector<qoi_state_t> starts(strips);
+		qoi_state_t state=m_state;
+		for(unsigned s=0;s<strips;s++){
+			starts[s]=state;
+			state.follow(effects[s]);
+		}
+		m_state=state;
+
+		ParallelForRange(0, strips, [&](unsigned sBegin, unsigned sEnd){
+			for(unsigned s=sBegin;s<sEnd;s++){
+				const uint8_t *src=block+(size_t)s*stripRows*m_rowBytes;
+				size_t n=(size_t)std::min(stripRows, rows-s*stripRows)*m_w;
+				QoiEncode(src, n, starts[s], pieces[s]);
+			}
+		});
+		return true;
+	}
+
+	std::string trailer()
+	{
+		return std::string("\0\0\0\0\0\0\0\x01", 8);
+	}
+private:
+	qoi_state_t m_state;	// after every row so far
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+static bool HasExtension(const std::string &fileName, const char *extension)
+{
+	size_t n=strlen(extension);
+	if(fileName.size()<n)
+		return false;
+	for(size_t i=0;i<n;i++){
+		if(tolower((unsigned char)fileName[fileName.size()-n+i])!=extension[i])
+			return false;
+	}
+	return true;
+}
+
+std::unique_ptr<ImageEncoder> MakeImageEncoder(const std::string &fileName, unsigned w, unsigned h)
+{
+	if(HasExtension(fileName, ".png")){
+		const char *d=getenv("HPCE_PNG_DEFLATE");
+		std::string deflate=d ? d : "fast";
+		if(deflate!="fast" && deflate!="stored")
+			throw std::invalid_argument("RenderWorld : HPCE_PNG_DEFLATE must be fast or stored.");
+		return std::unique_ptr<ImageEncoder>(new PngEncoder(w, h, deflate=="stored"));
+	}
+	if(HasExtension(fileName, ".qoi"))
+		return std::unique_ptr<ImageEncoder>(new QoiEncoder(w, h));
+	return std::unique_ptr<ImageEncoder>(new BitmapEncoder(w, h));
+}
+
+}; // namespace hpce
@@ -0,0 +1,416 @@
+#include "heat.hpp"
+#include "heat_checkpoint.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+namespace hpce{
+
+#ifndef _WIN32
+
+// Each thread reads or writes this much at a time
+static const uint64_t IoBlockBytes=4<<20;
+// O_DIRECT wants the file offset, the size and the memory aligned to this
+static const uint64_t DirectAlign=4096;
+
+static uint64_t AlignDown(uint64_t x)
+{ return x & ~(DirectAlign-1); }
+
+static uint64_t AlignUp(uint64_t x)
+{ return AlignDown(x+DirectAlign-1); }
+
+typedef std::vector<char,aligned_allocator<char> > io_buffer_t;
+
+//! A file descriptor for pread and pwrite from many threads at once
+class WorldFile
+{
+public:
+	WorldFile(const std::string &fileName, int flags, bool direct)
+		: m_name(fileName)
+	{
+		if(direct){
+#ifdef O_DIRECT
+			flags|=O_DIRECT;
+#else
+			throw std::invalid_argument("WorldFile : O_DIRECT isn't available on this platform.");
+#endif
+		}
+		m_fd=open(fileName.c_str(), flags, 0666);
+		if(m_fd<0)
+			throw std::runtime_error("WorldFile : Couldn't open '"+fileName+"' : "+strerror(errno));
+	}
+
+	~WorldFile()
+	{ close(m_fd); }
+
+	uint64_t size() const
+	{
+		struct stat st;
+		if(fstat(m_fd, &st))
+			throw std::runtime_error("WorldFile : Couldn't stat '"+m_name+"' : "+strerror(errno));
+		return st.st_size;
+	}
+
+	void truncate(uint64_t size) const
+	{
+		if(ftruncate(m_fd, size))
+			throw std::runtime_error("WorldFile : Couldn't size '"+m_name+"' : "+strerror(errno));
+	}
+
+	//! Reads up to size bytes, fewer only at the end of the file
+	uint64_t read(uint64_t offset, void *dst, uint64_t size) const
+	{
+		char *p=(char*)dst;
+		uint64_t done=0;
+		while(done<size){
+			ssize_t got=pread(m_fd, p+done, size-done, offset+done);
+			if(got<0)
+				throw std::runtime_error("WorldFile : Read of '"+m_name+"' failed : "+strerror(errno));
+			if(got==0)
+				break;
+			done+=got;
+		}
+		return done;
+	}
+
+	void sync() const
+	{
+		if(fsync(m_fd))
+			throw std::runtime_error("WorldFile : Couldn't sync '"+m_name+"' : "+strerror(errno));
+	}
+
+	void write(uint64_t offset, const void *src, uint64_t size) const
+	{
+		const char *p=(const char*)src;
+		while(size){
+			ssize_t put=pwrite(m_fd, p, size, offset);
+			if(put<0)
+				throw std::runtime_error("WorldFile : Write of '"+m_name+"' failed : "+strerror(errno));
+			p+=put; offset+=put; size-=put;
+		}
+	}
+private:
+	WorldFile(const WorldFile &); // = delete
+	WorldFile &operator=(const WorldFile &); // = delete
+
+	std::string m_name;
+	int m_fd;
+};
+
+//! Reads bytes at any offset, going through an aligned buffer for O_DIRECT
+static void ReadSpan(const WorldFile &file, bool direct, uint64_t offset, void *dst, uint64_t size, io_buffer_t &buffer)
+{
+	uint64_t got;
+	if(!direct){
+		got=file.read(offset, dst, size);
+	}else{
+		uint64_t begin=AlignDown(offset), end=AlignUp(offset+size);
+		buffer.resize(end-begin);
+		got=file.read(begin, &buffer[0], end-begin);
+		got=got>offset-begin ? std::min(size, got-(offset-begin)) : 0;
+		memcpy(dst, &buffer[offset-begin], got);
+	}
+	if(got!=size)
+		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements could not be read.");
+}
+
+// Neither check branches, so both vectorise, and a bad cell is only
+// looked for once a block is known to have one
+
+static bool PropertiesValid(const cell_flags_t *p, size_t n)
+{
+	uint32_t bad=0;
+	for(size_t i=0;i<n;i++){
+		bad|=(uint32_t)p[i] > (uint32_t)Cell_Insulator;
+	}
+	return !bad;
+}
+
+static bool StateValid(const float *s, size_t n)
+{
+	uint32_t bad=0;
+	for(size_t i=0;i<n;i++){
+		bad|=(s[i]<0.0f) | (s[i]>1.0f);
+	}
+	return !bad;
+}
+
+//! Loads a binary world by row blocks on all threads, or returns false for any other layout
+/*! \param preamble If not NULL, the file starts with a line that is put here */
+static bool LoadBinaryWorldFile(const std::string &fileName, bool direct, world_t &world, std::string *preamble=NULL)
+{
+	WorldFile file(fileName, O_RDONLY, direct);
+	uint64_t fileSize=file.size();
+
+	// The header is text, so parse it like WorldReader does
+	io_buffer_t buffer;
+	std::vector<char> head(std::min<uint64_t>(fileSize, DirectAlign));
+	if(!head.empty())
+		ReadSpan(file, direct, 0, &head[0], head.size(), buffer);
+	std::istringstream src(std::string(head.begin(), head.end()));
+	if(preamble && !std::getline(src, *preamble))
+		return false;
+	std::string header;
+	src>>header;
+	if(header!="HPCEHeatWorldV0Binary")
+		return false;
+	char delim=0;
+	src>>world.w>>world.h>>world.alpha>>delim;
+	if(!src.good() || delim!='-')
+		return false;
+
+	uint64_t cells=(uint64_t)world.w*world.h;
+	uint64_t propertiesAt=src.tellg();
+	uint64_t stateAt=propertiesAt+4*cells+1;
+	uint64_t endAt=stateAt+4*cells;
+	if(fileSize<endAt+3)
+		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements could not be read.");
+	char dash, footer[16]={0};
+	ReadSpan(file, direct, stateAt-1, &dash, 1, buffer);
+	uint64_t footerSize=std::min<uint64_t>(fileSize-endAt, sizeof(footer)-1);
+	ReadSpan(file, direct, endAt, footer, footerSize, buffer);
+	if(dash!='-')
+		return false;	// the stream reader allows space before it
+	std::string end;
+	std::istringstream(footer)>>end;
+	if(end!="End")
+		throw std::invalid_argument("LoadWorld : Corrupt input file, missing 'End' to terminate world description.");
+
+	world.t=0.0f;
+	world.properties.resize(cells);
+	world.state.resize(cells);
+	if(cells==0)
+		return true;
+
+	// Whole rows per block, so each block is checked as soon as it lands
+	unsigned rowsPerBlock=std::max<uint64_t>(1, IoBlockBytes/(4*(uint64_t)world.w));
+	unsigned blocks=(world.h+rowsPerBlock-1)/rowsPerBlock;
+	ParallelForRange(0, 2*blocks, [&](unsigned begin, unsigned end){
+		io_buffer_t buffer;
+		for(unsigned i=begin;i<end;i++){
+			bool isState=i>=blocks;
+			unsigned y0=(i%blocks)*rowsPerBlock;
+			unsigned y1=std::min(world.h, y0+rowsPerBlock);
+			uint64_t first=(uint64_t)y0*world.w, n=(uint64_t)(y1-y0)*world.w;
+			if(!isState){
+				cell_flags_t *p=&world.properties[first];
+				ReadSpan(file, direct, propertiesAt+4*first, p, 4*n, buffer);
+				if(!PropertiesValid(p, n)){
+					for(uint64_t j=0;j<n;j++){
+						if(!PropertiesValid(p+j, 1)){
+							std::cerr<<"y="<<(first+j)/world.w<<", x="<<(first+j)%world.w<<", flags="<<(unsigned)p[j]<<"\n";
+							break;
+						}
+					}
+					throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
+				}
+			}else{
+				float *s=&world.state[first];
+				ReadSpan(file, direct, stateAt+4*first, s, 4*n, buffer);
+				if(!StateValid(s, n))
+					throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
+			}
+		}
+	});
+	return true;
+}
+
+//! Writes a binary world on all threads, byte for byte what SaveWorld writes
+/*! \param preamble Written before the world, a line for a checkpoint
+	\param sync Wait for the file to reach the disk before returning
+*/
+static void SaveBinaryWorldFile(const std::string &fileName, const world_t &world, bool direct,
+	const std::string &preamble=std::string(), bool sync=false)
+{
+	std::ostringstream head;
+	head<<preamble;
+	{
+		WorldWriter writer(head, world.w, world.h, world.alpha, true);
+	}
+	std::string prefix=head.str(), dash="-";
+	std::ostringstream tail;
+	tail<<"End"<<std::endl;
+	std::string suffix=tail.str();
+
+	// The file is these pieces end to end
+	uint64_t cells=(uint64_t)world.w*world.h;
+	const char *pieces[5]={prefix.data(), (const char*)world.properties.data(), dash.data(), (const char*)world.state.data(), suffix.data()};
+	uint64_t sizes[5]={prefix.size(), 4*cells, 1, 4*cells, suffix.size()};
+	uint64_t total=0;
+	for(unsigned j=0;j<5;j++){
+		total+=sizes[j];
+	}
+
+	WorldFile file(fileName, O_WRONLY|O_CREAT|O_TRUNC, direct);
+	file.truncate(total);
+	unsigned blocks=(total+IoBlockBytes-1)/IoBlockBytes;
+	ParallelForRange(0, blocks, [&](unsigned begin, unsigned end){
+		io_buffer_t buffer;
+		if(direct)
+			buffer.resize(IoBlockBytes);
+		for(unsigned i=begin;i<end;i++){
+			uint64_t blockBegin=i*IoBlockBytes, blockEnd=std::min(total, blockBegin+IoBlockBytes);
+			if(direct && blockEnd-blockBegin<IoBlockBytes)
+				std::fill(buffer.begin(), buffer.end(), 0);
+			uint64_t at=0;
+			for(unsigned j=0;j<5;j++){
+				uint64_t b=std::max(at, blockBegin), e=std::min(at+sizes[j], blockEnd);
+				if(b<e){
+					if(direct){
+						memcpy(&buffer[b-blockBegin], pieces[j]+(b-at), e-b);
+					}else{
+						file.write(b, pieces[j]+(b-at), e-b);
+					}
+				}
+				at+=sizes[j];
+			}
+			// Whole aligned blocks only, the tail is cut back off below
+			if(direct)
+				file.write(blockBegin, &buffer[0], AlignUp(blockEnd-blockBegin));
+		}
+	});
+	if(direct)
+		file.truncate(total);
+	if(sync)
+		file.sync();
+}
+
+//! Makes a rename within dir durable
+static void SyncDirectory(const std::string &fileName)
+{
+	size_t slash=fileName.rfind('/');
+	std::string dir=slash==std::string::npos ? "." : fileName.substr(0, std::max<size_t>(slash, 1));
+	int fd=open(dir.c_str(), O_RDONLY);
+	if(fd>=0){
+		fsync(fd);
+		close(fd);
+	}
+}
+
+#endif
+
+static const char *CheckpointHeader="HPCEHeatCheckpointV0";
+
+static uint32_t Bits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, 4);
+	return bits;
+}
+
+static float FromBits(uint32_t bits)
+{
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+void SaveCheckpoint(const std::string &fileName, const world_t &world, uint64_t step, float dt, bool direct)
+{
+	HPCE_TRACE_SPAN("SaveCheckpoint");
+	// t and dt go as bits, so a resumed run carries on exactly
+	std::ostringstream preamble;
+	preamble<<CheckpointHeader<<" "<<step<<" "<<Bits(world.t)<<" "<<Bits(dt)<<"\n";
+
+	std::string temp=fileName+".tmp";
+#ifndef _WIN32
+	SaveBinaryWorldFile(temp, world, direct, preamble.str(), true);
+	if(rename(temp.c_str(), fileName.c_str()))
+		throw std::runtime_error("SaveCheckpoint : Couldn't rename '"+temp+"' : "+strerror(errno));
+	SyncDirectory(fileName);
+#else
+	{
+		std::ofstream dst(temp.c_str(), std::ios::binary);
+		dst<<preamble.str();
+		SaveWorld(dst, world, true);
+		if(!dst.good())
+			throw std::runtime_error("SaveCheckpoint : Couldn't write '"+temp+"'.");
+	}
+	remove(fileName.c_str());
+	if(rename(temp.c_str(), fileName.c_str()))
+		throw std::runtime_error("SaveCheckpoint : Couldn't rename '"+temp+"'.");
+#endif
+}
+
+bool LoadCheckpoint(const std::string &fileName, world_t &world, uint64_t &step, float &dt, bool direct)
+{
+	HPCE_TRACE_SPAN("LoadCheckpoint");
+	if(!std::ifstream(fileName.c_str()).is_open())
+		return false;
+
+	std::string line;
+#ifndef _WIN32
+	if(!LoadBinaryWorldFile(fileName, direct, world, &line))
+		throw std::invalid_argument("LoadCheckpoint : '"+fileName+"' doesn't hold a binary world.");
+#else
+	(void)direct;
+	std::ifstream file(fileName.c_str(), std::ios::binary);
+	std::getline(file, line);
+	world=LoadWorld(file);
+#endif
+	std::istringstream src(line);
+	std::string header;
+	uint32_t tBits, dtBits;
+	src>>header>>step>>tBits>>dtBits;
+	if(header!=CheckpointHeader || src.fail())
+		throw std::invalid_argument("LoadCheckpoint : '"+fileName+"' doesn't start with HPCEHeatCheckpointV0.");
+	world.t=FromBits(tBits);
+	dt=FromBits(dtBits);
+	return true;
+}
+
+world_t LoadWorldFile(const std::string &fileName, bool direct)
+{
+	if(fileName=="-")
+		return LoadWorld(std::cin);
+#ifndef _WIN32
+	{
+		HPCE_TRACE_SPAN("LoadWorldFile");
+		world_t world;
+		if(LoadBinaryWorldFile(fileName, direct, world))
+			return world;
+	}
+#endif
+	std::ifstream src(fileName.c_str(), std::ios::binary);
+	if(!src.is_open())
+		throw std::runtime_error("LoadWorldFile : Couldn't open '"+fileName+"'.");
+	return LoadWorld(src);
+}
+
+void SaveWorldFile(const std::string &fileName, const world_t &world, bool binary, bool direct)
+{
+	if(fileName=="-"){
+		SaveWorld(std::cout, world, binary);
+		return;
+	}
+#ifndef _WIN32
+	if(binary){
+		HPCE_TRACE_SPAN("SaveWorldFile");
+		SaveBinaryWorldFile(fileName, world, direct);
+		return;
+	}
+#endif
+	std::ofstream dst(fileName.c_str(), std::ios::binary);
+	if(!dst.is_open())
+		throw std::runtime_error("SaveWorldFile : Couldn't create '"+fileName+"'.");
+	SaveWorld(dst, world, binary);
+	if(!dst.good())
+		throw std::runtime_error("SaveWorldFile : Couldn't write '"+fileName+"'.");
+}
+
+}; // namespace hpce
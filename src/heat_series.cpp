@@ -0,0 +1,370 @@
+#include "heat_series.hpp"
+#include "heat_trace.hpp"
+#include "heat_varint.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace hpce{
+
+static const char *SeriesHeader="HPCEHeatSeriesV0";
+
+// Frames allowed to wait for the writer before append blocks
+static const unsigned SeriesQueueLength=4;
+
+// In front of each frame's payload
+struct series_record_t
+{
+	uint64_t bytes;
+	uint32_t keyframe;
+	uint32_t tBits;
+};
+
+//! The state as the words that are differenced, the float bits or multiples of quantum
+static void StateToWords(const state_vector_t &state, double quantum, std::vector<uint32_t> &words)
+{
+	words.resize(state.size());
+	if(quantum>0){
+		for(size_t i=0;i<state.size();i++){
+			words[i]=(uint32_t)std::lround(state[i]/quantum);
+		}
+	}else if(!state.empty()){
+		memcpy(&words[0], &state[0], 4*state.size());
+	}
+}
+
+static void WordsToState(const std::vector<uint32_t> &words, double quantum, state_vector_t &state)
+{
+	state.resize(words.size());
+	if(quantum>0){
+		for(size_t i=0;i<words.size();i++){
+			state[i]=std::min(1.0f, (float)(words[i]*quantum));
+		}
+	}else if(!words.empty()){
+		memcpy(&state[0], &words[0], 4*words.size());
+	}
+}
+
+//! Each word as its difference from ref, or from zero for a keyframe
+static std::string EncodeFrame(const std::vector<uint32_t> &words, const std::vector<uint32_t> *ref)
+{
+	std::string res;
+	size_t n=words.size();
+	for(size_t i=0;i<n;){
+		uint32_t base=ref ? (*ref)[i] : 0;
+		uint32_t zz=detail::ZigzagDelta(words[i], base);
+		detail::PutVarint(res, zz);
+		if(zz==0){
+			size_t j=i+1;
+			while(j<n && j-i<=UINT32_MAX && words[j]==(ref ? (*ref)[j] : 0))
+				j++;
+			detail::PutVarint(res, (uint32_t)(j-i-1));
+			i=j;
+		}else{
+			i++;
+		}
+	}
+	return res;
+}
+
+//! Applies a frame to words, which must hold the frame before unless it is a keyframe
+static void DecodeFrame(const uint8_t *p, const uint8_t *end, bool keyframe, std::vector<uint32_t> &words)
+{
+	size_t n=words.size();
+	for(size_t i=0;i<n;){
+		uint32_t zz=detail::GetVarint(p, end, "SeriesReader");
+		size_t run=1;
+		if(zz==0){
+			run+=detail::GetVarint(p, end, "SeriesReader");
+			if(run>n-i)
+				throw std::invalid_argument("SeriesReader : Corrupt frame, run past the end.");
+		}
+		for(size_t j=i;j<i+run;j++){
+			words[j]=detail::UnzigzagDelta(zz, keyframe ? 0 : words[j]);
+		}
+		i+=run;
+	}
+	if(p!=end)
+		throw std::invalid_argument("SeriesReader : Corrupt frame, trailing bytes.");
+}
+
+static uint32_t Bits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, 4);
+	return bits;
+}
+
+//! Cuts fileName back to its first bytes bytes
+static void CutFile(const std::string &fileName, uint64_t bytes)
+{
+#ifndef _WIN32
+	if(truncate(fileName.c_str(), bytes))
+		throw std::runtime_error("SeriesWriter : Couldn't cut '"+fileName+"' back to the resumed step : "+strerror(errno));
+#else
+	// No truncate here, so the bytes kept are copied to a new file that
+	// replaces the old one
+	std::string temp=fileName+".tmp";
+	{
+		std::ifstream src(fileName.c_str(), std::ios::binary);
+		std::ofstream dst(temp.c_str(), std::ios::binary);
+		std::vector<char> block(1<<20);
+		while(bytes && src && dst){
+			size_t n=(size_t)std::min<uint64_t>(bytes, block.size());
+			src.read(&block[0], n);
+			dst.write(&block[0], src.gcount());
+			bytes-=src.gcount();
+		}
+		if(bytes || !dst){
+			dst.close();
+			std::remove(temp.c_str());
+			throw std::runtime_error("SeriesWriter : Couldn't cut '"+fileName+"' back to the resumed step.");
+		}
+	}
+	std::remove(fileName.c_str());
+	if(std::rename(temp.c_str(), fileName.c_str()))
+		throw std::runtime_error("SeriesWriter : Couldn't replace '"+fileName+"' with '"+temp+"'.");
+#endif
+}
+
+SeriesWriter::SeriesWriter(const std::string &fileName, const world_t &world, unsigned keyframeInterval, double quantum, bool resume)
+	: m_keyframeInterval(std::max(1u, keyframeInterval))
+	, m_quantum(quantum)
+	, m_frames(0)
+	, m_lastT(0)
+	, m_closing(false)
+{
+	if(quantum<0 || (quantum>0 && 1/quantum>UINT32_MAX/2))
+		throw std::invalid_argument("SeriesWriter : The quantum must be zero, or big enough for [0,1] to fit in 31 bits.");
+
+	if(resume && std::ifstream(fileName.c_str()).is_open()){
+		uint64_t keep;
+		{
+			SeriesReader reader(fileName);
+			const world_t &geometry=reader.m_world;
+			if(geometry.w!=world.w || geometry.h!=world.h || geometry.properties!=world.properties)
+				throw std::invalid_argument("SeriesWriter : The series in '"+fileName+"' has a different geometry.");
+			if(reader.m_quantum!=quantum)
+				throw std::invalid_argument("SeriesWriter : The series in '"+fileName+"' has a different quantum.");
+			m_keyframeInterval=reader.m_keyframeInterval;
+			while(m_frames<reader.frameCount() && reader.frameTime(m_frames)<=world.t){
+				m_frames++;
+			}
+			if(m_frames){
+				reader.readWords(m_frames-1, m_previous);
+				m_lastT=reader.frameTime(m_frames-1);
+			}
+			keep=reader.bytesThrough(m_frames);
+		}
+		CutFile(fileName, keep);
+		m_dst.open(fileName.c_str(), std::ios::binary | std::ios::app);
+		if(!m_dst.is_open())
+			throw std::runtime_error("SeriesWriter : Couldn't open '"+fileName+"'.");
+	}else{
+		m_dst.open(fileName.c_str(), std::ios::binary);
+		if(!m_dst.is_open())
+			throw std::runtime_error("SeriesWriter : Couldn't create '"+fileName+"'.");
+
+		m_dst<<SeriesHeader<<std::endl;
+		m_dst.precision(std::numeric_limits<double>::max_digits10);
+		m_dst<<world.w<<" "<<world.h<<" "<<world.alpha<<" "<<m_keyframeInterval<<" "<<quantum<<std::endl;
+		m_dst<<"-";
+		// The flags fit a byte, and the geometry is only written once anyway
+		std::vector<uint8_t> properties(world.properties.begin(), world.properties.end());
+		m_dst.write((const char*)properties.data(), properties.size());
+	}
+
+	m_thread=std::thread(&SeriesWriter::run, this);
+}
+
+SeriesWriter::~SeriesWriter()
+{
+	try{
+		finish();
+	}catch(...){
+		// Already too late to report it
+	}
+}
+
+void SeriesWriter::append(const world_t &world)
+{
+	HPCE_TRACE_SPAN("series:append");
+	frame_t frame;
+	frame.t=world.t;
+	frame.state=world.state;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed.wait(lock, [&](){ return m_queue.size()<SeriesQueueLength || m_error; });
+	if(m_error)
+		std::rethrow_exception(m_error);
+	m_queue.push_back(std::move(frame));
+	m_changed.notify_all();
+}
+
+void SeriesWriter::finish()
+{
+	if(m_thread.joinable()){
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_closing=true;
+			m_changed.notify_all();
+		}
+		m_thread.join();
+		m_dst.close();
+	}
+	if(m_error)
+		std::rethrow_exception(m_error);
+}
+
+void SeriesWriter::run()
+{
+	std::vector<uint32_t> words;
+	while(true){
+		frame_t frame;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_changed.wait(lock, [&](){ return !m_queue.empty() || m_closing; });
+			if(m_queue.empty())
+				return;
+			frame=std::move(m_queue.front());
+			m_queue.pop_front();
+			m_changed.notify_all();
+			if(m_error)
+				continue;	// drain the queue, so append doesn't wait for us
+		}
+
+		try{
+			HPCE_TRACE_SPAN("series:write");
+			StateToWords(frame.state, m_quantum, words);
+			bool keyframe=m_frames%m_keyframeInterval==0;
+			std::string payload=EncodeFrame(words, keyframe ? NULL : &m_previous);
+
+			series_record_t record={payload.size(), keyframe, Bits(frame.t)};
+			m_dst.write((const char*)&record, sizeof(record));
+			m_dst.write(payload.data(), payload.size());
+			m_dst.flush();
+			if(!m_dst.good())
+				throw std::runtime_error("SeriesWriter : Couldn't write a frame.");
+			std::swap(m_previous, words);
+			m_frames++;
+		}catch(...){
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_error=std::current_exception();
+			m_changed.notify_all();
+		}
+	}
+}
+
+SeriesReader::SeriesReader(const std::string &fileName)
+	: m_src(fileName.c_str(), std::ios::binary)
+{
+	if(!m_src.is_open())
+		throw std::runtime_error("SeriesReader : Couldn't open '"+fileName+"'.");
+
+	std::string header;
+	m_src>>header;
+	if(header!=SeriesHeader)
+		throw std::invalid_argument("SeriesReader : File does not start with HPCEHeatSeriesV0.");
+	m_src>>m_world.w>>m_world.h>>m_world.alpha>>m_keyframeInterval>>m_quantum;
+	char delim=0;
+	m_src>>delim;
+	if(!m_src.good() || delim!='-')
+		throw std::invalid_argument("SeriesReader : Corrupt header.");
+
+	size_t cells=(size_t)m_world.w*m_world.h;
+	std::vector<uint8_t> properties(cells);
+	m_src.read((char*)properties.data(), cells);
+	if(!m_src.good())
+		throw std::invalid_argument("SeriesReader : Corrupt input file, properties could not be read.");
+	m_world.properties.resize(cells);
+	for(size_t i=0;i<cells;i++){
+		unsigned flags=properties[i];
+		if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
+			throw std::invalid_argument("SeriesReader : Unknown flags for cell.");
+		m_world.properties[i]=(cell_flags_t)flags;
+	}
+	m_world.t=0.0f;
+
+	// Only the record headers are read, a frame cut short ends the series
+	m_framesStart=m_src.tellg();
+	uint64_t offset=m_framesStart;
+	m_src.seekg(0, std::ios::end);
+	uint64_t size=m_src.tellg();
+	while(offset+sizeof(series_record_t)<=size){
+		series_record_t record;
+		m_src.seekg(offset);
+		m_src.read((char*)&record, sizeof(record));
+		if(!m_src.good() || record.bytes>size-offset-sizeof(record))
+			break;
+		record_t r;
+		r.offset=offset+sizeof(record);
+		r.bytes=record.bytes;
+		r.keyframe=record.keyframe!=0;
+		memcpy(&r.t, &record.tBits, 4);
+		m_records.push_back(r);
+		offset=r.offset+r.bytes;
+	}
+	m_src.clear();
+}
+
+world_t SeriesReader::readFrame(unsigned i)
+{
+	HPCE_TRACE_SPAN("series:read");
+	std::vector<uint32_t> words;
+	readWords(i, words);
+
+	world_t world;
+	world.w=m_world.w;
+	world.h=m_world.h;
+	world.alpha=m_world.alpha;
+	world.properties=m_world.properties;
+	world.t=m_records[i].t;
+	WordsToState(words, m_quantum, world.state);
+	return world;
+}
+
+void SeriesReader::readWords(unsigned i, std::vector<uint32_t> &words)
+{
+	if(i>=m_records.size())
+		throw std::out_of_range("SeriesReader : No such frame.");
+	unsigned first=i;
+	while(!m_records[first].keyframe){
+		if(first==0)
+			throw std::invalid_argument("SeriesReader : Corrupt series, no keyframe before the frame.");
+		first--;
+	}
+
+	words.assign((size_t)m_world.w*m_world.h, 0);
+	std::vector<uint8_t> payload;
+	for(unsigned j=first;j<=i;j++){
+		const record_t &r=m_records[j];
+		payload.resize(r.bytes);
+		m_src.seekg(r.offset);
+		m_src.read((char*)payload.data(), r.bytes);
+		if(!m_src.good())
+			throw std::invalid_argument("SeriesReader : Corrupt input file, frame could not be read.");
+		DecodeFrame(payload.data(), payload.data()+payload.size(), r.keyframe, words);
+	}
+}
+
+uint64_t SeriesReader::bytesThrough(unsigned count) const
+{
+	if(count==0)
+		return m_framesStart;
+	const record_t &r=m_records.at(count-1);
+	return r.offset+r.bytes;
+}
+
+}; // namespace hpce
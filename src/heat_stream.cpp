@@ -0,0 +1,167 @@
+#include "heat_stream.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace hpce{
+
+const char *GeometryRecordHeader="HPCEHeatGeometryV0";
+const char *FrameRecordHeader="HPCEHeatFrameV0";
+
+static std::mutex g_geometriesMutex;
+static std::map<uint64_t, std::shared_ptr<const world_t> > g_geometries;
+
+static std::string HashText(uint64_t hash)
+{
+	char buffer[17];
+	snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)hash);
+	return buffer;
+}
+
+static uint64_t ReadHash(std::istream &src)
+{
+	std::string text;
+	src>>text;
+	char *end=0;
+	uint64_t hash=strtoull(text.c_str(), &end, 16);
+	if(text.size()!=16 || *end)
+		throw std::invalid_argument("LoadWorld : Corrupt input file, bad geometry hash.");
+	return hash;
+}
+
+static uint32_t Bits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, 4);
+	return bits;
+}
+
+static float FromBits(uint32_t bits)
+{
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+static void ReadEnd(std::istream &src)
+{
+	std::string footer;
+	src>>footer;
+	if(footer!="End")
+		throw std::invalid_argument("LoadWorld : Corrupt input file, missing 'End' to terminate record.");
+}
+
+WorldStreamWriter::WorldStreamWriter(std::ostream &dst)
+	: m_dst(dst)
+{}
+
+void WorldStreamWriter::write(const world_t &world)
+{
+	HPCE_TRACE_SPAN("WorldStreamWriter");
+	uint64_t hash=GeometryHash(world);
+	size_t cells=(size_t)world.w*world.h;
+	if(!m_sent.count(hash)){
+		m_dst<<GeometryRecordHeader<<" "<<HashText(hash)<<" "<<world.w<<" "<<world.h<<std::endl;
+		m_dst<<"-";
+		std::vector<uint8_t> flags(world.properties.begin(), world.properties.end());
+		m_dst.write((const char*)flags.data(), cells);
+		m_dst<<"End"<<std::endl;
+		m_sent.insert(hash);
+	}
+	// alpha and t go as bits, so they come through exactly
+	m_dst<<FrameRecordHeader<<" "<<HashText(hash)<<" "<<Bits(world.alpha)<<" "<<Bits(world.t)<<std::endl;
+	m_dst<<"-";
+	m_dst.write((const char*)world.state.data(), 4*cells);
+	m_dst<<"End"<<std::endl;
+}
+
+std::shared_ptr<const world_t> FindStreamedGeometry(uint64_t hash)
+{
+	std::lock_guard<std::mutex> lock(g_geometriesMutex);
+	std::map<uint64_t, std::shared_ptr<const world_t> >::const_iterator it=g_geometries.find(hash);
+	return it==g_geometries.end() ? std::shared_ptr<const world_t>() : it->second;
+}
+
+//! Reads a geometry record after its header, and keeps it for the frames
+static void ReadGeometry(std::istream &src)
+{
+	uint64_t hash=ReadHash(src);
+	std::shared_ptr<world_t> geometry=std::make_shared<world_t>();
+	char delim=0;
+	src>>geometry->w>>geometry->h>>delim;
+	if(!src.good() || delim!='-')
+		throw std::invalid_argument("LoadWorld : Corrupt input file, bad geometry record.");
+
+	size_t cells=(size_t)geometry->w*geometry->h;
+	std::vector<uint8_t> flags(cells);
+	src.read((char*)flags.data(), cells);
+	if(!src.good())
+		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements of properties could not be read.");
+	geometry->properties.resize(cells);
+	for(size_t i=0;i<cells;i++){
+		if(flags[i]>Cell_Insulator)
+			throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
+		geometry->properties[i]=(cell_flags_t)flags[i];
+	}
+	ReadEnd(src);
+	geometry->alpha=0;
+	geometry->t=0;
+
+	if(GeometryHash(*geometry)!=hash)
+		throw std::invalid_argument("LoadWorld : Corrupt input file, geometry doesn't match its hash.");
+
+	std::lock_guard<std::mutex> lock(g_geometriesMutex);
+	g_geometries[hash]=geometry;
+}
+
+world_t LoadWorldStreamed(std::istream &src, const std::string &header)
+{
+	HPCE_TRACE_SPAN("LoadWorldStreamed");
+	std::string word=header;
+	if(word==GeometryRecordHeader){
+		ReadGeometry(src);
+		src>>word;
+	}
+	if(word!=FrameRecordHeader)
+		throw std::invalid_argument("LoadWorld : Expected a frame record.");
+
+	uint64_t hash=ReadHash(src);
+	uint32_t alphaBits=0, tBits=0;
+	char delim=0;
+	src>>alphaBits>>tBits>>delim;
+	if(!src.good() || delim!='-')
+		throw std::invalid_argument("LoadWorld : Corrupt input file, bad frame record.");
+	std::shared_ptr<const world_t> geometry=FindStreamedGeometry(hash);
+	if(!geometry)
+		throw std::invalid_argument("LoadWorld : Frame of geometry "+HashText(hash)+", which hasn't been sent.");
+
+	world_t world;
+	world.w=geometry->w;
+	world.h=geometry->h;
+	world.properties=geometry->properties;
+	world.alpha=FromBits(alphaBits);
+	world.t=FromBits(tBits);
+	size_t cells=(size_t)world.w*world.h;
+	world.state.resize(cells);
+	src.read((char*)world.state.data(), 4*cells);
+	if(!src.good())
+		throw std::invalid_argument("LoadWorld : Corrupt input file, one or more elements of state could not be read.");
+	unsigned bad=0;
+	for(size_t i=0;i<cells;i++){
+		bad|=(world.state[i]<0.0f) | (world.state[i]>1.0f);
+	}
+	if(bad)
+		throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
+	ReadEnd(src);
+	return world;
+}
+
+}; // namespace hpce
@@ -1,4 +1,6 @@
 #include "heat.hpp"
+#include "heat_chunked.hpp"
+#include "heat_stream.hpp"
 
 #include <cstdlib>
 
@@ -7,6 +9,8 @@ int main(int argc, char *argv[])
 	unsigned n=128;
 	float alpha=0.1;
 	bool binary=false;
+	bool chunked=false;	// format 2, see SaveWorldChunked
+	bool streamed=false;	// format 3, see WorldStreamWriter
 	
 	if(argc>1){
 		n=atoi(argv[1]);
@@ -17,12 +21,22 @@ int main(int argc, char *argv[])
 	if(argc>3){
 		if(atoi(argv[3]))
 			binary=true;
+		if(atoi(argv[3])==2)
+			chunked=true;
+		if(atoi(argv[3])==3)
+			streamed=true;
 	}
 	
 	try{
 		hpce::world_t world=hpce::MakeTestWorld(n, alpha);
 		
-		hpce::SaveWorld(std::cout, world, binary);
+		if(chunked){
+			hpce::SaveWorldChunked(std::cout, world);
+		}else if(streamed){
+			hpce::WorldStreamWriter(std::cout).write(world);
+		}else{
+			hpce::SaveWorld(std::cout, world, binary);
+		}
 	}catch(const std::exception &e){
 		std::cerr<<"Exception : "<<e.what()<<std::endl;
 		return 1;
@@ -1,21 +1,58 @@
 #include "heat.hpp"
+#include "heat_chunked.hpp"
+#include "heat_stream.hpp"
 
 #include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
 
 int main(int argc, char *argv[])
 {
 	std::string dstFile="-"; // stdout
+	std::string srcFile="-"; // stdin
 	
 	if(argc>1){
 		dstFile=argv[1];
 	}
+	// Reading from a file rather than stdin keeps only a row of the world in
+	// memory, see WorldRowReader
+	if(argc>2){
+		srcFile=argv[2];
+	}
 	
 	try{
-		hpce::world_t world=hpce::LoadWorld(std::cin);
-		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+		std::ifstream file;
+		std::istream *src=&std::cin;
+		if(srcFile!="-"){
+			file.open(srcFile.c_str(), std::ios::in | std::ios::binary);
+			if(!file.good())
+				throw std::runtime_error("render_world : Couldn't open '"+srcFile+"'.");
+			src=&file;
+		}
+		std::string header;
+		*src>>header;
+		
+		// Chunked and streamed worlds can't be read a row at a time, so
+		// they are loaded whole and rendered from memory
+		if(header==hpce::ChunkedWorldHeader
+			|| header==hpce::GeometryRecordHeader || header==hpce::FrameRecordHeader){
+			hpce::world_t world=hpce::LoadWorld(*src, header);
+			std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+			
+			std::cerr<<"Rendering to "<<dstFile<<std::endl;
+			hpce::RenderWorld(dstFile, world);
+			return 0;
+		}
+		
+		// A file is opened again by name, to read properties and state side by side
+		std::unique_ptr<hpce::WorldRowReader> rows(srcFile=="-"
+			? new hpce::WorldRowReader(std::cin, header)
+			: new hpce::WorldRowReader(srcFile));
+		std::cerr<<"Loaded world with w="<<rows->width()<<", h="<<rows->height()<<std::endl;
 		
 		std::cerr<<"Rendering to "<<dstFile<<std::endl;
-		hpce::RenderWorld(dstFile, world);
+		hpce::RenderWorld(dstFile, *rows);
 	}catch(const std::exception &e){
 		std::cerr<<"Exception : "<<e.what()<<std::endl;
 		return 1;
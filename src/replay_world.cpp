@@ -0,0 +1,39 @@
+#include "heat.hpp"
+#include "heat_series.hpp"
+
+#include <cstdlib>
+
+/* Reads the frames of a time series written by step_world --series
+
+	replay_world series	lists the frames, the index and t of each
+	replay_world series i [binary]	writes frame i out as a world
+*/
+int main(int argc, char *argv[])
+{
+	if(argc<2){
+		std::cerr<<"Usage : replay_world series [frame [binary]]"<<std::endl;
+		return 1;
+	}
+
+	try{
+		hpce::SeriesReader reader(argv[1]);
+
+		if(argc<3){
+			for(unsigned i=0;i<reader.frameCount();i++){
+				std::cout<<i<<" "<<reader.frameTime(i)<<std::endl;
+			}
+			return 0;
+		}
+
+		unsigned frame=atoi(argv[2]);
+		bool binary=argc>3 && atoi(argv[3]);
+		hpce::world_t world=reader.readFrame(frame);
+		std::cerr<<"Frame "<<frame<<" of "<<reader.frameCount()<<" at t="<<world.t<<std::endl;
+		hpce::SaveWorld(std::cout, world, binary);
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,12 +1,130 @@
 #include "heat.hpp"
+#include "heat_engine.hpp"
+#include "heat_perf_counters.hpp"
+#include "heat_out_of_core.hpp"
+#include "heat_chunked.hpp"
+#include "heat_checkpoint.hpp"
+#include "heat_series.hpp"
+#include "heat_stream.hpp"
 
 #include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fstream>
+
+namespace{
+	// The format argument: chunked is SaveWorldChunked, and streamed is
+	// WorldStreamWriter, which sends the geometry of a batch or of a chain
+	// of step_worlds once
+	enum{
+		Format_Text=0,
+		Format_Binary=1,
+		Format_Chunked=2,
+		Format_Streamed=3
+	};
+	
+	//! \param stdoutStream Writes the streamed worlds to stdout
+	void Save(const std::string &output, const hpce::world_t &world, int format, hpce::WorldStreamWriter &stdoutStream)
+	{
+		if(format==Format_Streamed && output=="-"){
+			stdoutStream.write(world);
+		}else if(format==Format_Streamed){
+			std::ofstream dst(output.c_str(), std::ios::binary);
+			hpce::WorldStreamWriter(dst).write(world);
+		}else if(format==Format_Chunked && output=="-"){
+			hpce::SaveWorldChunked(std::cout, world);
+		}else if(format==Format_Chunked){
+			std::ofstream dst(output.c_str(), std::ios::binary);
+			hpce::SaveWorldChunked(dst, world);
+		}else{
+			// HPCE_IO_DIRECT=1 bypasses the page cache for big files
+			const char *direct=getenv("HPCE_IO_DIRECT");
+			hpce::SaveWorldFile(output, world, format!=Format_Text, direct && atoi(direct));
+		}
+	}
+};
 
 int main(int argc, char *argv[])
 {
 	float dt=0.1;
 	unsigned n=1;
-	bool binary=false;
+	int format=Format_Text;
+	
+	// The engine comes from --engine=<name>, then HPCE_ENGINE, then defaults
+	// to the reference. Options are taken out so the positional arguments
+	// keep their positions.
+	std::string engineName="reference";
+	const char *env=getenv("HPCE_ENGINE");
+	if(env && *env)
+		engineName=env;
+	bool listEngines=false;
+	// With --batch every world on stdin is read, they are stepped together
+	// and written out in the same order
+	bool batch=false;
+	// With --out-of-core the world goes straight from stdin to scratch files
+	// and back out to stdout, so it never has to fit in memory
+	bool outOfCore=false;
+	// A single world can come from and go to named files, rather than
+	// stdin and stdout, which lets binary worlds be read and written by
+	// every thread at once
+	std::string input="-", output="-";
+	// With --checkpoint=<file> a single world is checkpointed every so many
+	// steps or seconds (default every 600 seconds), and with --resume the
+	// run starts from that file if it is there, rather than from the input
+	std::string checkpoint;
+	uint64_t checkpointSteps=0;
+	double checkpointSeconds=0;
+	bool resume=false;
+	// With --series=<file> the world is recorded at the start and every
+	// --series-every steps as a time series, see SeriesWriter, which
+	// replay_world reads back
+	std::string series;
+	uint64_t seriesEvery=1;
+	unsigned seriesKeyframe=16;
+	double seriesQuantum=0;
+	int argDst=1;
+	for(int i=1;i<argc;i++){
+		if(!strncmp(argv[i], "--engine=", 9)){
+			engineName=argv[i]+9;
+		}else if(!strcmp(argv[i], "--list-engines")){
+			listEngines=true;
+		}else if(!strcmp(argv[i], "--batch")){
+			batch=true;
+		}else if(!strcmp(argv[i], "--out-of-core")){
+			outOfCore=true;
+		}else if(!strncmp(argv[i], "--input=", 8)){
+			input=argv[i]+8;
+		}else if(!strncmp(argv[i], "--output=", 9)){
+			output=argv[i]+9;
+		}else if(!strncmp(argv[i], "--checkpoint=", 13)){
+			checkpoint=argv[i]+13;
+		}else if(!strncmp(argv[i], "--checkpoint-steps=", 19)){
+			checkpointSteps=strtoull(argv[i]+19, NULL, 10);
+		}else if(!strncmp(argv[i], "--checkpoint-seconds=", 21)){
+			checkpointSeconds=strtod(argv[i]+21, NULL);
+		}else if(!strcmp(argv[i], "--resume")){
+			resume=true;
+		}else if(!strncmp(argv[i], "--series=", 9)){
+			series=argv[i]+9;
+		}else if(!strncmp(argv[i], "--series-every=", 15)){
+			seriesEvery=std::max(1ull, strtoull(argv[i]+15, NULL, 10));
+		}else if(!strncmp(argv[i], "--series-keyframe=", 18)){
+			seriesKeyframe=atoi(argv[i]+18);
+		}else if(!strncmp(argv[i], "--series-quantum=", 17)){
+			seriesQuantum=strtod(argv[i]+17, NULL);
+		}else{
+			argv[argDst++]=argv[i];
+		}
+	}
+	argc=argDst;
+	
+	if(listEngines){
+		const std::vector<hpce::engine_t> &engines=hpce::Engines();
+		for(unsigned i=0;i<engines.size();i++){
+			std::cout<<engines[i].name<<"\t"<<engines[i].description<<"\n";
+		}
+		return 0;
+	}
 	
 	if(argc>1){
 		dt=(float)strtod(argv[1], NULL);
@@ -15,18 +133,112 @@ int main(int argc, char *argv[])
 		n=atoi(argv[2]);
 	}
 	if(argc>3){
-		if(atoi(argv[3]))
-			binary=true;
+		format=atoi(argv[3]);
+		if(format<Format_Text || format>Format_Streamed)
+			format=Format_Binary;	// any other non-zero has always meant binary
 	}
 	
 	try{
-		hpce::world_t world=hpce::LoadWorld(std::cin);
-		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+		if((outOfCore || batch) && (input!="-" || output!="-"))
+			throw std::invalid_argument("--input and --output are for a single world in memory.");
+		if((outOfCore || batch) && (!checkpoint.empty() || !series.empty()))
+			throw std::invalid_argument("--checkpoint and --series are for a single world in memory.");
+		if(resume && checkpoint.empty())
+			throw std::invalid_argument("--resume needs --checkpoint=<file>.");
+		if(!checkpoint.empty() && checkpointSteps==0 && checkpointSeconds<=0)
+			checkpointSeconds=600;
+		
+		if(outOfCore){
+			if(format!=Format_Text && format!=Format_Binary)
+				throw std::invalid_argument("Out of core worlds are written a row at a time, as text or binary.");
+			std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" out of core"<<std::endl;
+			hpce::StepStreamOutOfCore(std::cin, std::cout, dt, n, format==Format_Binary, hpce::out_of_core_options_t::FromEnvironment());
+			return 0;
+		}
+		
+		const hpce::engine_t &engine=hpce::FindEngine(engineName);
+		hpce::WorldStreamWriter stdoutStream(std::cout);
+		
+		if(batch){
+			std::vector<hpce::world_t> worlds;
+			double cells=0;
+			while((std::cin>>std::ws).peek()!=EOF){
+				worlds.push_back(hpce::LoadWorld(std::cin));
+				cells+=(double)worlds.back().w*worlds.back().h;
+			}
+			std::cerr<<"Loaded "<<worlds.size()<<" worlds with "<<cells<<" cells"<<std::endl;
+			
+			std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" with engine "<<engine.name<<std::endl;
+			hpce::PerfCounters counters;
+			counters.start();
+			hpce::StepWorlds(engine, worlds, std::vector<float>(1, dt), n);
+			counters.stop();
+			counters.report(engine.name, cells*n);
+			
+			for(unsigned i=0;i<worlds.size();i++){
+				Save("-", worlds[i], format, stdoutStream);
+			}
+			return 0;
+		}
+		
+		const char *io=getenv("HPCE_IO_DIRECT");
+		bool direct=io && atoi(io);
+		hpce::world_t world;
+		uint64_t step=0;
+		float checkpointDt=dt;
+		bool resumed=resume && hpce::LoadCheckpoint(checkpoint, world, step, checkpointDt, direct);
+		if(resumed){
+			if(checkpointDt!=dt)
+				throw std::invalid_argument("The checkpoint was taken with a different dt.");
+			if(step>n)
+				throw std::invalid_argument("The checkpoint is past the end of the run.");
+			std::cerr<<"Resumed world with w="<<world.w<<", h="<<world.h<<" at step "<<step<<std::endl;
+		}else{
+			world=hpce::LoadWorldFile(input, direct);
+			std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+		}
+		uint64_t first=step;
 		
-		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<std::endl;
-		hpce::StepWorld(world, dt, n);
+		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" with engine "<<engine.name<<std::endl;
+		// HPCE_PERF_COUNTERS wraps just the stepping in hardware counters
+		hpce::PerfCounters counters;
+		counters.start();
+		if(checkpoint.empty() && series.empty()){
+			engine.step(world, dt, n);
+		}else{
+			// Stepping in chunks gives the same world as one call. A resumed
+			// run carries on its series, with frames at the same steps.
+			std::unique_ptr<hpce::Checkpointer> checkpointer;
+			if(!checkpoint.empty())
+				checkpointer.reset(new hpce::Checkpointer(checkpoint, dt, step, checkpointSteps, checkpointSeconds, direct));
+			std::unique_ptr<hpce::SeriesWriter> seriesWriter;
+			if(!series.empty()){
+				seriesWriter.reset(new hpce::SeriesWriter(series, world, seriesKeyframe, seriesQuantum, resumed));
+				if(step%seriesEvery==0 && !seriesWriter->endsAt(world.t))
+					seriesWriter->append(world);
+			}
+			while(step<n){
+				uint64_t chunk=n-step;
+				if(checkpointer)
+					chunk=std::min<uint64_t>(chunk, checkpointer->nextChunk(step, n-step));
+				if(seriesWriter)
+					chunk=std::min(chunk, seriesEvery-step%seriesEvery);
+				engine.step(world, dt, (unsigned)chunk);
+				step+=chunk;
+				if(checkpointer)
+					checkpointer->update(world, step);
+				if(seriesWriter && step%seriesEvery==0)
+					seriesWriter->append(world);
+			}
+			if(checkpointer)
+				checkpointer->finish();
+			if(seriesWriter)
+				seriesWriter->finish();
+		}
+		counters.stop();
+		counters.report(engine.name, (double)world.w*world.h*(n-first));
 		
-		hpce::SaveWorld(std::cout, world, binary);
+		Save(output, world, format, stdoutStream);
 	}catch(const std::exception &e){
 		std::cerr<<"Exception : "<<e.what()<<std::endl;
 		return 1;
@@ -0,0 +1,137 @@
+#ifndef yc12015_cl_common_hpp
+#define yc12015_cl_common_hpp
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <stdexcept>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+namespace hpce{
+  namespace yc12015{
+
+//! True while this thread's engines should keep their setup to themselves
+/*! Set through QuietSetup, so auto can calibrate without printing the
+    device listing of every run. Build logs and errors still get out. */
+inline bool &SetupIsQuiet(){
+  static thread_local bool quiet = false;
+  return quiet;
+}
+
+//! Keeps the engines run by this thread quiet while it is in scope
+class QuietSetup
+{
+public:
+  QuietSetup()
+    : m_old(SetupIsQuiet())
+  { SetupIsQuiet() = true; }
+
+  ~QuietSetup()
+  { SetupIsQuiet() = m_old; }
+private:
+  bool m_old;
+};
+
+//! Reads a kernel source file from HPCE_CL_SRC_DIR (default src/yc12015)
+inline std::string LoadSource(const char *fileName){
+  const char *v = getenv("HPCE_CL_SRC_DIR");
+  std::string baseDir = v? v: "src/yc12015";
+
+  std::string fullName = baseDir+"/"+fileName;
+
+  std::ifstream src(fullName, std::ios::in | std::ios::binary);
+  if(!src.is_open()){
+    throw std::runtime_error("LoadSource: Couldn't load cl file from '"+
+        fullName+"'.\n");
+  }
+  return std::string(
+      (std::istreambuf_iterator<char>(src)), // extra brackets?
+      std::istreambuf_iterator<char>()
+      );
+}
+
+//! Lists platforms and devices, and picks one from the environment
+/*! HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE choose by index, both
+    defaulting to 0.
+    \param devices Filled with all the devices of the chosen platform
+    \return The chosen device
+*/
+inline cl::Device SelectDevice(std::vector<cl::Device> &devices){
+  // show platforms
+  std::vector<cl::Platform> platforms;
+  cl::Platform::get(&platforms);
+  std::vector<cl::Platform>::size_type no_platforms = platforms.size();
+  if(no_platforms == 0){
+    throw std::runtime_error("No OpenCL plaforms found.\n");
+  }
+  bool quiet = SetupIsQuiet();
+  if(!quiet){
+    std::cerr<<"Found "<<no_platforms<<" platforms"<<std::endl;
+    for(unsigned i=0; i<no_platforms; i++){
+      std::string vendor = platforms[i].getInfo<CL_PLATFORM_VENDOR>();
+      std::cerr<<"\tPlatform "<<i<<" : "<<vendor<<std::endl;
+    }
+  }
+  // get from env
+  const char *v = getenv("HPCE_SELECT_PLATFORM");
+  // default platform is 0
+  int selectedPlatform = v? atoi(v): 0;
+  if(!quiet)
+    std::cerr<<"Choosing platform "<<selectedPlatform<<std::endl;
+  cl::Platform platform = platforms.at(selectedPlatform);
+
+  // show devices
+  platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+  std::vector<cl::Device>::size_type no_devices = devices.size();
+  if(no_devices == 0){
+    throw std::runtime_error("No OpenCL devices found.\n");
+  }
+  if(!quiet){
+    std::cerr<<"Found "<<no_devices<<" devies"<<std::endl;
+    for(unsigned i=0; i<no_devices; i++){
+      std::string deviceName = devices[i].getInfo<CL_DEVICE_NAME>();
+      std::cerr<<"\tDevice "<<i<<" : "<<deviceName<<std::endl;
+    }
+  }
+  // get from env
+  const char *u = getenv("HPCE_SELECT_DEVICE");
+  // default device is 0
+  int selectedDevice = u? atoi(u): 0;
+  if(!quiet)
+    std::cerr<<"Choosing device "<<selectedDevice<<std::endl;
+  return devices.at(selectedDevice);
+}
+
+//! Loads and builds a kernel file, printing the build logs on failure
+inline cl::Program BuildProgram(const cl::Context &context, const std::vector<cl::Device> &devices, const char *fileName){
+  std::string kernelSource = LoadSource(fileName);
+  cl::Program::Sources sources;
+  sources.push_back(std::make_pair(
+        kernelSource.c_str(),
+        kernelSource.size()+1
+        )
+      );
+
+  cl::Program program(context, sources);
+  try{
+    program.build(devices);
+  }catch(...){
+    for(unsigned i=0; i<devices.size(); i++){
+      std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
+      std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
+    }
+    throw;
+  }
+  return program;
+}
+
+  }; // namespace yc12015
+}; // namespace hpce
+
+#endif
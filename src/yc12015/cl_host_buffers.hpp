@@ -0,0 +1,66 @@
+#ifndef yc12015_cl_host_buffers_hpp
+#define yc12015_cl_host_buffers_hpp
+
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#include "cl_common.hpp"
+
+namespace hpce{
+  namespace yc12015{
+
+//! Whether buffers should be created over host memory rather than copied
+/*! True for devices reporting CL_DEVICE_HOST_UNIFIED_MEMORY (typically CPU
+    runtimes and integrated GPUs), unless HPCE_CL_ZERO_COPY=0. */
+inline bool UseZeroCopy(const cl::Device &device)
+{
+  const char *v = getenv("HPCE_CL_ZERO_COPY");
+  if(v && !atoi(v)){
+    return false;
+  }
+  bool unified = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>()==CL_TRUE;
+  if(!SetupIsQuiet())
+    std::cerr<<"Device "<<(unified ? "shares" : "doesn't share")<<" memory with the host"<<std::endl;
+  return unified;
+}
+
+//! Whether host storage is aligned enough for the runtime to use it in place
+inline bool IsSuitableHostPtr(const cl::Device &device, const void *ptr)
+{
+  // reported in bits
+  cl_uint align = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>()/8;
+  return align==0 || ((uintptr_t)ptr % align)==0;
+}
+
+//! Creates a buffer over existing host storage if zeroCopy, else a device buffer
+/*! The host storage must outlive the buffer. */
+inline cl::Buffer MakeHostBuffer(const cl::Context &context, cl_mem_flags flags,
+    size_t cb, const void *host, bool zeroCopy)
+{
+  if(zeroCopy){
+    return cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, cb, (void*)host);
+  }else{
+    return cl::Buffer(context, flags, cb);
+  }
+}
+
+//! Makes the device's writes to a host pointer buffer visible to the host
+/*! On unified memory the map is a no-op returning the original pointer, so
+    this replaces enqueueReadBuffer without copying anything. */
+inline void SyncHostBuffer(cl::CommandQueue &queue, cl::Buffer &buffer, size_t cb,
+    const std::vector<cl::Event> *dependencies=NULL, cl::Event *event=NULL)
+{
+  void *p = queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, cb, dependencies);
+  queue.enqueueUnmapMemObject(buffer, p, NULL, event);
+}
+
+  }; // namespace yc12015
+}; // namespace hpce
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef yc12015_cl_profiler_hpp
+#define yc12015_cl_profiler_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+namespace hpce{
+  namespace yc12015{
+
+//! Collects timing for an OpenCL engine run and reports it as JSON
+/*! Instrumentation is switched on by the environment variable HPCE_CL_PROFILE:
+    - unset, empty or "0" : disabled, no overhead apart from a branch per call,
+      as labels are passed as C strings and only copied when enabled
+    - "1", "-" or "stderr" : report is written to stderr
+    - anything else : name of the file the report is written to
+
+    Host-side phases (context setup, program build, ...) are timed as laps
+    of a wall clock, and every enqueue that is handed to record() has its
+    cl::Event profiling info folded into per (phase, kernel) totals.
+*/
+class ClProfiler
+{
+public:
+  ClProfiler(const std::string &engine)
+    : m_engine(engine)
+    , m_enabled(false)
+    , m_start(clock_type::now())
+    , m_lap(m_start)
+  {
+    const char *v = getenv("HPCE_CL_PROFILE");
+    if(v && *v && std::string(v)!="0"){
+      m_enabled = true;
+      m_dest = v;
+    }
+  }
+
+  bool enabled() const
+  { return m_enabled; }
+
+  //! Properties to pass when creating the command queue
+  cl_command_queue_properties queueProperties() const
+  { return m_enabled ? CL_QUEUE_PROFILING_ENABLE : 0; }
+
+  //! Attributes the host time since the previous lap to the named phase
+  /*! \return Length of the lap in seconds, or 0 when disabled */
+  double lap(const char *phase)
+  {
+    if(!m_enabled)
+      return 0;
+    clock_type::time_point now = clock_type::now();
+    double seconds = std::chrono::duration<double>(now-m_lap).count();
+    m_hostPhases.push_back(std::make_pair(std::string(phase), seconds));
+    m_lap = now;
+    return seconds;
+  }
+
+  //! Remembers an enqueued command, to be resolved once it completes
+  void record(const char *phase, const char *kernel, const cl::Event &ev)
+  {
+    if(!m_enabled)
+      return;
+    m_pending.push_back(pending_t{std::string(phase), std::string(kernel), ev});
+    // Don't let long runs accumulate millions of events: resolving a batch
+    // waits for it, which costs a host sync every few thousand enqueues,
+    // but only when profiling.
+    if(m_pending.size() >= 4096){
+      resolve();
+    }
+  }
+
+  //! Extra key/value pairs for the report, e.g. world size
+  void attribute(const char *key, double value)
+  {
+    if(m_enabled)
+      m_attributes.push_back(std::make_pair(std::string(key), value));
+  }
+
+  //! Waits for outstanding events and writes the report
+  void report()
+  {
+    if(!m_enabled)
+      return;
+    resolve();
+
+    double wall = std::chrono::duration<double>(clock_type::now()-m_start).count();
+
+    if(m_dest=="1" || m_dest=="-" || m_dest=="stderr"){
+      write(std::cerr, wall);
+    }else{
+      std::ofstream dst(m_dest.c_str());
+      if(!dst.is_open()){
+        throw std::runtime_error("ClProfiler: Couldn't open '"+m_dest+"' for the timing report.\n");
+      }
+      write(dst, wall);
+    }
+  }
+
+private:
+  typedef std::chrono::steady_clock clock_type;
+
+  struct pending_t{
+    std::string phase;
+    std::string kernel;
+    cl::Event event;
+  };
+
+  struct stats_t{
+    uint64_t count;
+    uint64_t queuedNs;  // time between enqueue and start of execution
+    uint64_t totalNs;   // execution time
+    uint64_t minNs;
+    uint64_t maxNs;
+  };
+
+  void resolve()
+  {
+    for(unsigned i=0; i<m_pending.size(); i++){
+      cl::Event &ev = m_pending[i].event;
+      ev.wait();
+      cl_ulong queued = ev.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+      cl_ulong start = ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      cl_ulong end = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+      std::pair<std::string,std::string> key(m_pending[i].phase, m_pending[i].kernel);
+      std::map<std::pair<std::string,std::string>,stats_t>::iterator it = m_device.find(key);
+      if(it==m_device.end()){
+        stats_t fresh = {0, 0, 0, UINT64_MAX, 0};
+        it = m_device.insert(std::make_pair(key, fresh)).first;
+        m_deviceOrder.push_back(key);
+      }
+      stats_t &s = it->second;
+      uint64_t dur = end-start;
+      s.count++;
+      s.queuedNs += start-queued;
+      s.totalNs += dur;
+      s.minNs = std::min(s.minNs, dur);
+      s.maxNs = std::max(s.maxNs, dur);
+    }
+    m_pending.clear();
+  }
+
+  static std::string quote(const std::string &s)
+  {
+    std::string res = "\"";
+    for(unsigned i=0; i<s.size(); i++){
+      if(s[i]=='"' || s[i]=='\\')
+        res += '\\';
+      res += s[i];
+    }
+    return res+"\"";
+  }
+
+  void write(std::ostream &dst, double wall) const
+  {
+    dst<<"{\n";
+    dst<<"  \"engine\": "<<quote(m_engine)<<",\n";
+    for(unsigned i=0; i<m_attributes.size(); i++){
+      dst<<"  "<<quote(m_attributes[i].first)<<": "<<m_attributes[i].second<<",\n";
+    }
+    dst<<"  \"wall_seconds\": "<<wall<<",\n";
+
+    dst<<"  \"host_phases\": [";
+    for(unsigned i=0; i<m_hostPhases.size(); i++){
+      dst<<(i?",":"")<<"\n    {\"phase\": "<<quote(m_hostPhases[i].first)
+        <<", \"seconds\": "<<m_hostPhases[i].second<<"}";
+    }
+    dst<<"\n  ],\n";
+
+    dst<<"  \"device_phases\": [";
+    for(unsigned i=0; i<m_deviceOrder.size(); i++){
+      const stats_t &s = m_device.find(m_deviceOrder[i])->second;
+      dst<<(i?",":"")<<"\n    {\"phase\": "<<quote(m_deviceOrder[i].first)
+        <<", \"kernel\": "<<quote(m_deviceOrder[i].second)
+        <<", \"count\": "<<s.count
+        <<", \"total_ns\": "<<s.totalNs
+        <<", \"mean_ns\": "<<(s.count ? s.totalNs/s.count : 0)
+        <<", \"min_ns\": "<<(s.count ? s.minNs : 0)
+        <<", \"max_ns\": "<<s.maxNs
+        <<", \"queued_ns\": "<<s.queuedNs<<"}";
+    }
+    dst<<"\n  ]\n";
+    dst<<"}"<<std::endl;
+  }
+
+  std::string m_engine;
+  bool m_enabled;
+  std::string m_dest;
+
+  clock_type::time_point m_start;
+  clock_type::time_point m_lap;
+
+  std::vector<std::pair<std::string,double> > m_attributes;
+  std::vector<std::pair<std::string,double> > m_hostPhases;
+  std::vector<pending_t> m_pending;
+  std::map<std::pair<std::string,std::string>,stats_t> m_device;
+  std::vector<std::pair<std::string,std::string> > m_deviceOrder;
+};
+
+  }; // namespace yc12015
+}; // namespace hpce
+
+#endif
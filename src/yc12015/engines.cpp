@@ -0,0 +1,82 @@
+#include "heat_engine.hpp"
+#include "heat_parallel.hpp"
+
+#include <stdexcept>
+
+namespace hpce{
+  namespace yc12015{
+
+void StepWorldV1Lambda(world_t &world, float dt, unsigned n);
+void StepWorldV2Function(world_t &world, float dt, unsigned n);
+void StepWorldV3OpenCL(world_t &world, float dt, unsigned n);
+void StepWorldV4DoubleBuffered(world_t &world, float dt, unsigned n);
+void StepWorldsV4DoubleBuffered(std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n);
+void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n);
+void StepWorldV6HalfPrecision(world_t &world, float dt, unsigned n);
+void StepWorldEnsemble(world_t &world, float dt, unsigned n);
+void StepWorldsEnsemble(std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n);
+void StepWorldOutOfCore(world_t &world, float dt, unsigned n);
+void StepWorldAuto(world_t &world, float dt, unsigned n);
+
+  }; // namespace yc12015
+
+// Per cell update, for the roofline model in heat_bench. Bytes are the
+// compulsory traffic once neighbours come from cache: the cell's state and
+// properties in, the new state out. Flops are those of an interior cell: a
+// multiply, four conditional add + multiply-add pairs and a divide, with
+// the clamp not counted. auto depends on the engine it picks, so is unknown.
+const double StencilFlops = 1+4*3+1;
+
+const std::vector<engine_t> &Engines()
+{
+  static const engine_t table[]={
+    {"reference", "single threaded reference StepWorld", &StepWorld, 0, 4+4+4, StencilFlops},
+    {"v1_lambda", "reference loop with the stencil in a lambda", &yc12015::StepWorldV1Lambda, 0, 4+4+4, StencilFlops},
+    {"v2_function", "reference loop with the stencil in a function", &yc12015::StepWorldV2Function, 0, 4+4+4, StencilFlops},
+    // device memory only, the state also crosses the bus twice a step
+    {"v3_opencl", "OpenCL, state copied to and from the device every step", &yc12015::StepWorldV3OpenCL, 0, 4+4+4, StencilFlops},
+    {"v4_double_buffered", "OpenCL, state stays on the device and ping-pongs", &yc12015::StepWorldV4DoubleBuffered, &yc12015::StepWorldsV4DoubleBuffered, 4+4+4, StencilFlops},
+    // packing saves the neighbour property loads, which were cache hits
+    {"v5_packed_properties", "OpenCL, neighbour insulator bits packed per cell", &yc12015::StepWorldV5PackedProperties, 0, 4+4+4, StencilFlops},
+    // 16 bit state and an 8 bit mask, decoding to float isn't counted
+    {"v6_half_precision", "16 bit state (HPCE_HALF_FORMAT), CPU or OpenCL", &yc12015::StepWorldV6HalfPrecision, 0, 2+1+2, StencilFlops},
+    // per member, the neighbour byte of each cell is shared by all of them
+    {"ensemble", "batches sharing a geometry stepped together, members interleaved per cell", &yc12015::StepWorldEnsemble, &yc12015::StepWorldsEnsemble, 4+4, StencilFlops},
+    // through scratch files, the real entry point is step_world --out-of-core
+    {"out_of_core", "slabs of the world stepped from scratch files, blocked over steps", &yc12015::StepWorldOutOfCore, 0, 4+4+1, StencilFlops},
+    {"auto", "fastest engine for the world size and steps, by a cost model measured per host", &yc12015::StepWorldAuto, 0, 0, 0}
+  };
+  static const std::vector<engine_t> engines(table, table+sizeof(table)/sizeof(table[0]));
+  return engines;
+}
+
+void StepWorlds(const engine_t &engine, std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n)
+{
+  if(dts.size()!=1 && dts.size()!=worlds.size())
+    throw std::invalid_argument("StepWorlds: Need one dt, or one per world.");
+  if(worlds.empty())
+    return;
+  if(engine.stepBatch){
+    engine.stepBatch(worlds, dts.size()==1 ? std::vector<float>(worlds.size(), dts[0]) : dts, n);
+    return;
+  }
+  ParallelForRange(0, worlds.size(), [&](unsigned begin, unsigned end){
+    for(unsigned i=begin; i<end; i++){
+      engine.step(worlds[i], dts.size()==1 ? dts[0] : dts[i], n);
+    }
+  });
+}
+
+const engine_t &FindEngine(const std::string &name)
+{
+  const std::vector<engine_t> &engines=Engines();
+  std::string known;
+  for(unsigned i=0; i<engines.size(); i++){
+    if(name==engines[i].name)
+      return engines[i];
+    known += std::string(i ? ", " : "")+engines[i].name;
+  }
+  throw std::invalid_argument("FindEngine: Unknown engine '"+name+"', expected one of "+known+".");
+}
+
+}; // namespace hpce
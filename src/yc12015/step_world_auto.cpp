@@ -0,0 +1,305 @@
+#include "heat.hpp"
+#include "heat_engine.hpp"
+
+#include "cl_common.hpp"
+
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+namespace hpce{
+  namespace yc12015{
+
+//! Predicted cost of one call to an engine, fitted per host
+/*! time = setup + cells*perCell + cells*n*perCellStep */
+struct engine_cost_t{
+  std::string name;
+  bool available;      // false if the engine failed to run here
+  double setup;        // fixed seconds per call (context, program build)
+  double perCell;      // seconds per cell per call (allocation, transfers)
+  double perCellStep;  // seconds per cell per step
+
+  double predict(unsigned cells, unsigned n) const
+  {
+    if(!available)
+      return std::numeric_limits<double>::infinity();
+    return setup + cells*perCell + (double)cells*n*perCellStep;
+  }
+};
+
+//! Engines auto chooses between, from HPCE_AUTO_CANDIDATES if set
+/*! Only engines that match the reference up to rounding belong here, which
+    rules out v6. v3 always loses to v4, and v1/v2 are the reference loop. */
+std::vector<std::string> AutoCandidates()
+{
+  const char *v = getenv("HPCE_AUTO_CANDIDATES");
+  std::string list = v? v: "reference,v4_double_buffered,v5_packed_properties";
+  std::vector<std::string> names;
+  std::stringstream src(list);
+  std::string name;
+  while(std::getline(src, name, ',')){
+    if(name=="auto")
+      throw std::invalid_argument("AutoCandidates: auto can't be its own candidate.");
+    if(!name.empty())
+      names.push_back(name);
+  }
+  return names;
+}
+
+//! Where the fitted costs for this host (and OpenCL device choice) live
+std::string AutoCacheFile()
+{
+  const char *v = getenv("HPCE_AUTO_CACHE");
+  if(v && *v)
+    return v;
+
+  std::string host = "unknown";
+#ifdef _WIN32
+  const char *c = getenv("COMPUTERNAME");
+  if(c)
+    host = c;
+#else
+  char buffer[256] = {0};
+  if(gethostname(buffer, sizeof(buffer)-1)==0)
+    host = buffer;
+#endif
+  // the OpenCL engines cost very different amounts on each device
+  const char *p = getenv("HPCE_SELECT_PLATFORM");
+  const char *d = getenv("HPCE_SELECT_DEVICE");
+  std::string name = ".hpce_auto_"+host+"_p"+(p? p: "0")+"_d"+(d? d: "0");
+
+  const char *home = getenv("HOME");
+  return home? std::string(home)+"/"+name: name;
+}
+
+//! Reads whatever costs were cached, a missing file is just empty
+std::vector<engine_cost_t> LoadCosts(const std::string &fileName)
+{
+  std::vector<engine_cost_t> costs;
+  std::ifstream src(fileName.c_str());
+  std::string line;
+  while(std::getline(src, line)){
+    if(line.empty() || line[0]=='#')
+      continue;
+    std::stringstream fields(line);
+    engine_cost_t c;
+    std::string setup;
+    fields>>c.name>>setup;
+    if(setup=="unavailable"){
+      c.available=false;
+      c.setup=c.perCell=c.perCellStep=0;
+    }else{
+      c.available=true;
+      c.setup=strtod(setup.c_str(), NULL);
+      fields>>c.perCell>>c.perCellStep;
+      if(fields.fail())
+        continue; // damaged line, that engine just gets recalibrated
+    }
+    costs.push_back(c);
+  }
+  return costs;
+}
+
+//! Writes the cache atomically, so concurrent jobs never see half a file
+void SaveCosts(const std::string &fileName, const std::vector<engine_cost_t> &costs)
+{
+  std::stringstream text;
+  text.precision(9);
+  text<<"# engine setup_s per_cell_s per_cell_step_s\n";
+  for(unsigned i=0; i<costs.size(); i++){
+    if(costs[i].available){
+      text<<costs[i].name<<" "<<costs[i].setup<<" "<<costs[i].perCell<<" "<<costs[i].perCellStep<<"\n";
+    }else{
+      text<<costs[i].name<<" unavailable\n";
+    }
+  }
+  std::string data = text.str();
+
+#ifndef _WIN32
+  // every job measuring at once gets its own temporary file, and the
+  // last rename wins with a whole cache
+  std::string pattern = fileName+".tmp_XXXXXX";
+  std::vector<char> tmpName(pattern.begin(), pattern.end());
+  tmpName.push_back(0);
+  int fd = mkstemp(&tmpName[0]);
+  if(fd<0){
+    std::cerr<<"auto: Couldn't write cost cache '"<<pattern<<"' : "<<strerror(errno)<<std::endl;
+    return;
+  }
+  fchmod(fd, 0644);  // as the ofstream used to create it
+  size_t done = 0;
+  while(done<data.size()){
+    ssize_t put = write(fd, data.data()+done, data.size()-done);
+    if(put<0){
+      std::cerr<<"auto: Couldn't write cost cache '"<<&tmpName[0]<<"' : "<<strerror(errno)<<std::endl;
+      close(fd);
+      unlink(&tmpName[0]);
+      return;
+    }
+    done += put;
+  }
+  close(fd);
+  if(std::rename(&tmpName[0], fileName.c_str())){
+    std::cerr<<"auto: Couldn't replace cost cache '"<<fileName<<"'"<<std::endl;
+    unlink(&tmpName[0]);
+  }
+#else
+  // rename won't replace a file here, so there is a moment with no cache,
+  // which a concurrent job just treats as uncalibrated
+  std::string tmpName = fileName+".tmp";
+  {
+    std::ofstream dst(tmpName.c_str(), std::ios::binary);
+    dst<<data;
+    if(!dst.good()){
+      std::cerr<<"auto: Couldn't write cost cache '"<<tmpName<<"'"<<std::endl;
+      dst.close();
+      std::remove(tmpName.c_str());
+      return;
+    }
+  }
+  std::remove(fileName.c_str());
+  if(std::rename(tmpName.c_str(), fileName.c_str())){
+    std::cerr<<"auto: Couldn't replace cost cache '"<<fileName<<"'"<<std::endl;
+    std::remove(tmpName.c_str());
+  }
+#endif
+}
+
+//! Best of a few runs of one engine on a copy of the world
+double TimeEngine(const engine_t &engine, const world_t &world, unsigned n)
+{
+  double best = std::numeric_limits<double>::infinity();
+  for(unsigned rep=0; rep<3; rep++){
+    world_t copy(world);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    engine.step(copy, 0.1f, n);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    best = std::min(best, seconds);
+  }
+  return best;
+}
+
+//! Fits the three cost terms from runs at two sizes and two step counts
+engine_cost_t Calibrate(const engine_t &engine)
+{
+  const unsigned smallSize=16, largeSize=256, largeSteps=64;
+  world_t smallWorld = MakeTestWorld(smallSize, 0.1f);
+  world_t largeWorld = MakeTestWorld(largeSize, 0.1f);
+  double smallCells = smallSize*smallSize, largeCells = largeSize*largeSize;
+
+  engine_cost_t c;
+  c.name = engine.name;
+  try{
+    QuietSetup quiet;
+    world_t warm(smallWorld);
+    engine.step(warm, 0.1f, 1); // first call pays for loading drivers
+
+    double tSmall = TimeEngine(engine, smallWorld, 1);
+    double tLarge = TimeEngine(engine, largeWorld, 1);
+    double tLong = TimeEngine(engine, largeWorld, 1+largeSteps);
+
+    c.available = true;
+    c.perCellStep = std::max(0.0, (tLong-tLarge)/(largeCells*largeSteps));
+    c.perCell = std::max(0.0, (tLarge-tSmall)/(largeCells-smallCells) - c.perCellStep);
+    c.setup = std::max(0.0, tSmall - smallCells*(c.perCell+c.perCellStep));
+  }catch(const std::exception &e){
+    std::cerr<<"auto: "<<engine.name<<" is unavailable : "<<e.what()<<std::endl;
+    c.available = false;
+    c.setup = c.perCell = c.perCellStep = 0;
+  }
+  return c;
+}
+
+//! Cost model for each candidate, calibrating and caching any not yet known
+/*! HPCE_AUTO_RECALIBRATE=1 throws the cache away first. */
+std::vector<engine_cost_t> LoadOrCalibrateCosts()
+{
+  std::string cacheFile = AutoCacheFile();
+  std::vector<engine_cost_t> cached;
+  const char *r = getenv("HPCE_AUTO_RECALIBRATE");
+  if(!(r && atoi(r)))
+    cached = LoadCosts(cacheFile);
+
+  std::vector<std::string> names = AutoCandidates();
+  std::vector<engine_cost_t> costs;
+  bool changed = false;
+  for(unsigned i=0; i<names.size(); i++){
+    const engine_t &engine = FindEngine(names[i]);
+    unsigned j=0;
+    while(j<cached.size() && cached[j].name!=names[i])
+      j++;
+    if(j<cached.size()){
+      costs.push_back(cached[j]);
+    }else{
+      std::cerr<<"auto: Calibrating "<<engine.name<<std::endl;
+      costs.push_back(Calibrate(engine));
+      cached.push_back(costs.back());
+      changed = true;
+    }
+  }
+  if(changed)
+    SaveCosts(cacheFile, cached);
+  return costs;
+}
+
+//! The costs, worked out once per process
+/*! Worlds stepped in a batch call auto from several threads at once, so
+    the first one calibrates while the rest wait for its costs. */
+const std::vector<engine_cost_t> &CandidateCosts()
+{
+  static std::mutex mutex;
+  static bool known = false;
+  static std::vector<engine_cost_t> costs;
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!known){
+    costs = LoadOrCalibrateCosts();
+    known = true;
+  }
+  return costs;
+}
+
+//! Steps the world with whichever candidate engine the cost model predicts is fastest
+/*! \param dt Amount to step the world by.  Note that large steps will be unstable.
+	\param n Number of times to step the world
+	\note Overall time increment will be n*dt
+
+  The costs are measured the first time auto runs on a host and cached in
+  HPCE_AUTO_CACHE (default ~/.hpce_auto_<host>_p<platform>_d<device>).
+*/
+void StepWorldAuto(world_t &world, float dt, unsigned n)
+{
+  const std::vector<engine_cost_t> &costs = CandidateCosts();
+  unsigned cells = world.w*world.h;
+
+  unsigned best = 0;
+  for(unsigned i=1; i<costs.size(); i++){
+    if(costs[i].predict(cells, n) < costs[best].predict(cells, n))
+      best = i;
+  }
+  if(costs.empty() || !costs[best].available){
+    throw std::runtime_error("StepWorldAuto: None of the candidate engines can run on this host.");
+  }
+
+  std::cerr<<"auto: Picked "<<costs[best].name<<", predicted "<<costs[best].predict(cells, n)<<"s"<<std::endl;
+  FindEngine(costs[best].name).step(world, dt, n);
+}
+
+  }; // namespace yc12015
+}; // namespace hpce
@@ -0,0 +1,207 @@
+#include "heat.hpp"
+#include "heat_artefact_cache.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace hpce{
+  namespace yc12015{
+
+// Per cell, which neighbours conduct, or that the cell never changes
+enum neighbour_flags_t{
+  Neighbour_Above = 0x1,
+  Neighbour_Below = 0x2,
+  Neighbour_Left  = 0x4,
+  Neighbour_Right = 0x8,
+  Neighbour_Fixed = 0x10  // fixed or insulator, the cell keeps its value
+};
+
+//! The geometry all the members of an ensemble share, as one byte per cell
+void BuildNeighbours(const world_t &world, uint8_t *res)
+{
+  unsigned w=world.w, h=world.h;
+  const properties_vector_t &p=world.properties;
+  for(unsigned y=0; y<h; y++){
+    for(unsigned x=0; x<w; x++){
+      unsigned index=y*w + x;
+      if((p[index] & Cell_Fixed) || (p[index] & Cell_Insulator)){
+        res[index]=Neighbour_Fixed;
+        continue;
+      }
+      // only border cells could reach outside, and they are never stepped
+      uint8_t m=0;
+      if(!(p[index-w] & Cell_Insulator)) m|=Neighbour_Above;
+      if(!(p[index+w] & Cell_Insulator)) m|=Neighbour_Below;
+      if(!(p[index-1] & Cell_Insulator)) m|=Neighbour_Left;
+      if(!(p[index+1] & Cell_Insulator)) m|=Neighbour_Right;
+      res[index]=m;
+    }
+  }
+}
+
+//! Steps K members that share one geometry, with the state interleaved
+/*! \param state Cell-major and member-minor, so state[index*k+j] is cell
+        index of member j
+    \param outer,inner The coefficients of each member
+
+  The loop over members is the inner one, and is free of branches, so it
+  vectorises across members however small the world is, and each cell's
+  neighbour byte is read once for all of them. A neighbour that doesn't
+  conduct is weighted by zero, which adds exactly nothing, and contrib is
+  built up one outer at a time, so every member matches the reference bit
+  for bit.
+*/
+void StepEnsemble(unsigned w, unsigned h, unsigned k, const uint8_t *neighbours,
+    const std::vector<float> &inner, const std::vector<float> &outer,
+    state_vector_t &state, unsigned n)
+{
+  if((size_t)w*h==0)
+    return;
+
+  // contrib[c*k+j] is inner+outer+... for c conducting neighbours
+  std::vector<float> contrib(5*k);
+  for(unsigned j=0; j<k; j++){
+    contrib[j]=inner[j];
+    for(unsigned c=1; c<=4; c++){
+      contrib[c*k+j]=contrib[(c-1)*k+j]+outer[j];
+    }
+  }
+
+  state_vector_t buffer(state.size());
+  const float *src=state.data();
+  float *dst=buffer.data();
+
+  // the threads are started once, and swap buffers between steps
+  ParallelForSteps(0, h, n, [&](unsigned /*t*/, unsigned yBegin, unsigned yEnd){
+    for(unsigned y=yBegin; y<yEnd; y++){
+      for(unsigned x=0; x<w; x++){
+        unsigned index=y*w + x;
+        uint8_t m=neighbours[index];
+        const float *here=src+(size_t)index*k;
+        float *out=dst+(size_t)index*k;
+
+        if(m & Neighbour_Fixed){
+          std::copy(here, here+k, out);
+          continue;
+        }
+
+        const float *above=here-(size_t)w*k, *below=here+(size_t)w*k;
+        const float *left=here-k, *right=here+k;
+        float fa=(m & Neighbour_Above) ? 1.0f : 0.0f;
+        float fb=(m & Neighbour_Below) ? 1.0f : 0.0f;
+        float fl=(m & Neighbour_Left) ? 1.0f : 0.0f;
+        float fr=(m & Neighbour_Right) ? 1.0f : 0.0f;
+        unsigned count=(m&1)+((m>>1)&1)+((m>>2)&1)+((m>>3)&1);
+        const float *c=&contrib[count*k];
+
+        for(unsigned j=0; j<k; j++){
+          float acc=inner[j]*here[j];
+          acc += (fa*outer[j]) * above[j];
+          acc += (fb*outer[j]) * below[j];
+          acc += (fl*outer[j]) * left[j];
+          acc += (fr*outer[j]) * right[j];
+          float res=acc/c[j];
+          out[j]=std::min(1.0f, std::max(0.0f, res));
+        }
+      }
+    }
+  }, [&](unsigned /*t*/){
+    std::swap(state, buffer);
+    src=state.data();
+    dst=buffer.data();
+  }, 16);
+}
+
+//! Steps worlds sharing one geometry as a single interleaved ensemble
+void StepSharedGeometry(std::vector<world_t*> &members, const std::vector<float> &dts, unsigned n)
+{
+  const world_t &first=*members[0];
+  unsigned w=first.w, h=first.h, k=members.size();
+  if((size_t)w*h==0){
+    // nothing to step, but time still passes as it does for the reference
+    for(unsigned j=0; j<k; j++){
+      for(unsigned t=0; t<n; t++){
+        members[j]->t += dts[j];
+      }
+    }
+    return;
+  }
+  // the neighbour bytes depend on the geometry alone, so they are cached
+  // across runs rather than rebuilt every time
+  GeometryArtefact neighbours=GetGeometryArtefact(first, "ensemble_neighbours", 1, (size_t)w*h,
+    [&](uint8_t *dst){ BuildNeighbours(first, dst); });
+
+  std::vector<float> inner(k), outer(k);
+  state_vector_t state((size_t)w*h*k);
+  for(unsigned j=0; j<k; j++){
+    outer[j]=members[j]->alpha*dts[j];
+    inner[j]=1-outer[j]/4;
+    const state_vector_t &s=members[j]->state;
+    for(unsigned i=0; i<w*h; i++){
+      state[(size_t)i*k+j]=s[i];
+    }
+  }
+
+  StepEnsemble(w, h, k, neighbours.data(), inner, outer, state, n);
+
+  for(unsigned j=0; j<k; j++){
+    state_vector_t &s=members[j]->state;
+    for(unsigned i=0; i<w*h; i++){
+      s[i]=state[(size_t)i*k+j];
+    }
+    for(unsigned t=0; t<n; t++){
+      members[j]->t += dts[j];
+    }
+  }
+}
+
+bool SameGeometry(const world_t &a, const world_t &b)
+{
+  return a.w==b.w && a.h==b.h
+    && (a.properties.empty()
+      || !memcmp(a.properties.data(), b.properties.data(), a.properties.size()*sizeof(a.properties[0])));
+}
+
+//! Steps a batch as ensembles of the worlds that share a geometry
+/*! \param dts One dt per world
+
+  Members of an ensemble can differ in alpha, dt and initial state. A batch
+  with several geometries is split into one ensemble per geometry.
+*/
+void StepWorldsEnsemble(std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n)
+{
+  HPCE_TRACE_SPAN("ensemble:step");
+  if(dts.size()!=worlds.size())
+    throw std::invalid_argument("StepWorldsEnsemble: Need one dt per world.");
+
+  std::vector<bool> done(worlds.size(), false);
+  for(unsigned i=0; i<worlds.size(); i++){
+    if(done[i])
+      continue;
+    std::vector<world_t*> members;
+    std::vector<float> memberDts;
+    for(unsigned j=i; j<worlds.size(); j++){
+      if(!done[j] && SameGeometry(worlds[i], worlds[j])){
+        members.push_back(&worlds[j]);
+        memberDts.push_back(dts[j]);
+        done[j]=true;
+      }
+    }
+    StepSharedGeometry(members, memberDts, n);
+  }
+}
+
+//! A single world is an ensemble of one
+void StepWorldEnsemble(world_t &world, float dt, unsigned n)
+{
+  std::vector<world_t*> members(1, &world);
+  StepSharedGeometry(members, std::vector<float>(1, dt), n);
+}
+
+  }; // namespace yc12015
+}; // namespace hpce
@@ -0,0 +1,363 @@
+#include "heat.hpp"
+#include "heat_out_of_core.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <future>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace hpce{
+
+out_of_core_options_t out_of_core_options_t::FromEnvironment()
+{
+  out_of_core_options_t res;
+  const char *d = getenv("HPCE_OOC_DIR");
+  const char *t = getenv("TMPDIR");
+  res.scratchDir = (d && *d)? d: (t && *t)? t: "/tmp";
+  const char *m = getenv("HPCE_OOC_MEMORY_MB");
+  res.memoryBudget = (size_t)((m && atoi(m)>0)? atoi(m): 1024)<<20;
+  const char *k = getenv("HPCE_OOC_BLOCK_STEPS");
+  res.blockSteps = (k && atoi(k)>0)? atoi(k): 8;
+  return res;
+}
+
+  namespace yc12015{
+
+// One byte per cell on disk: which neighbours conduct, and the cell's own
+// flags so the properties can be written back out
+enum ooc_flags_t{
+  Ooc_Above     = 0x1,
+  Ooc_Below     = 0x2,
+  Ooc_Left      = 0x4,
+  Ooc_Right     = 0x8,
+  Ooc_Fixed     = 0x10,
+  Ooc_Insulator = 0x20
+};
+
+#ifndef _WIN32
+
+//! A scratch file that is deleted as soon as it is open, so it never outlives us
+class ScratchFile
+{
+public:
+  ScratchFile(const std::string &dir, const char *name)
+  {
+    std::string pattern = dir+"/hpce_ooc_"+name+"_XXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+    path.push_back(0);
+    m_fd = mkstemp(&path[0]);
+    if(m_fd<0)
+      throw std::runtime_error("ScratchFile: Couldn't create a file in '"+dir+"' : "+strerror(errno));
+    unlink(&path[0]);
+  }
+
+  ~ScratchFile()
+  { close(m_fd); }
+
+  //! Positional, so the prefetch and write-behind threads can share the file
+  void read(uint64_t offset, void *dst, size_t size) const
+  {
+    char *p = (char*)dst;
+    while(size){
+      ssize_t got = pread(m_fd, p, size, offset);
+      if(got<=0)
+        throw std::runtime_error(std::string("ScratchFile: Read failed : ")+(got<0? strerror(errno): "end of file"));
+      p += got; offset += got; size -= got;
+    }
+  }
+
+  void write(uint64_t offset, const void *src, size_t size) const
+  {
+    const char *p = (const char*)src;
+    while(size){
+      ssize_t put = pwrite(m_fd, p, size, offset);
+      if(put<0)
+        throw std::runtime_error(std::string("ScratchFile: Write failed : ")+strerror(errno));
+      p += put; offset += put; size -= put;
+    }
+  }
+private:
+  ScratchFile(const ScratchFile &); // = delete
+  ScratchFile &operator=(const ScratchFile &); // = delete
+
+  int m_fd;
+};
+
+#else
+
+class ScratchFile
+{
+public:
+  ScratchFile(const std::string &, const char *)
+  { throw std::runtime_error("ScratchFile: The out-of-core engine needs pread and pwrite."); }
+  void read(uint64_t, void *, size_t) const {}
+  void write(uint64_t, const void *, size_t) const {}
+};
+
+#endif
+
+//! Builds the on-disk byte of every cell in row y from it and its neighbours
+void EncodeRow(unsigned w, unsigned h, unsigned y, const cell_flags_t *above,
+    const cell_flags_t *here, const cell_flags_t *below, uint8_t *dst)
+{
+  for(unsigned x=0; x<w; x++){
+    uint8_t m = 0;
+    if(here[x] & Cell_Fixed) m |= Ooc_Fixed;
+    if(here[x] & Cell_Insulator) m |= Ooc_Insulator;
+    if(!m){
+      if(y==0 || y+1==h || x==0 || x+1==w)
+        throw std::invalid_argument("StepStreamOutOfCore: Cells on the edge of the world must be fixed or insulators.");
+      if(!(above[x] & Cell_Insulator)) m |= Ooc_Above;
+      if(!(below[x] & Cell_Insulator)) m |= Ooc_Below;
+      if(!(here[x-1] & Cell_Insulator)) m |= Ooc_Left;
+      if(!(here[x+1] & Cell_Insulator)) m |= Ooc_Right;
+    }
+    dst[x] = m;
+  }
+}
+
+//! One row of the reference stencil, in the same order of operations
+/*! \param contrib contrib[c] is inner plus c lots of outer, added one at a
+        time as StepWorld does, for c conducting neighbours */
+void StepRow(unsigned w, const uint8_t *mask, const float *above, const float *here,
+    const float *below, float *out, float inner, float outer, const float *contrib)
+{
+  for(unsigned x=0; x<w; x++){
+    uint8_t m = mask[x];
+    if(m & (Ooc_Fixed|Ooc_Insulator)){
+      out[x] = here[x];
+      continue;
+    }
+    float acc = inner*here[x];
+    unsigned count = 0;
+    if(m & Ooc_Above){ acc += outer*above[x]; count++; }
+    if(m & Ooc_Below){ acc += outer*below[x]; count++; }
+    if(m & Ooc_Left){ acc += outer*here[x-1]; count++; }
+    if(m & Ooc_Right){ acc += outer*here[x+1]; count++; }
+    float res = acc/contrib[count];
+    out[x] = std::min(1.0f, std::max(0.0f, res));
+  }
+}
+
+//! The rows of one slab and its halo, as read from disk
+struct slab_t{
+  unsigned first, last;   // output rows [first,last)
+  unsigned begin, end;    // rows held, with the halo [begin,end)
+  std::vector<uint8_t> mask;
+  state_vector_t state;
+};
+
+//! Steps a whole world k steps, one slab at a time, from one state file to the other
+void Pass(const ScratchFile &masks, const ScratchFile &src, const ScratchFile &dst,
+    unsigned w, unsigned h, unsigned slabRows, unsigned k,
+    float inner, float outer, const float *contrib)
+{
+  unsigned slabs = (h+slabRows-1)/slabRows;
+
+  auto load = [&](unsigned s, slab_t &slab){
+    HPCE_TRACE_SPAN("out_of_core:read");
+    slab.first = s*slabRows;
+    slab.last = std::min(h, slab.first+slabRows);
+    slab.begin = slab.first>k? slab.first-k: 0;
+    slab.end = std::min(h, slab.last+k);
+    size_t cells = (size_t)(slab.end-slab.begin)*w;
+    slab.mask.resize(cells);
+    slab.state.resize(cells);
+    masks.read((uint64_t)slab.begin*w, &slab.mask[0], cells);
+    src.read((uint64_t)slab.begin*w*4, &slab.state[0], cells*4);
+  };
+
+  slab_t slabBuffers[2];
+  state_vector_t work[2], outBuffers[2];
+  std::future<void> reading, writing;
+
+  load(0, slabBuffers[0]);
+  for(unsigned s=0; s<slabs; s++){
+    slab_t &slab = slabBuffers[s%2];
+    // read the next slab while this one is stepped
+    if(s+1<slabs){
+      reading = std::async(std::launch::async, load, s+1, std::ref(slabBuffers[(s+1)%2]));
+    }
+
+    {
+      HPCE_TRACE_SPAN("out_of_core:step");
+      unsigned rows = slab.end-slab.begin;
+      state_vector_t *cur = &slab.state, *next = &work[0];
+      work[0].resize(slab.state.size());
+      if(k>1)
+        work[1].resize(slab.state.size());
+      // rows [lo,hi) of cur are valid, and each step loses a row at any
+      // side that is halo rather than the edge of the world, so step t
+      // writes rows [nlo,nhi)
+      unsigned lo = 0, hi = rows;
+      auto shrink = [&](){
+        return std::make_pair((slab.begin+lo>0)? lo+1: lo, (slab.begin+hi<h)? hi-1: hi);
+      };
+      std::pair<unsigned,unsigned> valid = shrink();
+      const uint8_t *m = &slab.mask[0];
+      // the threads are started once for the k steps, each keeps its
+      // share of the slab's rows, clipped to the rows that step writes
+      ParallelForSteps(0, rows, k, [&](unsigned /*t*/, unsigned yBegin, unsigned yEnd){
+        const float *c = &(*cur)[0];
+        float *nx = &(*next)[0];
+        for(unsigned y=std::max(yBegin, valid.first); y<std::min(yEnd, valid.second); y++){
+          // the first and last rows of the world are all fixed or insulators
+          const float *above = y>0? c+(y-1)*w: c+y*w;
+          const float *below = y+1<rows? c+(y+1)*w: c+y*w;
+          StepRow(w, m+y*w, above, c+y*w, below, nx+y*w, inner, outer, contrib);
+        }
+      }, [&](unsigned t){
+        lo = valid.first;
+        hi = valid.second;
+        valid = shrink();
+        if(t==0){
+          next = &work[1];
+          cur = &work[0];
+        }else{
+          std::swap(cur, next);
+        }
+      }, 16);
+
+      // hand the finished rows to the writer, once it is done with the buffer
+      if(writing.valid())
+        writing.get();
+      state_vector_t &out = outBuffers[s%2];
+      unsigned offset = slab.first-slab.begin;
+      out.assign(cur->begin()+(size_t)offset*w, cur->begin()+(size_t)(offset+slab.last-slab.first)*w);
+      unsigned first = slab.first;
+      writing = std::async(std::launch::async, [&dst, &out, first, w](){
+        HPCE_TRACE_SPAN("out_of_core:write");
+        dst.write((uint64_t)first*w*4, &out[0], out.size()*4);
+      });
+    }
+
+    if(reading.valid())
+      reading.get();
+  }
+  if(writing.valid())
+    writing.get();
+}
+
+  }; // namespace yc12015
+
+void StepStreamOutOfCore(std::istream &src, std::ostream &dst, float dt, unsigned n, bool binary, const out_of_core_options_t &options)
+{
+  using namespace yc12015;
+  HPCE_TRACE_PHASE(phase, "out_of_core:import");
+
+  WorldReader reader(src);
+  unsigned w = reader.width(), h = reader.height();
+  float alpha = reader.alpha();
+
+  ScratchFile masks(options.scratchDir, "masks");
+  ScratchFile stateA(options.scratchDir, "state_a"), stateB(options.scratchDir, "state_b");
+  const ScratchFile *states[2] = {&stateA, &stateB};
+
+  {
+    // the byte of row y needs row y+1, so three rows of properties are kept
+    std::vector<properties_vector_t> rows(3, properties_vector_t(w, (cell_flags_t)0));
+    std::vector<uint8_t> encoded(w);
+    for(unsigned y=0; y<=h; y++){
+      if(y<h)
+        reader.readPropertiesRow(&rows[y%3][0]);
+      if(y>0){
+        unsigned r = y-1;
+        const cell_flags_t *above = &rows[(r+2)%3][0];
+        const cell_flags_t *below = &rows[(r+1)%3][0];
+        EncodeRow(w, h, r, above, &rows[r%3][0], below, &encoded[0]);
+        masks.write((uint64_t)r*w, &encoded[0], w);
+      }
+    }
+    state_vector_t row(w);
+    for(unsigned y=0; y<h; y++){
+      reader.readStateRow(&row[0]);
+      states[0]->write((uint64_t)y*w*4, &row[0], (size_t)w*4);
+    }
+    reader.finish();
+  }
+  HPCE_TRACE_NEXT(phase, "out_of_core:passes");
+
+  float outer = alpha*dt;   // We spread alpha to other cells per time
+  float inner = 1-outer/4;  // Anything that doesn't spread stays
+  float contrib[5];
+  contrib[0] = inner;
+  for(unsigned c=1; c<5; c++){
+    contrib[c] = contrib[c-1]+outer;
+  }
+
+  // Per cell of a slab: two slabs read (state and byte), two stepped
+  // copies, and two written
+  unsigned k = std::max(1u, std::min(options.blockSteps, std::max(1u, n)));
+  size_t perRow = (size_t)w*(2*5+2*4+2*4);
+  size_t budgetRows = options.memoryBudget/std::max<size_t>(1, perRow);
+  unsigned slabRows = budgetRows>2*k? (unsigned)std::min<size_t>(h, budgetRows-2*k): 1;
+  if(budgetRows<=2*k){
+    std::cerr<<"StepStreamOutOfCore: Memory budget is too small for "<<k<<" steps of halo, going over it"<<std::endl;
+  }
+  std::cerr<<"StepStreamOutOfCore: "<<slabRows<<" rows per slab, "<<k<<" steps per pass"<<std::endl;
+
+  unsigned current = 0;
+  for(unsigned done=0; done<n; ){
+    unsigned steps = std::min(k, n-done);
+    Pass(masks, *states[current], *states[1-current], w, h, slabRows, steps, inner, outer, contrib);
+    current = 1-current;
+    done += steps;
+  }
+  HPCE_TRACE_NEXT(phase, "out_of_core:export");
+
+  WorldWriter writer(dst, w, h, alpha, binary);
+  {
+    std::vector<uint8_t> encoded(w);
+    properties_vector_t row(w);
+    for(unsigned y=0; y<h; y++){
+      masks.read((uint64_t)y*w, &encoded[0], w);
+      for(unsigned x=0; x<w; x++){
+        unsigned flags = ((encoded[x] & Ooc_Fixed)? (unsigned)Cell_Fixed: 0u) | ((encoded[x] & Ooc_Insulator)? (unsigned)Cell_Insulator: 0u);
+        row[x] = (cell_flags_t)flags;
+      }
+      writer.writePropertiesRow(&row[0]);
+    }
+  }
+  {
+    state_vector_t row(w);
+    for(unsigned y=0; y<h; y++){
+      states[current]->read((uint64_t)y*w*4, &row[0], (size_t)w*4);
+      writer.writeStateRow(&row[0]);
+    }
+  }
+  writer.finish();
+}
+
+  namespace yc12015{
+
+//! The out-of-core engine on a world that is already in memory
+/*! The world goes through the scratch files like any other, which is only
+    useful to check the engine against the others with the usual gates.
+*/
+void StepWorldOutOfCore(world_t &world, float dt, unsigned n)
+{
+  std::stringstream src, dst;
+  SaveWorld(src, world, true);
+  StepStreamOutOfCore(src, dst, dt, n, true, out_of_core_options_t::FromEnvironment());
+  world_t res = LoadWorld(dst);
+  world.state.swap(res.state);
+  for(unsigned t=0; t<n; t++){
+    world.t += dt;
+  }
+}
+
+  }; // namespace yc12015
+}; // namespace hpce
@@ -1,4 +1,5 @@
 #include "heat.hpp"
+#include "heat_trace.hpp"
 
 #include <stdexcept>
 #include <cmath>
@@ -65,13 +66,14 @@ void kernel_xy(uint32_t x, uint32_t y, uint32_t w,
 */
 void StepWorldV2Function(world_t &world, float dt, unsigned n)
 {
+  HPCE_TRACE_SPAN("v2_function:step");
 	unsigned w=world.w, h=world.h;
 	
 	float outer=world.alpha*dt;		// We spread alpha to other cells per time
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	state_vector_t buffer(w*h);
 
 	
 	for(unsigned t=0;t<n;t++){
@@ -97,36 +99,3 @@ void StepWorldV2Function(world_t &world, float dt, unsigned n)
 
 }; // namespace yc12015
 }; // namepspace hpce
-
-int main(int argc, char *argv[])
-{
-	float dt=0.1;
-	unsigned n=1;
-	bool binary=false;
-	
-	if(argc>1){
-		dt=(float)strtod(argv[1], NULL);
-	}
-	if(argc>2){
-		n=atoi(argv[2]);
-	}
-	if(argc>3){
-		if(atoi(argv[3]))
-			binary=true;
-	}
-	
-	try{
-		hpce::world_t world=hpce::LoadWorld(std::cin);
-		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
-		
-		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<std::endl;
-		hpce::yc12015::StepWorldV2Function(world, dt, n);
-		
-		hpce::SaveWorld(std::cout, world, binary);
-	}catch(const std::exception &e){
-		std::cerr<<"Exception : "<<e.what()<<std::endl;
-		return 1;
-	}
-		
-	return 0;
-}
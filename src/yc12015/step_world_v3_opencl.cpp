@@ -1,4 +1,5 @@
 #include "heat.hpp"
+#include "heat_trace.hpp"
 
 #include <stdexcept>
 #include <cmath>
@@ -14,26 +15,11 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include "CL/cl.hpp"
 
+#include "cl_common.hpp"
+
 namespace hpce{
   namespace yc12015{
 
-std::string LoadSource(const char *fileName){
-  const char *v = getenv("HPCE_CL_SRC_DIR");
-  std::string baseDir = v? v: "src/yc12015";
-
-  std::string fullName = baseDir+"/"+fileName;
-
-  std::ifstream src(fullName, std::ios::in | std::ios::binary);
-  if(!src.is_open()){
-    throw std::runtime_error("LoadSource: Couldn't load cl file from '"+
-        fullName+"'.\n");
-  }
-  return std::string(
-      (std::istreambuf_iterator<char>(src)), // extra brackets?
-      std::istreambuf_iterator<char>()
-      );
-}
-
 //! Reference world stepping program
 /*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 	\param n Number of times to step the world
@@ -41,72 +27,16 @@ std::string LoadSource(const char *fileName){
 */
 void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 {
+  HPCE_TRACE_PHASE(phase, "v3_opencl:setup");
 
-  // show platforms
-  std::vector<cl::Platform> platforms;
-  cl::Platform::get(&platforms);
-  std::vector<cl::Platform>::size_type no_platforms = platforms.size();
-  if(no_platforms == 0){
-    throw std::runtime_error("No OpenCL plaforms found.\n");
-  }
-  else{
-    std::cerr<<"Found "<<no_platforms<<" platforms"<<std::endl;
-  }
-  for(unsigned i=0; i<no_platforms; i++){
-    std::string vendor = platforms[i].getInfo<CL_PLATFORM_VENDOR>();
-    std::cerr<<"\tPlatform "<<i<<" : "<<vendor<<std::endl;
-  }
-  // get from env
-  const char *v = getenv("HPCE_SELECT_PLATFORM");
-  // default platform is 0
-  int selectedPlatform = v? atoi(v): 0;
-  std::cerr<<"Choosing platform "<<selectedPlatform<<std::endl;
-  cl::Platform platform = platforms.at(selectedPlatform);
-
-  // show devices
   std::vector<cl::Device> devices;
-  platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-  std::vector<cl::Device>::size_type no_devices = devices.size();
-  if(no_devices == 0){
-    throw std::runtime_error("No OpenCL devices found.\n");
-  }
-  else{
-    std::cerr<<"Found "<<no_devices<<" devies"<<std::endl;
-  }
-  // show devices
-  for(unsigned i=0; i<no_devices; i++){
-    std::string deviceName = devices[i].getInfo<CL_DEVICE_NAME>();
-    std::cerr<<"\tDevice "<<i<<" : "<<deviceName<<std::endl;
-  }
-  // get from env
-  const char *u = getenv("HPCE_SELECT_DEVICE");
-  // default platform is 0
-  int selectedDevice = u? atoi(u): 0;
-  std::cerr<<"Choosing device "<<selectedDevice<<std::endl;
-  cl::Device device = devices.at(selectedDevice);
+  cl::Device device = SelectDevice(devices);
 
   // create context
   cl::Context context(devices);
   //--------------------
   // build cl program
-  std::string kernelSource = LoadSource("step_world_v3_kernel.cl");
-  cl::Program::Sources sources;
-  sources.push_back(std::make_pair(
-        kernelSource.c_str(),
-        kernelSource.size()+1
-        )
-      );
-
-  cl::Program program(context, sources);
-  try{
-    program.build(devices);
-  }catch(...){
-    for(unsigned i=0; i<no_devices; i++){
-      std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
-      std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
-    }
-    throw;
-  }
+  cl::Program program = BuildProgram(context, devices, "step_world_v3_kernel.cl");
 
   // ----------------
   // allocate buffers
@@ -122,7 +52,7 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	state_vector_t buffer(w*h);
 
   // ---------------
   // setting kernel parameters
@@ -138,6 +68,7 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
   cl::CommandQueue queue(context, device);
 
   // -------------------
+  HPCE_TRACE_NEXT(phase, "v3_opencl:upload");
   // copy over fixed data
   queue.enqueueWriteBuffer(
       buffProperties,
@@ -145,6 +76,8 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
       &world.properties[0]
       );
 	
+  // each step copies the state both ways, so readback is part of it
+  HPCE_TRACE_NEXT(phase, "v3_opencl:step");
 	for(unsigned t=0;t<n;t++){
     // copy mem buffers
     cl::Event evCopiedState;
@@ -197,36 +130,3 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 
 }; // namespace yc12015
 }; // namepspace hpce
-
-int main(int argc, char *argv[])
-{
-	float dt=0.1;
-	unsigned n=1;
-	bool binary=false;
-	
-	if(argc>1){
-		dt=(float)strtod(argv[1], NULL);
-	}
-	if(argc>2){
-		n=atoi(argv[2]);
-	}
-	if(argc>3){
-		if(atoi(argv[3]))
-			binary=true;
-	}
-	
-	try{
-		hpce::world_t world=hpce::LoadWorld(std::cin);
-		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
-		
-		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<std::endl;
-		hpce::yc12015::StepWorldV3OpenCL(world, dt, n);
-		
-		hpce::SaveWorld(std::cout, world, binary);
-	}catch(const std::exception &e){
-		std::cerr<<"Exception : "<<e.what()<<std::endl;
-		return 1;
-	}
-		
-	return 0;
-}
@@ -0,0 +1,74 @@
+enum cell_flags_t{
+  Cell_Fixed    = 0x1,
+  Cell_Insulator= 0x2
+};
+
+// Steps a batch of worlds packed one after another into the same buffers.
+// Dimension 1 picks the world and dimension 0 the cell within it, so the
+// NDRange is as wide as the largest world and smaller worlds leave the
+// tail of their row idle. Every world's border is fixed or insulating, as
+// for the reference, so the neighbours never reach into another world.
+__kernel void kernel_batch(
+    __global const uint *offsets,   // first cell of each world, plus the end
+    __global const uint *widths,
+    __global const float *coeffs,   // inner and outer of each world
+    __global const uint *props,
+    __global const float *states,
+    __global float *buffer
+    ){
+
+  uint i = get_global_id(0);
+  uint k = get_global_id(1);
+
+  uint begin = offsets[k];
+  if(i >= offsets[k+1]-begin){
+    return;
+  }
+  uint w = widths[k];
+  float inner = coeffs[2*k];
+  float outer = coeffs[2*k+1];
+
+  unsigned index=begin + i;
+
+  if((props[index] & Cell_Fixed) || (props[index] & Cell_Insulator)){
+    // Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
+    buffer[index]=states[index];
+  }else{
+    float contrib=inner;
+    float acc=inner*states[index];
+
+    // Cell above
+    if(! (props[index-w] & Cell_Insulator)) {
+      contrib += outer;
+      acc += outer * states[index-w];
+    }
+
+    // Cell below
+    if(! (props[index+w] & Cell_Insulator)) {
+      contrib += outer;
+      acc += outer * states[index+w];
+    }
+
+    // Cell left
+    if(! (props[index-1] & Cell_Insulator)) {
+      contrib += outer;
+      acc += outer * states[index-1];
+    }
+
+    // Cell right
+    if(! (props[index+1] & Cell_Insulator)) {
+      contrib += outer;
+      acc += outer * states[index+1];
+    }
+
+    // Scale the accumulate value by the number of places contributing to it
+    float res=acc/contrib;
+    // Then clamp to the range [0,1]
+    res=min(1.0f, max(0.0f, res));
+    buffer[index] = res;
+
+  } // end of if(insulator){ ... } else {
+
+}
+
+// vim: ft=c:
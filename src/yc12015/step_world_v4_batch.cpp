@@ -0,0 +1,159 @@
+#include "heat.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#include "cl_common.hpp"
+#include "cl_profiler.hpp"
+
+namespace hpce{
+  namespace yc12015{
+
+//! Steps a batch of worlds with one context, one program and one NDRange per step
+/*! \param dts One dt per world
+	\param n Number of times to step every world
+
+  The worlds are packed end to end into one properties and one state
+  buffer, with a table of where each starts, its width and its inner and
+  outer coefficients. Like v4 the state stays on the device and
+  ping-pongs, so a batch of small worlds pays the setup and the launch
+  cost of one world.
+*/
+void StepWorldsV4DoubleBuffered(std::vector<world_t> &worlds, const std::vector<float> &dts, unsigned n)
+{
+  HPCE_TRACE_PHASE(phase, "v4_batch:setup");
+  if(dts.size()!=worlds.size())
+    throw std::invalid_argument("StepWorldsV4DoubleBuffered: Need one dt per world.");
+  unsigned k = worlds.size();
+  if(k==0)
+    return;
+
+  ClProfiler profiler("v4_batch");
+  profiler.attribute("worlds", k);
+  profiler.attribute("n", n);
+
+  // ----------------
+  // pack the batch
+  std::vector<cl_uint> offsets(k+1), widths(k);
+  std::vector<float> coeffs(2*k);
+  unsigned maxCells = 0;
+  offsets[0] = 0;
+  for(unsigned i=0; i<k; i++){
+    unsigned cells = worlds[i].w*worlds[i].h;
+    if((uint64_t)offsets[i]+cells > UINT32_MAX/4)
+      throw std::invalid_argument("StepWorldsV4DoubleBuffered: Batch is too big for one buffer.");
+    offsets[i+1] = offsets[i]+cells;
+    widths[i] = worlds[i].w;
+    float outer = worlds[i].alpha*dts[i];
+    coeffs[2*i] = 1-outer/4;
+    coeffs[2*i+1] = outer;
+    maxCells = std::max(maxCells, cells);
+  }
+  unsigned total = offsets[k];
+  properties_vector_t properties(total);
+  state_vector_t state(total);
+  for(unsigned i=0; i<k; i++){
+    std::copy(worlds[i].properties.begin(), worlds[i].properties.end(), properties.begin()+offsets[i]);
+    std::copy(worlds[i].state.begin(), worlds[i].state.end(), state.begin()+offsets[i]);
+  }
+  profiler.attribute("cells", total);
+  profiler.lap("pack");
+
+  std::vector<cl::Device> devices;
+  cl::Device device = SelectDevice(devices);
+  profiler.lap("select_device");
+
+  cl::Context context(devices);
+  profiler.lap("create_context");
+
+  cl::Program program = BuildProgram(context, devices, "step_world_v4_batch.cl");
+  profiler.lap("build_program");
+
+  // ----------------
+  // allocate buffers
+  size_t cbBuffer = 4*(size_t)total;
+  cl::Buffer buffOffsets(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 4*(k+1), &offsets[0]);
+  cl::Buffer buffWidths(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 4*k, &widths[0]);
+  cl::Buffer buffCoeffs(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 4*2*k, &coeffs[0]);
+  cl::Buffer buffProperties(context, CL_MEM_READ_ONLY, cbBuffer);
+  cl::Buffer buffState(context, CL_MEM_READ_WRITE, cbBuffer);
+  cl::Buffer buffBuffer(context, CL_MEM_READ_WRITE, cbBuffer);
+
+  // ping steps state into buffer and pong steps it back, as in v4
+  cl::Kernel kernelPing(program, "kernel_batch");
+  cl::Kernel kernelPong(program, "kernel_batch");
+  cl::Kernel *kernels[2] = {&kernelPing, &kernelPong};
+  for(unsigned j=0; j<2; j++){
+    kernels[j]->setArg(0, buffOffsets);
+    kernels[j]->setArg(1, buffWidths);
+    kernels[j]->setArg(2, buffCoeffs);
+    kernels[j]->setArg(3, buffProperties);
+    kernels[j]->setArg(4, j==0 ? buffState : buffBuffer);
+    kernels[j]->setArg(5, j==0 ? buffBuffer : buffState);
+  }
+
+  cl::CommandQueue queue(context, device, profiler.queueProperties());
+  profiler.lap("create_queue");
+  HPCE_TRACE_NEXT(phase, "v4_batch:upload");
+
+  cl::Event evCopiedProperties, evCopiedState;
+  queue.enqueueWriteBuffer(buffProperties, CL_FALSE, 0, cbBuffer, &properties[0], NULL, &evCopiedProperties);
+  profiler.record("upload", "properties", evCopiedProperties);
+  queue.enqueueWriteBuffer(buffState, CL_FALSE, 0, cbBuffer, &state[0], NULL, &evCopiedState);
+  profiler.record("upload", "state", evCopiedState);
+  profiler.lap("upload");
+  HPCE_TRACE_NEXT(phase, "v4_batch:step");
+
+  // the in order queue serialises the steps, see v4 for the flush interval
+  const char *f = getenv("HPCE_CL_FLUSH_INTERVAL");
+  unsigned flushInterval = f? atoi(f): 64;
+
+  cl::NDRange globalSize(maxCells, k);
+  cl::Event evExecutedKernel;
+  for(unsigned t=0; t<n; t++){
+    queue.enqueueNDRangeKernel(
+        *kernels[t%2],
+        cl::NullRange,
+        globalSize,
+        cl::NullRange,
+        NULL,
+        profiler.enabled() ? &evExecutedKernel : NULL
+        );
+    if(profiler.enabled()){
+      profiler.record("step", "kernel_batch", evExecutedKernel);
+    }
+    if(flushInterval && (t+1)%flushInterval==0){
+      queue.flush();
+    }
+  }
+  double submitted = profiler.lap("submit");
+  profiler.attribute("submit_us_per_step", n ? 1e6*submitted/n : 0);
+  HPCE_TRACE_NEXT(phase, "v4_batch:readback");
+
+  cl::Event evCopiedBack;
+  queue.enqueueReadBuffer((n%2==0) ? buffState : buffBuffer, CL_TRUE, 0, cbBuffer, &state[0], NULL, &evCopiedBack);
+  profiler.record("readback", "state", evCopiedBack);
+  profiler.lap("readback");
+
+  for(unsigned i=0; i<k; i++){
+    std::copy(state.begin()+offsets[i], state.begin()+offsets[i+1], worlds[i].state.begin());
+    for(unsigned t=0; t<n; t++){
+      worlds[i].t += dts[i]; // added step by step, to round like the other engines
+    }
+  }
+  profiler.lap("unpack");
+
+  profiler.report();
+}
+
+}; // namespace yc12015
+}; // namepspace hpce
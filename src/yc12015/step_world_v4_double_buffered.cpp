@@ -1,4 +1,5 @@
 #include "heat.hpp"
+#include "heat_trace.hpp"
 
 #include <stdexcept>
 #include <cmath>
@@ -14,26 +15,13 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include "CL/cl.hpp"
 
+#include "cl_common.hpp"
+#include "cl_profiler.hpp"
+#include "cl_host_buffers.hpp"
+
 namespace hpce{
   namespace yc12015{
 
-std::string LoadSource(const char *fileName){
-  const char *v = getenv("HPCE_CL_SRC_DIR");
-  std::string baseDir = v? v: "src/yc12015";
-
-  std::string fullName = baseDir+"/"+fileName;
-
-  std::ifstream src(fullName, std::ios::in | std::ios::binary);
-  if(!src.is_open()){
-    throw std::runtime_error("LoadSource: Couldn't load cl file from '"+
-        fullName+"'.\n");
-  }
-  return std::string(
-      (std::istreambuf_iterator<char>(src)), // extra brackets?
-      std::istreambuf_iterator<char>()
-      );
-}
-
 //! Reference world stepping program
 /*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 	\param n Number of times to step the world
@@ -41,79 +29,46 @@ std::string LoadSource(const char *fileName){
 */
 void StepWorldV4DoubleBuffered(world_t &world, float dt, unsigned n)
 {
+  HPCE_TRACE_PHASE(phase, "v4_double_buffered:setup");
+  ClProfiler profiler("v4_double_buffered");
+  profiler.attribute("w", world.w);
+  profiler.attribute("h", world.h);
+  profiler.attribute("n", n);
 
-  // show platforms
-  std::vector<cl::Platform> platforms;
-  cl::Platform::get(&platforms);
-  std::vector<cl::Platform>::size_type no_platforms = platforms.size();
-  if(no_platforms == 0){
-    throw std::runtime_error("No OpenCL plaforms found.\n");
-  }
-  else{
-    std::cerr<<"Found "<<no_platforms<<" platforms"<<std::endl;
-  }
-  for(unsigned i=0; i<no_platforms; i++){
-    std::string vendor = platforms[i].getInfo<CL_PLATFORM_VENDOR>();
-    std::cerr<<"\tPlatform "<<i<<" : "<<vendor<<std::endl;
-  }
-  // get from env
-  const char *v = getenv("HPCE_SELECT_PLATFORM");
-  // default platform is 0
-  int selectedPlatform = v? atoi(v): 0;
-  std::cerr<<"Choosing platform "<<selectedPlatform<<std::endl;
-  cl::Platform platform = platforms.at(selectedPlatform);
-
-  // show devices
   std::vector<cl::Device> devices;
-  platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-  std::vector<cl::Device>::size_type no_devices = devices.size();
-  if(no_devices == 0){
-    throw std::runtime_error("No OpenCL devices found.\n");
-  }
-  else{
-    std::cerr<<"Found "<<no_devices<<" devies"<<std::endl;
-  }
-  // show devices
-  for(unsigned i=0; i<no_devices; i++){
-    std::string deviceName = devices[i].getInfo<CL_DEVICE_NAME>();
-    std::cerr<<"\tDevice "<<i<<" : "<<deviceName<<std::endl;
-  }
-  // get from env
-  const char *u = getenv("HPCE_SELECT_DEVICE");
-  // default platform is 0
-  int selectedDevice = u? atoi(u): 0;
-  std::cerr<<"Choosing device "<<selectedDevice<<std::endl;
-  cl::Device device = devices.at(selectedDevice);
+  cl::Device device = SelectDevice(devices);
+  profiler.lap("select_device");
 
   // create context
   cl::Context context(devices);
+  profiler.lap("create_context");
   //--------------------
   // build cl program
-  std::string kernelSource = LoadSource("step_world_v3_kernel.cl");
-  cl::Program::Sources sources;
-  sources.push_back(std::make_pair(
-        kernelSource.c_str(),
-        kernelSource.size()+1
-        )
-      );
-
-  cl::Program program(context, sources);
-  try{
-    program.build(devices);
-  }catch(...){
-    for(unsigned i=0; i<no_devices; i++){
-      std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
-      std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
-    }
-    throw;
-  }
+  cl::Program program = BuildProgram(context, devices, "step_world_v3_kernel.cl");
+  profiler.lap("build_program");
 
   // ----------------
   // allocate buffers
+  // with zero copy the buffers are created over the host arrays, so
+  // there is nothing to upload and reading back is a map not a copy
   size_t cbBuffer = 4*world.w*world.h;
-  cl::Buffer buffProperties(context, CL_MEM_READ_ONLY, cbBuffer);
-  cl::Buffer buffState(context, CL_MEM_READ_WRITE, cbBuffer);
-  cl::Buffer buffBuffer(context, CL_MEM_READ_WRITE, cbBuffer);
+  state_vector_t scratch;
+  bool zeroCopy = UseZeroCopy(device);
+  if(zeroCopy){
+    zeroCopy = IsSuitableHostPtr(device, world.properties.data())
+      && IsSuitableHostPtr(device, world.state.data());
+  }
+  // scratch only backs a buffer with zero copy, otherwise it stays empty
+  if(zeroCopy){
+    scratch.resize(world.w*world.h);
+    if(!IsSuitableHostPtr(device, scratch.data())){
+      zeroCopy = false;
+      state_vector_t().swap(scratch);
+    }
+  }
+  cl::Buffer buffProperties = MakeHostBuffer(context, CL_MEM_READ_ONLY, cbBuffer, world.properties.data(), zeroCopy);
+  cl::Buffer buffState = MakeHostBuffer(context, CL_MEM_READ_WRITE, cbBuffer, world.state.data(), zeroCopy);
+  cl::Buffer buffBuffer = MakeHostBuffer(context, CL_MEM_READ_WRITE, cbBuffer, scratch.data(), zeroCopy);
 
 
 	unsigned w=world.w, h=world.h;
@@ -128,113 +83,143 @@ void StepWorldV4DoubleBuffered(world_t &world, float dt, unsigned n)
 
   // ---------------
   // setting kernel parameters
-  cl::Kernel kernel(program, "kernel_xy");
-  kernel.setArg(0, inner);
-  kernel.setArg(1, outer);
-  kernel.setArg(2, buffProperties);
+  // Two kernels with their arguments bound once: ping steps state into
+  // buffer and pong steps it back, so the loop never needs setArg
+  cl::Kernel kernelPing(program, "kernel_xy");
+  kernelPing.setArg(0, inner);
+  kernelPing.setArg(1, outer);
+  kernelPing.setArg(2, buffProperties);
+  kernelPing.setArg(3, buffState);
+  kernelPing.setArg(4, buffBuffer);
+
+  cl::Kernel kernelPong(program, "kernel_xy");
+  kernelPong.setArg(0, inner);
+  kernelPong.setArg(1, outer);
+  kernelPong.setArg(2, buffProperties);
+  kernelPong.setArg(3, buffBuffer);
+  kernelPong.setArg(4, buffState);
 
   // ---------------
   // create command queue
-  cl::CommandQueue queue(context, device);
-
-  // -------------------
-  // copy over fixed data
-  queue.enqueueWriteBuffer(
-      buffProperties,
-      CL_TRUE, 0, cbBuffer,
-      &world.properties[0]
-      );
-
-  // copy mem buffers
-  cl::Event evCopiedState;
-  queue.enqueueWriteBuffer(
-      buffState,
-      CL_FALSE,
-      0,
-      cbBuffer,
-      &world.state[0],
-      NULL,
-      &evCopiedState
-      );
+  // out of order queues are opt-in, as we then have to chain every
+  // step to the previous one with events
+  const char *ooo = getenv("HPCE_CL_OUT_OF_ORDER");
+  bool outOfOrder = ooo && atoi(ooo);
+  if(outOfOrder && !(device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)){
+    if(!SetupIsQuiet())
+      std::cerr<<"Device doesn't support out of order queues, using in order"<<std::endl;
+    outOfOrder = false;
+  }
+  cl_command_queue_properties queueProperties = profiler.queueProperties();
+  if(outOfOrder){
+    queueProperties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+  }
+  cl::CommandQueue queue(context, device, queueProperties);
+  profiler.lap("create_queue");
+  HPCE_TRACE_NEXT(phase, "v4_double_buffered:upload");
+
+  // number of steps to enqueue before flushing them to the device,
+  // 0 means only the final read flushes
+  const char *f = getenv("HPCE_CL_FLUSH_INTERVAL");
+  unsigned flushInterval = f? atoi(f): 64;
+
+  // events the first step has to wait for
+  std::vector<cl::Event> chain;
+
+  if(!zeroCopy){
+    // -------------------
+    // copy over fixed data
+    cl::Event evCopiedProperties;
+    queue.enqueueWriteBuffer(
+        buffProperties,
+        CL_TRUE, 0, cbBuffer,
+        &world.properties[0],
+        NULL,
+        &evCopiedProperties
+        );
+    profiler.record("upload", "properties", evCopiedProperties);
+
+    // copy mem buffers
+    cl::Event evCopiedState;
+    queue.enqueueWriteBuffer(
+        buffState,
+        CL_FALSE,
+        0,
+        cbBuffer,
+        &world.state[0],
+        NULL,
+        &evCopiedState
+        );
+    profiler.record("upload", "state", evCopiedState);
+    chain.push_back(evCopiedState);
+  }
+  profiler.lap("upload");
+  // kernels run asynchronously, so this is the time to submit them and
+  // waiting for them falls into readback
+  HPCE_TRACE_NEXT(phase, "v4_double_buffered:step");
+
   // define kernel exe params
   cl::NDRange offset(0, 0);
   cl::NDRange globalSize(w, h);
   cl::NDRange localSize = cl::NullRange;
 
-  // kernel no longer depends on buffState as it is changing every loop
-  std::vector<cl::Event> kernelDependencies;
+  // an in order queue already serialises the steps, so events are only
+  // needed to chain an out of order queue, or for the profiler
+  bool needEvents = outOfOrder || profiler.enabled();
   cl::Event evExecutedKernel;
 
-  // set barrier
-  queue.enqueueBarrierWithWaitList();
-
 	for(unsigned t=0;t<n;t++){
-    // set args for every loop
-    kernel.setArg(3, buffState);
-    kernel.setArg(4, buffBuffer);
     queue.enqueueNDRangeKernel(
-        kernel,
+        (t%2==0) ? kernelPing : kernelPong,
         offset,
         globalSize,
         localSize,
-        &kernelDependencies,
-        &evExecutedKernel
+        outOfOrder ? &chain : NULL,
+        needEvents ? &evExecutedKernel : NULL
         );
+    if(needEvents){
+      profiler.record("step", "kernel_xy", evExecutedKernel);
+      chain.assign(1, evExecutedKernel);
+    }
+
+    if(flushInterval && (t+1)%flushInterval==0){
+      queue.flush();
+    }
 
-    queue.enqueueBarrierWithWaitList();
-		// All cells have now been calculated and placed in buffer, so we replace
-		// the old state with the new state
-		std::swap(buffState, buffBuffer);
-		// Swapping rather than assigning is cheaper: just a pointer swap
-		// rather than a memcpy, so O(1) rather than O(w*h)
-	
 		world.t += dt; // We have moved the world forwards in time
 		
 	} // end of for(t...
-  // copy the results back
-  std::vector<cl::Event> copyBackDependencies(1, evExecutedKernel);
-  queue.enqueueReadBuffer(
-      buffState,
-      CL_TRUE,
-      0,
-      cbBuffer,
-      &world.state[0],
-      &copyBackDependencies
-      );
+  double submitted = profiler.lap("submit");
+  HPCE_TRACE_NEXT(phase, "v4_double_buffered:readback");
+  profiler.attribute("submit_us_per_step", n ? 1e6*submitted/n : 0);
+
+  // copy the results back, which is in buffState after an even number
+  // of steps and in buffBuffer after an odd number
+  cl::Buffer &buffResult = (n%2==0) ? buffState : buffBuffer;
+  cl::Event evCopiedBack;
+  if(zeroCopy){
+    SyncHostBuffer(queue, buffResult, cbBuffer, outOfOrder ? &chain : NULL, &evCopiedBack);
+    queue.finish();
+    if(n%2==1){
+      // the result is already in scratch, so just take it over
+      std::swap(world.state, scratch);
+    }
+  }else{
+    queue.enqueueReadBuffer(
+        buffResult,
+        CL_TRUE,
+        0,
+        cbBuffer,
+        &world.state[0],
+        outOfOrder ? &chain : NULL,
+        &evCopiedBack
+        );
+  }
+  profiler.record("readback", "state", evCopiedBack);
+  profiler.lap("readback");
+
+  profiler.report();
 }
 
 }; // namespace yc12015
 }; // namepspace hpce
-
-int main(int argc, char *argv[])
-{
-	float dt=0.1;
-	unsigned n=1;
-	bool binary=false;
-	
-	if(argc>1){
-		dt=(float)strtod(argv[1], NULL);
-	}
-	if(argc>2){
-		n=atoi(argv[2]);
-	}
-	if(argc>3){
-		if(atoi(argv[3]))
-			binary=true;
-	}
-	
-	try{
-		hpce::world_t world=hpce::LoadWorld(std::cin);
-		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
-		
-		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<std::endl;
-		hpce::yc12015::StepWorldV4DoubleBuffered(world, dt, n);
-		
-		hpce::SaveWorld(std::cout, world, binary);
-	}catch(const std::exception &e){
-		std::cerr<<"Exception : "<<e.what()<<std::endl;
-		return 1;
-	}
-		
-	return 0;
-}
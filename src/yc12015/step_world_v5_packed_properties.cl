@@ -65,4 +65,39 @@ __kernel void kernel_xy(
 
 }
 
+// derives the packed properties from the raw ones, so only the raw
+// properties need to be uploaded
+__kernel void pack_properties(
+    __global const uint *props,
+    __global uint *packed
+    ){
+
+  uint x = get_global_id(0);
+  uint y = get_global_id(1);
+  uint w = get_global_size(0);
+
+  unsigned index=y*w + x;
+  uint thisProp = props[index];
+
+  if(!((thisProp & Cell_Fixed) || (thisProp & Cell_Insulator))){
+    // above
+    if(props[index-w] & Cell_Insulator){
+      thisProp |= (Cell_Insulator << 2);
+    }
+    // below
+    if(props[index+w] & Cell_Insulator){
+      thisProp |= (Cell_Insulator << 4);
+    }
+    // left
+    if(props[index-1] & Cell_Insulator){
+      thisProp |= (Cell_Insulator << 6);
+    }
+    // right
+    if(props[index+1] & Cell_Insulator){
+      thisProp |= (Cell_Insulator << 8);
+    }
+  }
+  packed[index] = thisProp;
+}
+
 // vim: ft=c:
@@ -0,0 +1,105 @@
+// per cell masks, computed on the host
+// bit 0: cell changes (neither fixed nor insulator)
+// bit 1: cell above conducts
+// bit 2: cell below conducts
+// bit 3: cell left conducts
+// bit 4: cell right conducts
+enum mask_bits_t{
+  Mask_Changes = 0x1,
+  Mask_Above   = 0x2,
+  Mask_Below   = 0x4,
+  Mask_Left    = 0x8,
+  Mask_Right   = 0x10
+};
+
+// state is stored in 16 bits, but everything is accumulated in fp32
+float update(
+    float inner, float outer, uchar m,
+    float here, float above, float below, float left, float right
+    ){
+  float contrib=inner;
+  float acc=inner*here;
+
+  // same order as the reference, adding zero for insulated neighbours
+  float wAbove = (m & Mask_Above) ? outer : 0.0f;
+  contrib += wAbove;
+  acc += wAbove * above;
+
+  float wBelow = (m & Mask_Below) ? outer : 0.0f;
+  contrib += wBelow;
+  acc += wBelow * below;
+
+  float wLeft = (m & Mask_Left) ? outer : 0.0f;
+  contrib += wLeft;
+  acc += wLeft * left;
+
+  float wRight = (m & Mask_Right) ? outer : 0.0f;
+  contrib += wRight;
+  acc += wRight * right;
+
+  float res=acc/contrib;
+  return min(1.0f, max(0.0f, res));
+}
+
+__kernel void step_fp16(
+    float inner,
+    float outer,
+    __global const uchar *masks,
+    __global const half *states,
+    __global half *buffer
+    ){
+
+  uint x = get_global_id(0);
+  uint y = get_global_id(1);
+  uint w = get_global_size(0);
+
+  unsigned index=y*w + x;
+  uchar m = masks[index];
+
+  float here = vload_half(index, states);
+  if(!(m & Mask_Changes)){
+    vstore_half(here, index, buffer);
+    return;
+  }
+
+  // neighbours are only read if they conduct, so edges are never overrun
+  float above = (m & Mask_Above) ? vload_half(index-w, states) : 0.0f;
+  float below = (m & Mask_Below) ? vload_half(index+w, states) : 0.0f;
+  float left = (m & Mask_Left) ? vload_half(index-1, states) : 0.0f;
+  float right = (m & Mask_Right) ? vload_half(index+1, states) : 0.0f;
+
+  vstore_half_rte(update(inner, outer, m, here, above, below, left, right), index, buffer);
+}
+
+__kernel void step_unorm16(
+    float inner,
+    float outer,
+    __global const uchar *masks,
+    __global const ushort *states,
+    __global ushort *buffer
+    ){
+
+  uint x = get_global_id(0);
+  uint y = get_global_id(1);
+  uint w = get_global_size(0);
+
+  unsigned index=y*w + x;
+  uchar m = masks[index];
+
+  if(!(m & Mask_Changes)){
+    buffer[index] = states[index];
+    return;
+  }
+
+  const float scale = 1.0f/65535.0f;
+  float here = states[index]*scale;
+  float above = (m & Mask_Above) ? states[index-w]*scale : 0.0f;
+  float below = (m & Mask_Below) ? states[index+w]*scale : 0.0f;
+  float left = (m & Mask_Left) ? states[index-1]*scale : 0.0f;
+  float right = (m & Mask_Right) ? states[index+1]*scale : 0.0f;
+
+  float res = update(inner, outer, m, here, above, below, left, right);
+  buffer[index] = convert_ushort_sat_rte(res*65535.0f);
+}
+
+// vim: ft=c:
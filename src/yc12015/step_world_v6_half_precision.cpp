@@ -0,0 +1,489 @@
+#include "heat.hpp"
+#include "heat_artefact_cache.hpp"
+#include "heat_parallel.hpp"
+#include "heat_trace.hpp"
+
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <cstdio>
+#include <string>
+#include <cstdlib>
+#include <fstream>
+#include <streambuf>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define YC12015_F16C_DISPATCH
+#endif
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#include "cl_common.hpp"
+#include "cl_profiler.hpp"
+
+namespace hpce{
+  namespace yc12015{
+
+typedef std::vector<uint16_t,aligned_allocator<uint16_t> > half_vector_t;
+
+// per cell masks, shared with step_world_v6_half_precision.cl
+enum mask_bits_t{
+  Mask_Changes = 0x1,  // neither fixed nor insulator
+  Mask_Above   = 0x2,  // cell above conducts
+  Mask_Below   = 0x4,
+  Mask_Left    = 0x8,
+  Mask_Right   = 0x10
+};
+
+//! Works out which neighbours each cell takes heat from
+/*! Unlike the reference, neighbours outside the world are treated as
+    insulators, so the masks can be trusted not to overrun the grid. */
+void BuildMasks(const world_t &world, uint8_t *masks)
+{
+  unsigned w=world.w, h=world.h;
+  ParallelForRange(0, h, [&](unsigned yBegin, unsigned yEnd){
+    for(unsigned y=yBegin; y<yEnd; y++){
+      for(unsigned x=0; x<w; x++){
+        unsigned index=y*w+x;
+        if(world.properties[index] & (Cell_Fixed|Cell_Insulator)){
+          masks[index]=0;
+          continue;
+        }
+        uint8_t m=Mask_Changes;
+        if(y>0 && !(world.properties[index-w] & Cell_Insulator))
+          m |= Mask_Above;
+        if(y+1<h && !(world.properties[index+w] & Cell_Insulator))
+          m |= Mask_Below;
+        if(x>0 && !(world.properties[index-1] & Cell_Insulator))
+          m |= Mask_Left;
+        if(x+1<w && !(world.properties[index+1] & Cell_Insulator))
+          m |= Mask_Right;
+        masks[index]=m;
+      }
+    }
+  }, 64);
+}
+
+//! IEEE half to float, handles denormals, infinities and NaNs
+inline float HalfToFloat(uint16_t h)
+{
+  const uint32_t shiftedExp = 0x7c00u << 13;
+  uint32_t o = (uint32_t)(h & 0x7fff) << 13;
+  uint32_t exp = shiftedExp & o;
+  o += (uint32_t)(127-15) << 23;
+  if(exp==shiftedExp){
+    o += (uint32_t)(128-16) << 23;   // infinity or NaN
+  }else if(exp==0){
+    // zero or denormal, renormalise through the FPU
+    const uint32_t magicBits = 113u << 23;
+    float magic, f;
+    o += 1u << 23;
+    memcpy(&magic, &magicBits, 4);
+    memcpy(&f, &o, 4);
+    f -= magic;
+    memcpy(&o, &f, 4);
+  }
+  o |= (uint32_t)(h & 0x8000) << 16;
+  float res;
+  memcpy(&res, &o, 4);
+  return res;
+}
+
+//! Float to IEEE half, rounding to nearest even like vstore_half_rte
+inline uint16_t FloatToHalf(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  uint32_t sign = x & 0x80000000u;
+  x ^= sign;
+
+  uint16_t o;
+  if(x >= (127u+16)<<23){
+    o = (x > 255u<<23) ? 0x7e00 : 0x7c00;  // NaN stays NaN, rest saturates to inf
+  }else if(x < 113u<<23){
+    // denormal result, let the FPU do the rounding
+    const uint32_t magicBits = ((127u-15)+(23-10)+1) << 23;
+    float magic, v;
+    memcpy(&magic, &magicBits, 4);
+    memcpy(&v, &x, 4);
+    v += magic;
+    memcpy(&x, &v, 4);
+    o = (uint16_t)(x - magicBits);
+  }else{
+    uint32_t mantOdd = (x >> 13) & 1;
+    x += 0xc8000fffu;  // rebias exponent by (15-127), plus rounding bias
+    x += mantOdd;
+    o = (uint16_t)(x >> 13);
+  }
+  return o | (uint16_t)(sign >> 16);
+}
+
+void DecodeHalfRow(const uint16_t *src, float *dst, unsigned n)
+{
+  for(unsigned i=0; i<n; i++){
+    dst[i]=HalfToFloat(src[i]);
+  }
+}
+
+void EncodeHalfRow(const float *src, uint16_t *dst, unsigned n)
+{
+  for(unsigned i=0; i<n; i++){
+    dst[i]=FloatToHalf(src[i]);
+  }
+}
+
+#ifdef YC12015_F16C_DISPATCH
+// Versions using the F16C conversion instructions, which are picked at run
+// time so the build doesn't need -mf16c
+__attribute__((target("avx,f16c")))
+void DecodeHalfRowF16C(const uint16_t *src, float *dst, unsigned n)
+{
+  unsigned i=0;
+  for(; i+8<=n; i+=8){
+    __m128i h = _mm_loadu_si128((const __m128i*)(src+i));
+    _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(h));
+  }
+  for(; i<n; i++){
+    dst[i]=HalfToFloat(src[i]);
+  }
+}
+
+__attribute__((target("avx,f16c")))
+void EncodeHalfRowF16C(const float *src, uint16_t *dst, unsigned n)
+{
+  unsigned i=0;
+  for(; i+8<=n; i+=8){
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(dst+i), h);
+  }
+  for(; i<n; i++){
+    dst[i]=FloatToHalf(src[i]);
+  }
+}
+#endif
+
+// unorm16 maps [0,1] onto [0,65535], simple enough to auto-vectorise
+void DecodeUnormRow(const uint16_t *src, float *dst, unsigned n)
+{
+  const float scale=1.0f/65535.0f;
+  for(unsigned i=0; i<n; i++){
+    dst[i]=src[i]*scale;
+  }
+}
+
+void EncodeUnormRow(const float *src, uint16_t *dst, unsigned n)
+{
+  for(unsigned i=0; i<n; i++){
+    float v=std::min(1.0f, std::max(0.0f, src[i]));
+    dst[i]=(uint16_t)(v*65535.0f+0.5f);
+  }
+}
+
+//! How state is squeezed into 16 bits per cell
+struct half_codec_t{
+  std::string name;    // "fp16" or "unorm16"
+  std::string kernel;  // matching kernel in step_world_v6_half_precision.cl
+  void (*decode)(const uint16_t *src, float *dst, unsigned n);
+  void (*encode)(const float *src, uint16_t *dst, unsigned n);
+};
+
+//! Picks the storage format from HPCE_HALF_FORMAT, defaulting to fp16
+half_codec_t SelectCodec()
+{
+  const char *v = getenv("HPCE_HALF_FORMAT");
+  std::string format = v ? v : "fp16";
+  half_codec_t codec;
+  if(format=="fp16"){
+    codec.name="fp16";
+    codec.kernel="step_fp16";
+    codec.decode=DecodeHalfRow;
+    codec.encode=EncodeHalfRow;
+#ifdef YC12015_F16C_DISPATCH
+    if(__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")){
+      codec.decode=DecodeHalfRowF16C;
+      codec.encode=EncodeHalfRowF16C;
+    }
+#endif
+  }else if(format=="unorm16"){
+    codec.name="unorm16";
+    codec.kernel="step_unorm16";
+    codec.decode=DecodeUnormRow;
+    codec.encode=EncodeUnormRow;
+  }else{
+    throw std::invalid_argument("SelectCodec: HPCE_HALF_FORMAT must be fp16 or unorm16.");
+  }
+  return codec;
+}
+
+//! One row of the stencil, all in fp32
+/*! above, here and below must be readable from index -1 to w, though
+    only cells whose masks say they conduct contribute. */
+inline void StepRow(unsigned w, float inner, float outer, const uint8_t *masks,
+    const float *above, const float *here, const float *below, float *out)
+{
+  const float *left=here-1, *right=here+1;
+  for(unsigned x=0; x<w; x++){
+    uint8_t m=masks[x];
+    float contrib=inner;
+    float acc=inner*here[x];
+
+    // adding zero for an insulated neighbour leaves acc and contrib exactly
+    // as the reference's branches would, but keeps the loop branch free
+    float wAbove = (m & Mask_Above) ? outer : 0.0f;
+    contrib += wAbove;
+    acc += wAbove * above[x];
+
+    float wBelow = (m & Mask_Below) ? outer : 0.0f;
+    contrib += wBelow;
+    acc += wBelow * below[x];
+
+    float wLeft = (m & Mask_Left) ? outer : 0.0f;
+    contrib += wLeft;
+    acc += wLeft * left[x];
+
+    float wRight = (m & Mask_Right) ? outer : 0.0f;
+    contrib += wRight;
+    acc += wRight * right[x];
+
+    float res=acc/contrib;
+    res=std::min(1.0f, std::max(0.0f, res));
+    out[x] = (m & Mask_Changes) ? res : here[x];
+  }
+}
+
+//! Steps 16-bit state on the CPU, with rows split across threads
+void StepHalfCpu(const half_codec_t &codec, const world_t &world, const uint8_t *masks,
+    half_vector_t &state, float dt, unsigned n)
+{
+  unsigned w=world.w, h=world.h;
+
+	float outer=world.alpha*dt;		// We spread alpha to other cells per time
+	float inner=1-outer/4;				// Anything that doesn't spread stays
+
+  half_vector_t buffer(w*h);
+  const uint16_t *src=&state[0];
+  uint16_t *dst=&buffer[0];
+
+  // the threads are started once, and swap buffers between steps
+  ParallelForSteps(0, h, n, [&](unsigned /*t*/, unsigned yBegin, unsigned yEnd){
+    // Each row is decoded once into a ring of three, padded by a cell
+    // either side so that x-1 and x+1 never need checking. A thread keeps
+    // its ring for every step, and the padding is never written, so it
+    // stays zero
+    static thread_local std::vector<float> rows, out;
+    if(rows.size()!=3*(w+2)){
+      rows.assign(3*(w+2), 0.0f);
+      out.resize(w);
+    }
+    float *above=&rows[1], *here=&rows[w+3], *below=&rows[2*w+5];
+
+    if(yBegin>0){
+      codec.decode(src+(yBegin-1)*w, above, w);
+    }
+    codec.decode(src+yBegin*w, here, w);
+
+    for(unsigned y=yBegin; y<yEnd; y++){
+      if(y+1<h){
+        codec.decode(src+(y+1)*w, below, w);
+      }
+      StepRow(w, inner, outer, &masks[y*w], above, here, below, &out[0]);
+      codec.encode(&out[0], dst+y*w, w);
+
+      float *tmp=above;
+      above=here;
+      here=below;
+      below=tmp;
+    }
+  }, [&](unsigned /*t*/){
+		std::swap(state, buffer);
+    src=&state[0];
+    dst=&buffer[0];
+  }, 16);
+}
+
+//! Steps 16-bit state with the kernels in step_world_v6_half_precision.cl
+void StepHalfOpenCL(const half_codec_t &codec, const world_t &world, const uint8_t *masks,
+    half_vector_t &state, float dt, unsigned n)
+{
+  HPCE_TRACE_PHASE(phase, "v6_half_precision:setup");
+  ClProfiler profiler("v6_half_precision_"+codec.name);
+  profiler.attribute("w", world.w);
+  profiler.attribute("h", world.h);
+  profiler.attribute("n", n);
+
+  std::vector<cl::Device> devices;
+  cl::Device device = SelectDevice(devices);
+  profiler.lap("select_device");
+
+  // create context
+  cl::Context context(devices);
+  profiler.lap("create_context");
+  //--------------------
+  // build cl program
+  cl::Program program = BuildProgram(context, devices, "step_world_v6_half_precision.cl");
+  profiler.lap("build_program");
+
+	unsigned w=world.w, h=world.h;
+
+	float outer=world.alpha*dt;		// We spread alpha to other cells per time
+	float inner=1-outer/4;				// Anything that doesn't spread stays
+
+  // ----------------
+  // allocate buffers, half the size of the fp32 engines' state buffers
+  size_t cbState = 2*w*h;
+  cl::Buffer buffMasks(context, CL_MEM_READ_ONLY, w*h);
+  cl::Buffer buffState(context, CL_MEM_READ_WRITE, cbState);
+  cl::Buffer buffBuffer(context, CL_MEM_READ_WRITE, cbState);
+
+  // ping steps state into buffer, pong steps it back
+  cl::Kernel kernelPing(program, codec.kernel.c_str());
+  kernelPing.setArg(0, inner);
+  kernelPing.setArg(1, outer);
+  kernelPing.setArg(2, buffMasks);
+  kernelPing.setArg(3, buffState);
+  kernelPing.setArg(4, buffBuffer);
+
+  cl::Kernel kernelPong(program, codec.kernel.c_str());
+  kernelPong.setArg(0, inner);
+  kernelPong.setArg(1, outer);
+  kernelPong.setArg(2, buffMasks);
+  kernelPong.setArg(3, buffBuffer);
+  kernelPong.setArg(4, buffState);
+
+  cl::CommandQueue queue(context, device, profiler.queueProperties());
+  profiler.lap("create_queue");
+  HPCE_TRACE_NEXT(phase, "v6_half_precision:upload");
+
+  const char *f = getenv("HPCE_CL_FLUSH_INTERVAL");
+  unsigned flushInterval = f? atoi(f): 64;
+
+  cl::Event evCopiedMasks, evCopiedState;
+  queue.enqueueWriteBuffer(buffMasks, CL_FALSE, 0, w*h, &masks[0], NULL, &evCopiedMasks);
+  profiler.record("upload", "masks", evCopiedMasks);
+  queue.enqueueWriteBuffer(buffState, CL_FALSE, 0, cbState, &state[0], NULL, &evCopiedState);
+  profiler.record("upload", "state", evCopiedState);
+  profiler.lap("upload");
+  HPCE_TRACE_NEXT(phase, "v6_half_precision:step");
+
+  cl::NDRange offset(0, 0);
+  cl::NDRange globalSize(w, h);
+  cl::NDRange localSize = cl::NullRange;
+
+  cl::Event evExecutedKernel;
+	for(unsigned t=0;t<n;t++){
+    queue.enqueueNDRangeKernel(
+        (t%2==0) ? kernelPing : kernelPong,
+        offset,
+        globalSize,
+        localSize,
+        NULL,
+        profiler.enabled() ? &evExecutedKernel : NULL
+        );
+    if(profiler.enabled()){
+      profiler.record("step", codec.kernel.c_str(), evExecutedKernel);
+    }
+    if(flushInterval && (t+1)%flushInterval==0){
+      queue.flush();
+    }
+  }
+  profiler.lap("submit");
+  HPCE_TRACE_NEXT(phase, "v6_half_precision:readback");
+
+  cl::Event evCopiedBack;
+  queue.enqueueReadBuffer(
+      (n%2==0) ? buffState : buffBuffer,
+      CL_TRUE,
+      0,
+      cbState,
+      &state[0],
+      NULL,
+      &evCopiedBack
+      );
+  profiler.record("readback", "state", evCopiedBack);
+  profiler.lap("readback");
+
+  profiler.report();
+}
+
+//! Compares a 16-bit run against the fp32 reference and reports on stderr
+void ReportAccuracy(const std::string &format, const world_t &reference, const world_t &world)
+{
+  double maxAbs=0, sumSq=0, sumAbs=0;
+  unsigned worst=0;
+  for(unsigned i=0; i<world.state.size(); i++){
+    double d=std::abs((double)world.state[i]-(double)reference.state[i]);
+    sumAbs += d;
+    sumSq += d*d;
+    if(d>maxAbs){
+      maxAbs=d;
+      worst=i;
+    }
+  }
+  unsigned cells=world.state.size();
+  std::cerr<<"{\"format\": \""<<format<<"\""
+    <<", \"cells\": "<<cells
+    <<", \"max_abs_error\": "<<maxAbs
+    <<", \"mean_abs_error\": "<<(cells ? sumAbs/cells : 0)
+    <<", \"rms_error\": "<<(cells ? std::sqrt(sumSq/cells) : 0)
+    <<", \"worst_x\": "<<(world.w ? worst%world.w : 0)
+    <<", \"worst_y\": "<<(world.w ? worst/world.w : 0)
+    <<"}"<<std::endl;
+}
+
+//! Steps the world with state stored as 16 bits per cell
+/*! \param dt Amount to step the world by.  Note that large steps will be unstable.
+	\param n Number of times to step the world
+	\note Overall time increment will be n*dt
+
+  State is always in [0,1], so it is stored as fp16 or unorm16 (chosen by
+  HPCE_HALF_FORMAT) and only widened to fp32 inside the stencil, halving
+  the memory traffic of the state. HPCE_HALF_DEVICE=opencl runs the
+  stencil as OpenCL kernels, otherwise it runs on the CPU. Setting
+  HPCE_HALF_ACCURACY=1 also runs the fp32 reference and reports the error.
+*/
+void StepWorldV6HalfPrecision(world_t &world, float dt, unsigned n)
+{
+  HPCE_TRACE_PHASE(phase, "v6_half_precision:setup");
+  half_codec_t codec=SelectCodec();
+  const char *d = getenv("HPCE_HALF_DEVICE");
+  bool useOpenCL = d && std::string(d)=="opencl";
+
+  const char *a = getenv("HPCE_HALF_ACCURACY");
+  std::unique_ptr<world_t> reference;
+  if(a && atoi(a)){
+    reference.reset(new world_t(world));
+    StepWorld(*reference, dt, n);
+  }
+
+  unsigned w=world.w, h=world.h;
+  GeometryArtefact masks=GetGeometryArtefact(world, "v6_masks", 1, (size_t)w*h,
+    [&](uint8_t *dst){ BuildMasks(world, dst); });
+
+  half_vector_t state(w*h);
+  codec.encode(&world.state[0], &state[0], w*h);
+
+  HPCE_TRACE_NEXT(phase, "v6_half_precision:step");
+  if(useOpenCL){
+    StepHalfOpenCL(codec, world, masks.data(), state, dt, n);
+  }else{
+    StepHalfCpu(codec, world, masks.data(), state, dt, n);
+  }
+
+  HPCE_TRACE_NEXT(phase, "v6_half_precision:decode");
+  codec.decode(&state[0], &world.state[0], w*h);
+	for(unsigned t=0;t<n;t++){
+		world.t += dt; // same accumulation as the reference
+	}
+
+  if(reference){
+    ReportAccuracy(codec.name, *reference, world);
+  }
+}
+
+}; // namespace yc12015
+}; // namepspace hpce